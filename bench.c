@@ -0,0 +1,435 @@
+#include "bench.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REC_FLAG_DROPPED    1
+#define REC_FLAG_DISCARDED  2
+
+typedef struct bench_rec_s {
+    int64_t t[BENCH_STAGE_COUNT];   // 0 = not reached
+    unsigned int flags;
+} bench_rec_t;
+
+typedef struct bench_run_s {
+    bench_rec_t * recs;
+    uint32_t n;
+    uint32_t size;
+} bench_run_t;
+
+struct bench_s {
+    pthread_mutex_t lock;
+    clockid_t clock_id;
+    unsigned int warmup;
+
+    bench_run_t * runs;
+    unsigned int run_count;
+    unsigned int run_size;
+};
+
+// Intervals reported - each is from one stage stamp to another
+static const struct {
+    const char * name;
+    bench_stage_t from;
+    bench_stage_t to;
+} intervals[] = {
+    {"arrive_to_receive",        BENCH_STAGE_ARRIVE,        BENCH_STAGE_RECEIVE},
+    {"receive_to_display_queue", BENCH_STAGE_RECEIVE,       BENCH_STAGE_DISPLAY_QUEUE},
+    {"display_queue_to_attach",  BENCH_STAGE_DISPLAY_QUEUE, BENCH_STAGE_ATTACH},
+    {"attach_to_commit",         BENCH_STAGE_ATTACH,        BENCH_STAGE_COMMIT},
+    {"commit_to_presented",      BENCH_STAGE_COMMIT,        BENCH_STAGE_PRESENTED},
+    {"presented_to_released",    BENCH_STAGE_PRESENTED,     BENCH_STAGE_RELEASED},
+    {"arrive_to_presented",      BENCH_STAGE_ARRIVE,        BENCH_STAGE_PRESENTED},
+    {"receive_to_presented",     BENCH_STAGE_RECEIVE,       BENCH_STAGE_PRESENTED},
+};
+#define INTERVAL_COUNT (sizeof(intervals)/sizeof(intervals[0]))
+#define INTERVAL_TOTAL (INTERVAL_COUNT - 1)
+#define INTERVAL_ARRIVE_TOTAL (INTERVAL_COUNT - 2)
+
+typedef struct interval_stats_s {
+    size_t count;
+    int64_t p50;
+    int64_t p95;
+    int64_t p99;
+    int64_t max;
+} interval_stats_t;
+
+typedef struct run_stats_s {
+    unsigned int received;
+    unsigned int displayed;
+    unsigned int presented;
+    unsigned int discarded;
+    unsigned int dropped;
+    double duration;        // Seconds from first receive to last presented
+    double decode_fps;
+    double present_fps;
+    interval_stats_t ivs[INTERVAL_COUNT];
+} run_stats_t;
+
+static int64_t
+time_ns(const clockid_t clock_id)
+{
+    struct timespec ts = {0,0};
+    clock_gettime(clock_id, &ts);
+    return (int64_t)ts.tv_nsec + (int64_t)ts.tv_sec * 1000000000;
+}
+
+// Call with lock held
+static bench_rec_t *
+rec_get(bench_t * const b, const uint64_t tag)
+{
+    const uint32_t run = (uint32_t)(tag >> 32);
+    const uint32_t seq = (uint32_t)tag;
+
+    if (run == 0 || run > b->run_count || seq == 0 || seq > b->runs[run - 1].n)
+        return NULL;
+    return b->runs[run - 1].recs + seq - 1;
+}
+
+uint64_t
+bench_frame_new(bench_t * const b)
+{
+    const int64_t now = b == NULL ? 0 : time_ns(b->clock_id);
+    bench_run_t * run;
+    uint64_t tag = 0;
+
+    if (b == NULL)
+        return 0;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->run_count == 0)
+        goto unlock;
+    run = b->runs + b->run_count - 1;
+
+    if (run->n >= run->size) {
+        const uint32_t size = run->size == 0 ? 1024 : run->size * 2;
+        bench_rec_t * const recs = realloc(run->recs, size * sizeof(*recs));
+        if (recs == NULL)
+            goto unlock;
+        run->recs = recs;
+        run->size = size;
+    }
+
+    memset(run->recs + run->n, 0, sizeof(run->recs[0]));
+    run->recs[run->n].t[BENCH_STAGE_RECEIVE] = now;
+    tag = ((uint64_t)b->run_count << 32) | ++run->n;
+
+unlock:
+    pthread_mutex_unlock(&b->lock);
+    return tag;
+}
+
+void
+bench_stamp(bench_t * const b, const uint64_t tag, const bench_stage_t stage, int64_t t_ns)
+{
+    bench_rec_t * rec;
+
+    if (b == NULL || tag == 0)
+        return;
+    if (t_ns == 0)
+        t_ns = time_ns(b->clock_id);
+
+    pthread_mutex_lock(&b->lock);
+    // Keep the first stamp - a frame may be (re)committed more than once
+    if ((rec = rec_get(b, tag)) != NULL && rec->t[stage] == 0)
+        rec->t[stage] = t_ns;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void
+rec_flag_set(bench_t * const b, const uint64_t tag, const unsigned int flag)
+{
+    bench_rec_t * rec;
+
+    if (b == NULL || tag == 0)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    if ((rec = rec_get(b, tag)) != NULL)
+        rec->flags |= flag;
+    pthread_mutex_unlock(&b->lock);
+}
+
+void
+bench_drop(bench_t * const b, const uint64_t tag)
+{
+    rec_flag_set(b, tag, REC_FLAG_DROPPED);
+}
+
+void
+bench_discard(bench_t * const b, const uint64_t tag)
+{
+    rec_flag_set(b, tag, REC_FLAG_DISCARDED);
+}
+
+void
+bench_run_start(bench_t * const b)
+{
+    if (b == NULL)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->run_count >= b->run_size) {
+        const unsigned int size = b->run_size == 0 ? 4 : b->run_size * 2;
+        bench_run_t * const runs = realloc(b->runs, size * sizeof(*runs));
+        if (runs == NULL)
+            goto unlock;
+        b->runs = runs;
+        b->run_size = size;
+    }
+    b->runs[b->run_count++] = (bench_run_t){.recs = NULL};
+unlock:
+    pthread_mutex_unlock(&b->lock);
+}
+
+//----------------------------------------------------------------------------
+//
+// Reporting
+
+static int
+cmp_int64(const void * va, const void * vb)
+{
+    const int64_t a = *(const int64_t *)va;
+    const int64_t b = *(const int64_t *)vb;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Nearest rank percentile of sorted v
+static int64_t
+percentile(const int64_t * const v, const size_t n, const unsigned int pc)
+{
+    size_t i = (n * pc + 99) / 100;
+    return v[i == 0 ? 0 : i - 1];
+}
+
+static void
+run_stats_calc(const bench_t * const b, const bench_run_t * const run, run_stats_t * const rs, int64_t * const tmp)
+{
+    int64_t t_first = 0;
+    int64_t t_last_rx = 0;
+    int64_t t_last_pres = 0;
+    unsigned int i;
+    uint32_t j;
+
+    memset(rs, 0, sizeof(*rs));
+
+    for (j = b->warmup; j < run->n; ++j) {
+        const bench_rec_t * const rec = run->recs + j;
+
+        ++rs->received;
+        if (rec->t[BENCH_STAGE_DISPLAY_QUEUE] != 0)
+            ++rs->displayed;
+        if (rec->t[BENCH_STAGE_PRESENTED] != 0)
+            ++rs->presented;
+        if ((rec->flags & REC_FLAG_DISCARDED) != 0)
+            ++rs->discarded;
+        if ((rec->flags & REC_FLAG_DROPPED) != 0 || rec->t[BENCH_STAGE_DISPLAY_QUEUE] == 0)
+            ++rs->dropped;
+
+        if (t_first == 0)
+            t_first = rec->t[BENCH_STAGE_RECEIVE];
+        t_last_rx = rec->t[BENCH_STAGE_RECEIVE];
+        if (rec->t[BENCH_STAGE_PRESENTED] > t_last_pres)
+            t_last_pres = rec->t[BENCH_STAGE_PRESENTED];
+    }
+
+    if (rs->received > 1 && t_last_rx > t_first)
+        rs->decode_fps = (rs->received - 1) * 1e9 / (t_last_rx - t_first);
+    if (rs->presented > 1 && t_last_pres > t_first) {
+        rs->duration = (t_last_pres - t_first) / 1e9;
+        rs->present_fps = (rs->presented - 1) / rs->duration;
+    }
+
+    for (i = 0; i != INTERVAL_COUNT; ++i) {
+        interval_stats_t * const is = rs->ivs + i;
+        size_t n = 0;
+
+        for (j = b->warmup; j < run->n; ++j) {
+            const bench_rec_t * const rec = run->recs + j;
+            const int64_t t0 = rec->t[intervals[i].from];
+            const int64_t t1 = rec->t[intervals[i].to];
+            if (t0 != 0 && t1 != 0)
+                tmp[n++] = t1 - t0;
+        }
+        if (n == 0)
+            continue;
+
+        qsort(tmp, n, sizeof(*tmp), cmp_int64);
+        is->count = n;
+        is->p50 = percentile(tmp, n, 50);
+        is->p95 = percentile(tmp, n, 95);
+        is->p99 = percentile(tmp, n, 99);
+        is->max = tmp[n - 1];
+    }
+}
+
+static void
+summary_json(FILE * const f, const char * const name, const double * const v, const unsigned int n, const bool last)
+{
+    double sum = 0, sum2 = 0;
+    double vmin = n == 0 ? 0 : v[0];
+    double vmax = vmin;
+    double mean, sd;
+    unsigned int i;
+
+    for (i = 0; i != n; ++i) {
+        sum += v[i];
+        sum2 += v[i] * v[i];
+        if (v[i] < vmin)
+            vmin = v[i];
+        if (v[i] > vmax)
+            vmax = v[i];
+    }
+    mean = n == 0 ? 0 : sum / n;
+    sd = n < 2 ? 0 : sqrt(fmax(0, (sum2 - n * mean * mean) / (n - 1)));
+
+    fprintf(f, "    \"%s\": {\"mean\": %.3f, \"stddev\": %.3f, \"min\": %.3f, \"max\": %.3f}%s\n",
+            name, mean, sd, vmin, vmax, last ? "" : ",");
+}
+
+int
+bench_report_json(bench_t * const b, FILE * const f)
+{
+    run_stats_t * rss = NULL;
+    int64_t * tmp = NULL;
+    double * vals = NULL;
+    uint32_t max_n = 0;
+    unsigned int i, k;
+    int rv = -1;
+
+    if (b == NULL)
+        return 0;
+
+    pthread_mutex_lock(&b->lock);
+
+    for (i = 0; i != b->run_count; ++i) {
+        if (b->runs[i].n > max_n)
+            max_n = b->runs[i].n;
+    }
+    if ((rss = calloc(b->run_count + 1, sizeof(*rss))) == NULL ||
+        (tmp = malloc((max_n + 1) * sizeof(*tmp))) == NULL ||
+        (vals = malloc((b->run_count + 1) * sizeof(*vals))) == NULL)
+        goto fail;
+
+    fprintf(f, "{\n  \"warmup_frames\": %u,\n  \"runs\": [\n", b->warmup);
+    for (i = 0; i != b->run_count; ++i) {
+        run_stats_t * const rs = rss + i;
+
+        run_stats_calc(b, b->runs + i, rs, tmp);
+
+        fprintf(f, "    {\n");
+        fprintf(f, "      \"received\": %u, \"displayed\": %u, \"presented\": %u, \"discarded\": %u, \"dropped\": %u,\n",
+                rs->received, rs->displayed, rs->presented, rs->discarded, rs->dropped);
+        fprintf(f, "      \"duration_s\": %.3f, \"decode_fps\": %.3f, \"present_fps\": %.3f,\n",
+                rs->duration, rs->decode_fps, rs->present_fps);
+        fprintf(f, "      \"latency_ms\": {\n");
+        for (k = 0; k != INTERVAL_COUNT; ++k) {
+            const interval_stats_t * const is = rs->ivs + k;
+            fprintf(f, "        \"%s\": {\"count\": %zu, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+                    intervals[k].name, is->count,
+                    is->p50 / 1e6, is->p95 / 1e6, is->p99 / 1e6, is->max / 1e6,
+                    k + 1 == INTERVAL_COUNT ? "" : ",");
+        }
+        fprintf(f, "      }\n    }%s\n", i + 1 == b->run_count ? "" : ",");
+    }
+    fprintf(f, "  ],\n  \"summary\": {\n    \"repeats\": %u,\n", b->run_count);
+
+    for (i = 0; i != b->run_count; ++i)
+        vals[i] = rss[i].decode_fps;
+    summary_json(f, "decode_fps", vals, b->run_count, false);
+    for (i = 0; i != b->run_count; ++i)
+        vals[i] = rss[i].present_fps;
+    summary_json(f, "present_fps", vals, b->run_count, false);
+    for (i = 0; i != b->run_count; ++i)
+        vals[i] = rss[i].ivs[INTERVAL_TOTAL].p50 / 1e6;
+    summary_json(f, "receive_to_presented_p50_ms", vals, b->run_count, false);
+    for (i = 0; i != b->run_count; ++i)
+        vals[i] = rss[i].ivs[INTERVAL_TOTAL].p99 / 1e6;
+    summary_json(f, "receive_to_presented_p99_ms", vals, b->run_count, false);
+    for (i = 0; i != b->run_count; ++i)
+        vals[i] = rss[i].ivs[INTERVAL_ARRIVE_TOTAL].p50 / 1e6;
+    summary_json(f, "arrive_to_presented_p50_ms", vals, b->run_count, false);
+    for (i = 0; i != b->run_count; ++i)
+        vals[i] = rss[i].dropped + rss[i].discarded;
+    summary_json(f, "dropped_plus_discarded", vals, b->run_count, true);
+    fprintf(f, "  }\n}\n");
+    fflush(f);
+    rv = 0;
+
+fail:
+    pthread_mutex_unlock(&b->lock);
+    free(vals);
+    free(tmp);
+    free(rss);
+    return rv;
+}
+
+int
+bench_summary_get(bench_t * const b, bench_summary_t * const bs)
+{
+    const bench_run_t * run;
+    run_stats_t rs;
+    int64_t * tmp;
+
+    memset(bs, 0, sizeof(*bs));
+    if (b == NULL)
+        return 0;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->run_count == 0)
+        goto unlock;
+    run = b->runs + b->run_count - 1;
+    if ((tmp = malloc((run->n + 1) * sizeof(*tmp))) == NULL) {
+        pthread_mutex_unlock(&b->lock);
+        return -1;
+    }
+
+    run_stats_calc(b, run, &rs, tmp);
+    free(tmp);
+
+    bs->received = rs.received;
+    bs->presented = rs.presented;
+    bs->dropped = rs.dropped;
+    bs->discarded = rs.discarded;
+    bs->present_fps = rs.present_fps;
+    bs->latency_p50_ns = rs.ivs[INTERVAL_TOTAL].p50;
+    bs->latency_p99_ns = rs.ivs[INTERVAL_TOTAL].p99;
+unlock:
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+void
+bench_delete(bench_t ** const ppb)
+{
+    bench_t * const b = *ppb;
+    unsigned int i;
+
+    if (b == NULL)
+        return;
+    *ppb = NULL;
+
+    for (i = 0; i != b->run_count; ++i)
+        free(b->runs[i].recs);
+    free(b->runs);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+}
+
+bench_t *
+bench_new(const clockid_t clock_id, const unsigned int warmup)
+{
+    bench_t * const b = calloc(1, sizeof(*b));
+
+    if (b == NULL)
+        return NULL;
+
+    pthread_mutex_init(&b->lock, NULL);
+    b->clock_id = clock_id;
+    b->warmup = warmup;
+    return b;
+}
+
@@ -0,0 +1,69 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-frame pipeline timing for --bench
+// Each frame gets a tag when it is received from the decoder which then
+// follows it through the pipeline. Any thread can stamp a stage for a tag.
+// Tag 0 is "not tracked" and is ignored by everything.
+
+typedef enum bench_stage_e {
+    BENCH_STAGE_ARRIVE = 0,     // Packet that carried the frame read by demux
+    BENCH_STAGE_RECEIVE,        // Frame received from decoder
+    BENCH_STAGE_DISPLAY_QUEUE,  // Handed to the display
+    BENCH_STAGE_ATTACH,         // Attached to the surface
+    BENCH_STAGE_COMMIT,         // Surface committed
+    BENCH_STAGE_PRESENTED,      // Presentation feedback - on screen
+    BENCH_STAGE_RELEASED,       // Buffer released by the compositor
+    BENCH_STAGE_COUNT
+} bench_stage_t;
+
+struct bench_s;
+typedef struct bench_s bench_t;
+
+// All times are ns in clock_id (should be the presentation clock)
+// The first warmup frames of each run are excluded from the stats
+bench_t * bench_new(const clockid_t clock_id, const unsigned int warmup);
+void bench_delete(bench_t ** const ppb);
+
+// Start a new run - subsequent tags belong to it
+void bench_run_start(bench_t * const b);
+
+// Allocate a tag for a new frame & stamp it as received
+uint64_t bench_frame_new(bench_t * const b);
+// t_ns == 0 => now
+void bench_stamp(bench_t * const b, const uint64_t tag, const bench_stage_t stage, int64_t t_ns);
+// Dropped before reaching the compositor
+void bench_drop(bench_t * const b, const uint64_t tag);
+// Discarded by the compositor (never presented)
+void bench_discard(bench_t * const b, const uint64_t tag);
+
+typedef struct bench_summary_s {
+    unsigned int received;
+    unsigned int presented;
+    unsigned int dropped;
+    unsigned int discarded;
+    double present_fps;
+    int64_t latency_p50_ns;     // Receive to presented
+    int64_t latency_p99_ns;
+} bench_summary_t;
+
+// Summary of the latest run (all 0 if none)
+int bench_summary_get(bench_t * const b, bench_summary_t * const bs);
+
+// Write JSON report of all runs + summary
+int bench_report_json(bench_t * const b, FILE * const f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,145 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#define CRC32C_POLY 0x82f63b78  // Reversed
+
+typedef uint32_t (* crc_fn_t)(uint32_t crc, const uint8_t * p, size_t len);
+
+static uint32_t crc_table[8][256];
+static crc_fn_t crc_fn;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+crc_sw(uint32_t crc, const uint8_t * p, size_t len)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len != 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --len;
+    }
+    // Slice by 8
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc_table[7][v & 0xff] ^
+            crc_table[6][(v >> 8) & 0xff] ^
+            crc_table[5][(v >> 16) & 0xff] ^
+            crc_table[4][(v >> 24) & 0xff] ^
+            crc_table[3][(v >> 32) & 0xff] ^
+            crc_table[2][(v >> 40) & 0xff] ^
+            crc_table[1][(v >> 48) & 0xff] ^
+            crc_table[0][v >> 56];
+    }
+#endif
+    while (len-- != 0)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAS_CRC_HW 1
+__attribute__((target("sse4.2")))
+static uint32_t
+crc_hw(uint32_t crc, const uint8_t * p, size_t len)
+{
+    uint64_t c;
+
+    while (len != 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        --len;
+    }
+    c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = (uint32_t)c;
+    while (len-- != 0)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+
+static bool
+crc_hw_present(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#define HAS_CRC_HW 1
+#if defined(__clang__)
+#define CRC32CB __builtin_arm_crc32cb
+#define CRC32CX __builtin_arm_crc32cd
+#else
+#define CRC32CB __builtin_aarch64_crc32cb
+#define CRC32CX __builtin_aarch64_crc32cx
+#endif
+
+__attribute__((target("+crc")))
+static uint32_t
+crc_hw(uint32_t crc, const uint8_t * p, size_t len)
+{
+    while (len != 0 && ((uintptr_t)p & 7) != 0) {
+        crc = CRC32CB(crc, *p++);
+        --len;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = CRC32CX(crc, v);
+    }
+    while (len-- != 0)
+        crc = CRC32CB(crc, *p++);
+    return crc;
+}
+
+static bool
+crc_hw_present(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static void
+crc_init(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i != 256; ++i) {
+        uint32_t c = i;
+        for (j = 0; j != 8; ++j)
+            c = (c >> 1) ^ ((c & 1) != 0 ? CRC32C_POLY : 0);
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i != 256; ++i) {
+        for (j = 1; j != 8; ++j)
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+    }
+
+    crc_fn = crc_sw;
+#if HAS_CRC_HW
+    if (crc_hw_present())
+        crc_fn = crc_hw;
+#endif
+}
+
+uint32_t
+crc32c(uint32_t crc, const void * const buf, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+    return ~crc_fn(~crc, buf, len);
+}
+
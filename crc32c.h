@@ -0,0 +1,24 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CRC-32C (Castagnoli)
+// Uses the CPU's crc32c instructions (SSE4.2 or ARMv8 CRC) if it has them,
+// otherwise slice-by-8 tables. Chosen at runtime on first use so no special
+// build flags are needed.
+
+// Start with crc = 0, feed the result back in to continue
+uint32_t crc32c(uint32_t crc, const void * const buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -1,6 +1,7 @@
 #include "dmabuf_pool.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -94,15 +95,67 @@ dmabuf_pool_kill(dmabuf_pool_t ** const pppool)
     generic_pool_kill(&pool);
 }
 
+static struct dmabuf_h *
+pool_fb_claim(dmabuf_pool_t * const pool, struct dmabuf_h * const dh)
+{
+    if (dh != NULL)
+        dmabuf_predel_cb_set(dh, dumb_predel_cb, dmabuf_pool_ref(pool));
+    return dh;
+}
+
 struct dmabuf_h *
 dmabuf_pool_fb_new(dmabuf_pool_t * const pool, size_t size)
 {
-    struct dmabuf_h * const dh = generic_pool_get(gp(pool), size);
-    if (dh == NULL)
-        return NULL;
+    return pool_fb_claim(pool, generic_pool_get(gp(pool), size));
+}
+
+struct dmabuf_h *
+dmabuf_pool_fb_new_wait(dmabuf_pool_t * const pool, size_t size, const int timeout_ms)
+{
+    return pool_fb_claim(pool, generic_pool_get_timeout(gp(pool), timeout_ms, size));
+}
 
-    dmabuf_predel_cb_set(dh, dumb_predel_cb, dmabuf_pool_ref(pool));
-    return dh;
+typedef struct fb_new_async_s {
+    dmabuf_pool_t * pool;
+    size_t size;
+    dmabuf_pool_fb_new_fn fn;
+    void * v;
+} fb_new_async_t;
+
+static bool
+fb_new_async_cb(void * v, bool killed)
+{
+    fb_new_async_t * const fna = v;
+    struct dmabuf_h * dh = NULL;
+
+    if (!killed && (dh = dmabuf_pool_fb_new(fna->pool, fna->size)) == NULL)
+        return false;
+
+    fna->fn(fna->v, dh);
+    dmabuf_pool_unref(&fna->pool);
+    free(fna);
+    return true;
+}
+
+int
+dmabuf_pool_fb_new_async(dmabuf_pool_t * const pool, size_t size, const dmabuf_pool_fb_new_fn fn, void * const v)
+{
+    fb_new_async_t * const fna = malloc(sizeof(*fna));
+    int rv;
+
+    if (fna == NULL)
+        return -ENOMEM;
+    *fna = (fb_new_async_t){
+        .pool = dmabuf_pool_ref(pool),
+        .size = size,
+        .fn = fn,
+        .v = v
+    };
+    if ((rv = generic_pool_on_put_add(gp(pool), fb_new_async_cb, fna)) != 0) {
+        dmabuf_pool_unref(&fna->pool);
+        free(fna);
+    }
+    return rv;
 }
 
 void
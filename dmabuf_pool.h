@@ -23,6 +23,16 @@ dmabuf_pool_t * dmabuf_pool_ref(dmabuf_pool_t * const pool);
 // Allocations need not be all of the same size but no guarantees are made about
 // efficient memory use if this is the case
 struct dmabuf_h * dmabuf_pool_fb_new(dmabuf_pool_t * const pool, size_t size);
+// As _fb_new but if the pool is exhausted wait up to timeout_ms (-1 forever)
+// for a buffer to be returned. NULL on timeout or pool killed.
+struct dmabuf_h * dmabuf_pool_fb_new_wait(dmabuf_pool_t * const pool, size_t size, const int timeout_ms);
+// Called with the new fb, or NULL if the pool was killed first
+typedef void (* dmabuf_pool_fb_new_fn)(void * v, struct dmabuf_h * dh);
+// Async _fb_new - fn is called as soon as a buffer is available. That may
+// be before this returns, otherwise it is on whichever thread returns a
+// buffer to the pool.
+// Returns 0 or -ENOMEM (fn will not be called)
+int dmabuf_pool_fb_new_async(dmabuf_pool_t * const pool, size_t size, const dmabuf_pool_fb_new_fn fn, void * const v);
 // Marks the pool as dead & unrefs this reference
 //   No allocs will succeed after this
 //   All free fbs are unrefed
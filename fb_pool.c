@@ -1,6 +1,7 @@
 #include "fb_pool.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -103,15 +104,75 @@ fb_pool_kill(fb_pool_t ** const pppool)
     generic_pool_kill(&pool);
 }
 
+static wo_fb_t *
+pool_fb_claim(fb_pool_t * const pool, wo_fb_t * const dh)
+{
+    if (dh != NULL)
+        wo_fb_pre_delete_set(dh, fb_predel_cb, fb_pool_ref(pool));
+    return dh;
+}
+
 wo_fb_t *
 fb_pool_fb_new(fb_pool_t * const pool, uint32_t width, uint32_t height, uint32_t fmt, uint64_t mod)
 {
-    wo_fb_t * const dh = generic_pool_get(gp(pool), width, height, fmt, mod);
-    if (dh == NULL)
-        return NULL;
+    return pool_fb_claim(pool, generic_pool_get(gp(pool), width, height, fmt, mod));
+}
+
+wo_fb_t *
+fb_pool_fb_new_wait(fb_pool_t * const pool, uint32_t width, uint32_t height, uint32_t fmt, uint64_t mod,
+                    const int timeout_ms)
+{
+    return pool_fb_claim(pool, generic_pool_get_timeout(gp(pool), timeout_ms, width, height, fmt, mod));
+}
 
-    wo_fb_pre_delete_set(dh, fb_predel_cb, fb_pool_ref(pool));
-    return dh;
+typedef struct fb_new_async_s {
+    fb_pool_t * pool;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fmt;
+    uint64_t mod;
+    fb_pool_fb_new_fn fn;
+    void * v;
+} fb_new_async_t;
+
+static bool
+fb_new_async_cb(void * v, bool killed)
+{
+    fb_new_async_t * const fna = v;
+    wo_fb_t * fb = NULL;
+
+    if (!killed && (fb = fb_pool_fb_new(fna->pool, fna->width, fna->height, fna->fmt, fna->mod)) == NULL)
+        return false;
+
+    fna->fn(fna->v, fb);
+    fb_pool_unref(&fna->pool);
+    free(fna);
+    return true;
+}
+
+int
+fb_pool_fb_new_async(fb_pool_t * const pool, uint32_t width, uint32_t height, uint32_t fmt, uint64_t mod,
+                     const fb_pool_fb_new_fn fn, void * const v)
+{
+    fb_new_async_t * const fna = malloc(sizeof(*fna));
+    int rv;
+
+    if (fna == NULL)
+        return -ENOMEM;
+    *fna = (fb_new_async_t){
+        .pool = fb_pool_ref(pool),
+        .width = width,
+        .height = height,
+        .fmt = fmt,
+        .mod = mod,
+        .fn = fn,
+        .v = v
+    };
+    if ((rv = generic_pool_on_put_add(gp(pool), fb_new_async_cb, fna)) != 0) {
+        fb_pool_unref(&fna->pool);
+        free(fna);
+    }
+    return rv;
 }
 
 void
@@ -22,6 +22,18 @@ fb_pool_t * fb_pool_ref(fb_pool_t * const pool);
 // Allocations need not be all of the same size but no guarantees are made about
 // efficient memory use if this is the case
 struct wo_fb_s * fb_pool_fb_new(fb_pool_t * const pool, uint32_t width, uint32_t height, uint32_t fmt, uint64_t mod);
+// As _fb_new but if the pool is exhausted wait up to timeout_ms (-1 forever)
+// for a fb to be returned. NULL on timeout or pool killed.
+struct wo_fb_s * fb_pool_fb_new_wait(fb_pool_t * const pool, uint32_t width, uint32_t height, uint32_t fmt, uint64_t mod,
+                                     const int timeout_ms);
+// Called with the new fb, or NULL if the pool was killed first
+typedef void (* fb_pool_fb_new_fn)(void * v, struct wo_fb_s * fb);
+// Async _fb_new - fn is called as soon as a fb is available. That may be
+// before this returns, otherwise it is on whichever thread returns a fb
+// to the pool.
+// Returns 0 or -ENOMEM (fn will not be called)
+int fb_pool_fb_new_async(fb_pool_t * const pool, uint32_t width, uint32_t height, uint32_t fmt, uint64_t mod,
+                         const fb_pool_fb_new_fn fn, void * const v);
 // Marks the pool as dead & unrefs this reference
 //   No allocs will succeed after this
 //   All free fbs are unrefed
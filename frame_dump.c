@@ -0,0 +1,402 @@
+#include "frame_dump.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+
+#include "frame_map.h"
+#include "ring_queue.h"
+
+//#include "log.h"
+#define LOG printf
+
+// Max iovecs per writev - well under any sane IOV_MAX
+#define IOV_BATCH 256
+
+typedef struct dump_ent_s {
+    AVFrame * frame;
+    AVRational rate;
+} dump_ent_t;
+
+struct frame_dump_s {
+    int fd;
+    bool y4m;
+    ring_queue_t * q;
+    pthread_t thread;
+    bool thread_ok;
+
+    atomic_uint_least64_t dropped;
+
+    // Only touched by the writer thread
+    bool header_done;
+    bool write_failed;
+    int width;
+    int height;
+    enum AVPixelFormat format;
+    uint64_t written;
+    uint64_t skipped;
+    uint64_t bytes;
+    uint8_t * scratch;
+    size_t scratch_size;
+};
+
+typedef struct iov_list_s {
+    int fd;
+    unsigned int n;
+    size_t bytes;
+    struct iovec v[IOV_BATCH];
+} iov_list_t;
+
+// y4m can only describe planar layouts - NV12 is deinterleaved on the way out
+static const struct {
+    enum AVPixelFormat pix_fmt;
+    const char * tag;
+    bool deinterleave;
+} y4m_fmt_table[] = {
+    {AV_PIX_FMT_YUV420P,     "420jpeg", false},
+    {AV_PIX_FMT_NV12,        "420jpeg", true},
+    {AV_PIX_FMT_YUV422P,     "422",     false},
+    {AV_PIX_FMT_YUV444P,     "444",     false},
+    {AV_PIX_FMT_GRAY8,       "mono",    false},
+    {AV_PIX_FMT_YUV420P10LE, "420p10",  false},
+    {AV_PIX_FMT_YUV422P10LE, "422p10",  false},
+    {AV_PIX_FMT_YUV444P10LE, "444p10",  false},
+};
+
+static int
+y4m_fmt_index(const enum AVPixelFormat pix_fmt)
+{
+    unsigned int i;
+    for (i = 0; i != sizeof(y4m_fmt_table)/sizeof(y4m_fmt_table[0]); ++i) {
+        if (y4m_fmt_table[i].pix_fmt == pix_fmt)
+            return (int)i;
+    }
+    return -1;
+}
+
+static void
+dump_ent_free(dump_ent_t ** const ppde)
+{
+    dump_ent_t * const de = *ppde;
+    if (de == NULL)
+        return;
+    *ppde = NULL;
+    av_frame_free(&de->frame);
+    free(de);
+}
+
+//----------------------------------------------------------------------------
+//
+// Vectored write - contiguous adds are merged so a linear plane with
+// pitch == width becomes a single iovec
+
+static int
+iov_flush(iov_list_t * const il)
+{
+    struct iovec * v = il->v;
+    unsigned int n = il->n;
+
+    while (n != 0) {
+        ssize_t len = writev(il->fd, v, n);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        il->bytes += len;
+        // Skip whatever got written
+        while (n != 0 && (size_t)len >= v->iov_len) {
+            len -= v->iov_len;
+            ++v;
+            --n;
+        }
+        if (n != 0) {
+            v->iov_base = (uint8_t *)v->iov_base + len;
+            v->iov_len -= len;
+        }
+    }
+    il->n = 0;
+    return 0;
+}
+
+static int
+iov_add(iov_list_t * const il, const void * const data, const size_t len)
+{
+    if (il->n != 0) {
+        struct iovec * const last = il->v + il->n - 1;
+        if ((const uint8_t *)last->iov_base + last->iov_len == data) {
+            last->iov_len += len;
+            return 0;
+        }
+        if (il->n == IOV_BATCH) {
+            const int rv = iov_flush(il);
+            if (rv != 0)
+                return rv;
+        }
+    }
+    il->v[il->n++] = (struct iovec){.iov_base = (void *)data, .iov_len = len};
+    return 0;
+}
+
+static int
+iov_add_plane(iov_list_t * const il, const uint8_t * data, const int linesize,
+              const size_t row_bytes, const unsigned int rows)
+{
+    unsigned int i;
+    int rv;
+
+    for (i = 0; i != rows; ++i, data += linesize) {
+        if ((rv = iov_add(il, data, row_bytes)) != 0)
+            return rv;
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+
+// Split interleaved CbCr into two planes in scratch
+static const uint8_t *
+deinterleave_uv(frame_dump_t * const fdmp, const uint8_t * src, const int linesize,
+                const unsigned int w, const unsigned int h)
+{
+    const size_t size = (size_t)w * h * 2;
+    uint8_t * u;
+    uint8_t * v;
+    unsigned int x, y;
+
+    if (size > fdmp->scratch_size) {
+        free(fdmp->scratch);
+        if ((fdmp->scratch = malloc(size)) == NULL) {
+            fdmp->scratch_size = 0;
+            return NULL;
+        }
+        fdmp->scratch_size = size;
+    }
+
+    u = fdmp->scratch;
+    v = u + (size_t)w * h;
+    for (y = 0; y != h; ++y, src += linesize) {
+        for (x = 0; x != w; ++x) {
+            *u++ = src[x * 2];
+            *v++ = src[x * 2 + 1];
+        }
+    }
+    return fdmp->scratch;
+}
+
+static int
+write_header(frame_dump_t * const fdmp, const frame_planes_t * const dp, const AVFrame * const frame,
+             const AVRational rate)
+{
+    const int n = y4m_fmt_index(dp->format);
+    const AVRational sar = frame->sample_aspect_ratio;
+    char buf[128];
+    iov_list_t il = {.fd = fdmp->fd};
+    int len;
+
+    if (n < 0) {
+        LOG("%s: Format %s not supported by y4m\n", __func__, av_get_pix_fmt_name(dp->format));
+        return -EINVAL;
+    }
+
+    len = snprintf(buf, sizeof(buf), "YUV4MPEG2 W%d H%d F%d:%d Ip A%d:%d C%s\n",
+                   dp->width, dp->height,
+                   rate.num > 0 && rate.den > 0 ? rate.num : 25, rate.num > 0 && rate.den > 0 ? rate.den : 1,
+                   sar.num, sar.num != 0 ? sar.den : 0,
+                   y4m_fmt_table[n].tag);
+    iov_add(&il, buf, len);
+    return iov_flush(&il);
+}
+
+static int
+write_planes(frame_dump_t * const fdmp, const frame_planes_t * const dp)
+{
+    static const char frame_hdr[] = "FRAME\n";
+    const int planes = av_pix_fmt_count_planes(dp->format);
+    const int y4m_n = fdmp->y4m ? y4m_fmt_index(dp->format) : -1;
+    iov_list_t il = {.fd = fdmp->fd};
+    int i;
+    int rv;
+
+    if (planes <= 0)
+        return -EINVAL;
+
+    if (fdmp->y4m)
+        iov_add(&il, frame_hdr, sizeof(frame_hdr) - 1);
+
+    for (i = 0; i != planes; ++i) {
+        const unsigned int rows = frame_planes_rows(dp, i);
+        const size_t row_bytes = frame_planes_row_bytes(dp, i);
+
+        if (y4m_n >= 0 && y4m_fmt_table[y4m_n].deinterleave && i == 1) {
+            const unsigned int cw = row_bytes / 2;
+            const uint8_t * const uv = deinterleave_uv(fdmp, dp->data[i], dp->linesize[i], cw, rows);
+            if (uv == NULL)
+                return -ENOMEM;
+            rv = iov_add(&il, uv, (size_t)cw * rows * 2);
+        }
+        else {
+            rv = iov_add_plane(&il, dp->data[i], dp->linesize[i], row_bytes, rows);
+        }
+        if (rv != 0)
+            return rv;
+    }
+
+    rv = iov_flush(&il);
+    fdmp->bytes += il.bytes;
+    return rv;
+}
+
+static int
+dump_one(frame_dump_t * const fdmp, const dump_ent_t * const de)
+{
+    const AVFrame * const frame = de->frame;
+    frame_planes_t dp;
+    int rv;
+
+    if ((rv = frame_planes_map(frame, &dp)) != 0)
+        goto fail;
+
+    if (!fdmp->header_done) {
+        fdmp->width = dp.width;
+        fdmp->height = dp.height;
+        fdmp->format = dp.format;
+        if (fdmp->y4m && (rv = write_header(fdmp, &dp, frame, de->rate)) != 0) {
+            fdmp->write_failed = true;
+            goto fail;
+        }
+        fdmp->header_done = true;
+    }
+    else if (fdmp->y4m &&
+             (dp.width != fdmp->width || dp.height != fdmp->height || dp.format != fdmp->format)) {
+        // y4m has no way of signalling a mid-stream change
+        if (fdmp->skipped++ == 0)
+            LOG("%s: Frame geometry changed - skipping frames\n", __func__);
+        goto fail;
+    }
+
+    if ((rv = write_planes(fdmp, &dp)) == 0)
+        ++fdmp->written;
+
+fail:
+    frame_planes_unmap(&dp);
+    return rv;
+}
+
+static void *
+dump_thread(void * v)
+{
+    frame_dump_t * const fdmp = v;
+    void * p;
+
+    while (ring_queue_get(fdmp->q, &p, true) == 0 && p != NULL) {
+        dump_ent_t * de = p;
+        int rv;
+
+        if (!fdmp->write_failed && (rv = dump_one(fdmp, de)) != 0 && rv != -ENOTSUP) {
+            if (rv == -EPIPE || rv == -ENOSPC || rv == -EIO) {
+                LOG("%s: Write failed: %s - dump stopped\n", __func__, strerror(-rv));
+                fdmp->write_failed = true;
+            }
+        }
+        dump_ent_free(&de);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+
+int
+frame_dump_frame(frame_dump_t * const fdmp, const AVFrame * const frame, const AVRational rate)
+{
+    dump_ent_t * de;
+    int rv;
+
+    if (fdmp == NULL)
+        return -EINVAL;
+
+    if ((de = malloc(sizeof(*de))) == NULL)
+        return -ENOMEM;
+    if ((de->frame = av_frame_clone(frame)) == NULL) {
+        free(de);
+        return -ENOMEM;
+    }
+    de->rate = rate;
+
+    // Never wait - dropping a dump frame is better than stalling display
+    if ((rv = ring_queue_put(fdmp->q, de, false)) != 0) {
+        if (rv == -EAGAIN)
+            atomic_fetch_add(&fdmp->dropped, 1);
+        dump_ent_free(&de);
+    }
+    return rv;
+}
+
+void
+frame_dump_delete(frame_dump_t ** const ppfd)
+{
+    frame_dump_t * const fdmp = *ppfd;
+    void * p;
+
+    if (fdmp == NULL)
+        return;
+    *ppfd = NULL;
+
+    if (fdmp->thread_ok) {
+        ring_queue_put(fdmp->q, NULL, true);
+        pthread_join(fdmp->thread, NULL);
+        LOG("Dump: %"PRIu64" frames (%"PRIu64" bytes) written, %"PRIu64" dropped, %"PRIu64" skipped\n",
+            fdmp->written, fdmp->bytes, (uint64_t)atomic_load(&fdmp->dropped), fdmp->skipped);
+    }
+
+    // Anything left only if the thread never started
+    while (fdmp->q != NULL && ring_queue_get(fdmp->q, &p, false) == 0) {
+        dump_ent_t * de = p;
+        dump_ent_free(&de);
+    }
+    ring_queue_delete(&fdmp->q);
+
+    if (fdmp->fd >= 0)
+        close(fdmp->fd);
+    free(fdmp->scratch);
+    free(fdmp);
+}
+
+frame_dump_t *
+frame_dump_new(const int fd, const unsigned int flags, const unsigned int queue_depth)
+{
+    frame_dump_t * fdmp = calloc(1, sizeof(*fdmp));
+
+    if (fdmp == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    fdmp->fd = fd;
+    fdmp->y4m = (flags & FRAME_DUMP_FLAG_Y4M) != 0;
+    fdmp->format = AV_PIX_FMT_NONE;
+
+    if ((fdmp->q = ring_queue_new(queue_depth)) == NULL)
+        goto fail;
+    if (pthread_create(&fdmp->thread, NULL, dump_thread, fdmp) != 0)
+        goto fail;
+    fdmp->thread_ok = true;
+
+    return fdmp;
+
+fail:
+    frame_dump_delete(&fdmp);
+    return NULL;
+}
+
@@ -0,0 +1,39 @@
+#ifndef _FRAME_DUMP_H
+#define _FRAME_DUMP_H
+
+#include <stdbool.h>
+
+#include "libavutil/rational.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Raw frame dump to file / pipe
+// Frames are queued to a writer thread which writes them directly from
+// their (mapped) buffers with writev. If the writer falls behind frames
+// are dropped rather than stalling the caller.
+
+struct AVFrame;
+struct frame_dump_s;
+typedef struct frame_dump_s frame_dump_t;
+
+#define FRAME_DUMP_FLAG_Y4M 1   // Add y4m stream & frame headers
+
+// fd is owned by the dumper and closed on delete
+frame_dump_t * frame_dump_new(const int fd, const unsigned int flags, const unsigned int queue_depth);
+// Waits for any queued frames to be written, prints stats and closes fd
+void frame_dump_delete(frame_dump_t ** const ppfd);
+
+// Queue a frame for writing. Takes a new ref to frame.
+// rate is only used for the y4m header
+// Returns 0 if queued, -EAGAIN if dropped because the queue was full,
+// other -ve on error
+int frame_dump_frame(frame_dump_t * const fdmp, const struct AVFrame * const frame, const AVRational rate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,174 @@
+#include "frame_map.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libdrm/drm_fourcc.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "dmabuf_alloc.h"
+#include "init_window.h"
+
+//#include "log.h"
+#define LOG printf
+
+static const struct {
+    uint32_t drm_fmt;
+    enum AVPixelFormat pix_fmt;
+} drm_fmt_table[] = {
+    {DRM_FORMAT_NV12,   AV_PIX_FMT_NV12},
+    {DRM_FORMAT_NV16,   AV_PIX_FMT_NV16},
+    {DRM_FORMAT_YUV420, AV_PIX_FMT_YUV420P},
+    {DRM_FORMAT_YUV422, AV_PIX_FMT_YUV422P},
+    {DRM_FORMAT_P010,   AV_PIX_FMT_P010LE},
+};
+
+static enum AVPixelFormat
+drm_to_pix_fmt(const uint32_t drm_fmt)
+{
+    unsigned int i;
+    for (i = 0; i != sizeof(drm_fmt_table)/sizeof(drm_fmt_table[0]); ++i) {
+        if (drm_fmt_table[i].drm_fmt == drm_fmt)
+            return drm_fmt_table[i].pix_fmt;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+// Map a linear DRM_PRIME frame directly
+// Returns 0 on success, -ENOTSUP if the layout is one we can't map directly
+static int
+map_drm_frame(const AVFrame * const frame, frame_planes_t * const fp)
+{
+    const AVDRMFrameDescriptor * const desc = (const AVDRMFrameDescriptor *)frame->data[0];
+    const AVDRMLayerDescriptor * layer;
+    uint8_t * maps[AV_DRM_MAX_PLANES] = {NULL};
+    int i;
+
+    if (desc == NULL || desc->nb_layers != 1 || desc->nb_objects > FRAME_MAP_MAX_OBJECTS)
+        return -ENOTSUP;
+    layer = desc->layers + 0;
+    if ((fp->format = drm_to_pix_fmt(layer->format)) == AV_PIX_FMT_NONE ||
+        layer->nb_planes != av_pix_fmt_count_planes(fp->format))
+        return -ENOTSUP;
+
+    for (i = 0; i != desc->nb_objects; ++i) {
+        if (desc->objects[i].format_modifier != DRM_FORMAT_MOD_LINEAR)
+            return -ENOTSUP;
+    }
+
+    for (i = 0; i != desc->nb_objects; ++i) {
+        if ((fp->dhs[i] = dmabuf_import(desc->objects[i].fd, desc->objects[i].size)) == NULL ||
+            (maps[i] = dmabuf_map(fp->dhs[i])) == NULL)
+            goto fail;
+        dmabuf_read_start(fp->dhs[i]);
+    }
+
+    fp->width = frame->width;
+    fp->height = frame->height;
+    for (i = 0; i != layer->nb_planes; ++i) {
+        fp->data[i] = maps[layer->planes[i].object_index] + layer->planes[i].offset;
+        fp->linesize[i] = layer->planes[i].pitch;
+    }
+    return 0;
+
+fail:
+    // Object i was never started (& may be NULL)
+    dmabuf_unref(fp->dhs + i);
+    while (--i >= 0) {
+        dmabuf_read_end(fp->dhs[i]);
+        dmabuf_unref(fp->dhs + i);
+    }
+    return -ENOMEM;
+}
+
+static void
+sw_frame_planes(const AVFrame * const frame, frame_planes_t * const fp)
+{
+    unsigned int i;
+
+    fp->format = frame->format;
+    fp->width = frame->width;
+    fp->height = frame->height;
+    for (i = 0; i != 4; ++i) {
+        fp->data[i] = frame->data[i];
+        fp->linesize[i] = frame->linesize[i];
+    }
+}
+
+void
+frame_planes_unmap(frame_planes_t * const fp)
+{
+    unsigned int i;
+
+    for (i = 0; i != FRAME_MAP_MAX_OBJECTS; ++i) {
+        if (fp->dhs[i] == NULL)
+            continue;
+        dmabuf_read_end(fp->dhs[i]);
+        dmabuf_unref(fp->dhs + i);
+    }
+    av_frame_free(&fp->sw_frame);
+}
+
+int
+frame_planes_map(const AVFrame * const frame, frame_planes_t * const fp)
+{
+    struct dmabuf_h * dh;
+    int rv;
+
+    memset(fp, 0, sizeof(*fp));
+    fp->format = AV_PIX_FMT_NONE;
+
+    if (frame->format == AV_PIX_FMT_DRM_PRIME && map_drm_frame(frame, fp) == 0) {
+        // Linear & mapped directly - no copy
+        return 0;
+    }
+
+    if (frame->hw_frames_ctx != NULL) {
+        // Tiled or otherwise unknown layout - only a copy will do
+        frame_planes_unmap(fp);
+        if ((fp->sw_frame = av_frame_alloc()) == NULL)
+            return -ENOMEM;
+        if ((rv = av_hwframe_transfer_data(fp->sw_frame, frame, 0)) < 0) {
+            LOG("%s: Error transferring the data to system memory\n", __func__);
+            return rv;
+        }
+        sw_frame_planes(fp->sw_frame, fp);
+        return 0;
+    }
+
+    if (frame->format == AV_PIX_FMT_DRM_PRIME)
+        return -ENOTSUP;
+
+    sw_frame_planes(frame, fp);
+    // S/w decode into our own dmabufs - read in place but sync like any
+    // other dmabuf
+    if ((dh = vidout_wayland_frame_dmabuf(frame)) != NULL) {
+        fp->dhs[0] = dmabuf_ref(dh);
+        dmabuf_read_start(fp->dhs[0]);
+    }
+    return 0;
+}
+
+unsigned int
+frame_planes_rows(const frame_planes_t * const fp, const unsigned int plane)
+{
+    const AVPixFmtDescriptor * const desc = av_pix_fmt_desc_get(fp->format);
+    if (desc == NULL)
+        return 0;
+    return (plane == 1 || plane == 2) ? AV_CEIL_RSHIFT(fp->height, desc->log2_chroma_h) : fp->height;
+}
+
+size_t
+frame_planes_row_bytes(const frame_planes_t * const fp, const unsigned int plane)
+{
+    const int n = av_image_get_linesize(fp->format, fp->width, plane);
+    return n < 0 ? 0 : (size_t)n;
+}
+
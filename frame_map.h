@@ -0,0 +1,50 @@
+#ifndef _FRAME_MAP_H
+#define _FRAME_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libavutil/pixfmt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CPU read access to the pixels of any frame we might display
+// Linear DRM_PRIME frames are mapped directly (bracketed by
+// dmabuf_read_start/end), other h/w frames are copied to system memory
+// and s/w frames are used as they are - bracketed too if they are in our
+// own dmabufs.
+
+struct AVFrame;
+struct dmabuf_h;
+
+#define FRAME_MAP_MAX_OBJECTS 4
+
+typedef struct frame_planes_s {
+    enum AVPixelFormat format;
+    int width;
+    int height;
+    const uint8_t * data[4];
+    int linesize[4];
+
+    // Private
+    struct dmabuf_h * dhs[FRAME_MAP_MAX_OBJECTS];
+    struct AVFrame * sw_frame;
+} frame_planes_t;
+
+// Returns 0 OK, -ENOTSUP if the layout isn't one we can read, other -ve
+// on error. fp must be unmapped whatever the return.
+int frame_planes_map(const struct AVFrame * const frame, frame_planes_t * const fp);
+void frame_planes_unmap(frame_planes_t * const fp);
+
+// Rows in plane & bytes of picture (not padding) in each
+unsigned int frame_planes_rows(const frame_planes_t * const fp, const unsigned int plane);
+size_t frame_planes_row_bytes(const frame_planes_t * const fp, const unsigned int plane);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
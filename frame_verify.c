@@ -0,0 +1,316 @@
+#include "frame_verify.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+
+#include "crc32c.h"
+#include "frame_map.h"
+#include "ring_queue.h"
+
+//#include "log.h"
+#define LOG printf
+
+#define VERIFY_HEADER       "hello_wayland verify crc32c 1"
+#define VERIFY_LINE_MAX     128
+// Mismatches reported individually - after that just counted
+#define VERIFY_REPORT_MAX   8
+
+struct frame_verify_s {
+    char * golden_name;
+    bool compare;               // true: check against golden, false: write it
+    FILE * out;                 // Golden being written
+    char ** golden;             // Golden lines (no frame no) being compared
+    size_t golden_count;
+
+    ring_queue_t * q;
+    pthread_t thread;
+    bool thread_ok;
+
+    atomic_uint_least64_t stalls;
+
+    // Only touched by the verify thread
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t mismatches;
+    uint64_t first_mismatch;
+    uint64_t errors;
+};
+
+static void
+golden_free(frame_verify_t * const fv)
+{
+    size_t i;
+    for (i = 0; i != fv->golden_count; ++i)
+        free(fv->golden[i]);
+    free(fv->golden);
+    fv->golden = NULL;
+    fv->golden_count = 0;
+}
+
+// Read the whole golden file - all lines must be in frame order
+static int
+golden_load(frame_verify_t * const fv, FILE * const f)
+{
+    char * line = NULL;
+    size_t size = 0;
+    size_t alloc = 0;
+    ssize_t len;
+    int rv = -EINVAL;
+
+    if ((len = getline(&line, &size, f)) < 0 ||
+        (line[strcspn(line, "\n")] = '\0', strcmp(line, VERIFY_HEADER) != 0)) {
+        LOG("%s: %s is not a verify file\n", __func__, fv->golden_name);
+        goto fail;
+    }
+
+    while ((len = getline(&line, &size, f)) >= 0) {
+        char * e;
+        const unsigned long long n = strtoull(line, &e, 10);
+
+        if (len != 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (e == line || *e != ' ' || n != fv->golden_count) {
+            LOG("%s: %s: bad line %zu\n", __func__, fv->golden_name, fv->golden_count + 2);
+            goto fail;
+        }
+
+        if (fv->golden_count == alloc) {
+            char ** const g = realloc(fv->golden, (alloc = alloc == 0 ? 1024 : alloc * 2) * sizeof(*g));
+            if (g == NULL) {
+                rv = -ENOMEM;
+                goto fail;
+            }
+            fv->golden = g;
+        }
+        if ((fv->golden[fv->golden_count] = strdup(e + 1)) == NULL) {
+            rv = -ENOMEM;
+            goto fail;
+        }
+        ++fv->golden_count;
+    }
+    rv = 0;
+
+fail:
+    free(line);
+    return rv;
+}
+
+// Line (without frame no) for a frame: geometry, format & per plane crcs
+static int
+frame_crc_line(frame_verify_t * const fv, const AVFrame * const frame, char * const buf, const size_t buf_size)
+{
+    frame_planes_t fp;
+    int planes;
+    int len;
+    int i;
+    int rv;
+
+    if ((rv = frame_planes_map(frame, &fp)) != 0)
+        goto fail;
+    if ((planes = av_pix_fmt_count_planes(fp.format)) <= 0) {
+        rv = -EINVAL;
+        goto fail;
+    }
+
+    len = snprintf(buf, buf_size, "%dx%d %s", fp.width, fp.height, av_get_pix_fmt_name(fp.format));
+    for (i = 0; i != planes; ++i) {
+        const unsigned int rows = frame_planes_rows(&fp, i);
+        const size_t row_bytes = frame_planes_row_bytes(&fp, i);
+        const uint8_t * p = fp.data[i];
+        uint32_t crc = 0;
+        unsigned int y;
+
+        // Padding is undefined so must be skipped - if the pitch is the
+        // width this is a single run anyway
+        if ((size_t)fp.linesize[i] == row_bytes) {
+            crc = crc32c(crc, p, row_bytes * rows);
+        }
+        else {
+            for (y = 0; y != rows; ++y, p += fp.linesize[i])
+                crc = crc32c(crc, p, row_bytes);
+        }
+        fv->bytes += row_bytes * rows;
+
+        len += snprintf(buf + len, buf_size - len, " %08"PRIx32, crc);
+    }
+
+fail:
+    frame_planes_unmap(&fp);
+    return rv;
+}
+
+static void
+verify_one(frame_verify_t * const fv, const AVFrame * const frame)
+{
+    const uint64_t n = fv->frames++;
+    char buf[VERIFY_LINE_MAX];
+
+    if (frame_crc_line(fv, frame, buf, sizeof(buf)) != 0) {
+        if (fv->errors++ == 0)
+            LOG("%s: Frame %"PRIu64": failed to read planes\n", __func__, n);
+        strcpy(buf, "unreadable");
+    }
+
+    if (!fv->compare) {
+        fprintf(fv->out, "%"PRIu64" %s\n", n, buf);
+        return;
+    }
+
+    if (n >= fv->golden_count || strcmp(buf, fv->golden[n]) != 0) {
+        if (fv->mismatches++ == 0)
+            fv->first_mismatch = n;
+        if (fv->mismatches <= VERIFY_REPORT_MAX)
+            LOG("Verify: frame %"PRIu64" mismatch: got '%s', expected '%s'\n", n, buf,
+                n >= fv->golden_count ? "<end of file>" : fv->golden[n]);
+    }
+}
+
+static void *
+verify_thread(void * v)
+{
+    frame_verify_t * const fv = v;
+    void * p;
+
+    while (ring_queue_get(fv->q, &p, true) == 0 && p != NULL) {
+        AVFrame * frame = p;
+        verify_one(fv, frame);
+        av_frame_free(&frame);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+
+int
+frame_verify_frame(frame_verify_t * const fv, const AVFrame * const frame)
+{
+    AVFrame * f;
+    int rv;
+
+    if (fv == NULL)
+        return -EINVAL;
+
+    if ((f = av_frame_clone(frame)) == NULL)
+        return -ENOMEM;
+
+    // Unlike dump we can't drop - try without waiting first so we can see
+    // if we ever held display up
+    if ((rv = ring_queue_put(fv->q, f, false)) == -EAGAIN) {
+        atomic_fetch_add(&fv->stalls, 1);
+        rv = ring_queue_put(fv->q, f, true);
+    }
+    if (rv != 0)
+        av_frame_free(&f);
+    return rv;
+}
+
+int
+frame_verify_delete(frame_verify_t ** const ppfv)
+{
+    frame_verify_t * const fv = *ppfv;
+    int rv = 0;
+    void * p;
+
+    if (fv == NULL)
+        return 0;
+    *ppfv = NULL;
+
+    if (fv->thread_ok) {
+        ring_queue_put(fv->q, NULL, true);
+        pthread_join(fv->thread, NULL);
+
+        if (fv->compare) {
+            // Golden frames we never got are failures too
+            const uint64_t missing = fv->frames < fv->golden_count ? fv->golden_count - fv->frames : 0;
+            LOG("Verify: %"PRIu64" frames (%"PRIu64" bytes) checked against %zu: %"PRIu64" mismatched",
+                fv->frames, fv->bytes, fv->golden_count, fv->mismatches);
+            if (fv->mismatches != 0)
+                LOG(" (first at frame %"PRIu64")", fv->first_mismatch);
+            LOG(", %"PRIu64" missing, %"PRIu64" stalls\n", missing, (uint64_t)atomic_load(&fv->stalls));
+            if (fv->mismatches != 0 || missing != 0)
+                rv = -1;
+        }
+        else {
+            LOG("Verify: %"PRIu64" frames (%"PRIu64" bytes) written to %s, %"PRIu64" stalls\n",
+                fv->frames, fv->bytes, fv->golden_name, (uint64_t)atomic_load(&fv->stalls));
+        }
+        if (fv->errors != 0) {
+            LOG("Verify: %"PRIu64" frames could not be read\n", fv->errors);
+            rv = -1;
+        }
+    }
+
+    // Anything left only if the thread never started
+    while (fv->q != NULL && ring_queue_get(fv->q, &p, false) == 0) {
+        AVFrame * frame = p;
+        av_frame_free(&frame);
+    }
+    ring_queue_delete(&fv->q);
+
+    if (fv->out != NULL && fclose(fv->out) != 0) {
+        LOG("Verify: failed to write %s: %s\n", fv->golden_name, strerror(errno));
+        rv = -1;
+    }
+    golden_free(fv);
+    free(fv->golden_name);
+    free(fv);
+    return rv;
+}
+
+frame_verify_t *
+frame_verify_new(const char * const golden_name, const unsigned int queue_depth)
+{
+    frame_verify_t * fv = calloc(1, sizeof(*fv));
+    FILE * f;
+
+    if (fv == NULL)
+        return NULL;
+    if ((fv->golden_name = strdup(golden_name)) == NULL)
+        goto fail;
+
+    if ((f = fopen(golden_name, "r")) != NULL) {
+        const int rv = golden_load(fv, f);
+        fclose(f);
+        if (rv != 0)
+            goto fail;
+        fv->compare = true;
+        LOG("Verify: checking against %zu frames in %s\n", fv->golden_count, golden_name);
+    }
+    else if (errno == ENOENT) {
+        if ((fv->out = fopen(golden_name, "w")) == NULL) {
+            LOG("%s: Failed to create %s: %s\n", __func__, golden_name, strerror(errno));
+            goto fail;
+        }
+        fprintf(fv->out, VERIFY_HEADER "\n");
+        LOG("Verify: writing new golden file %s\n", golden_name);
+    }
+    else {
+        LOG("%s: Failed to open %s: %s\n", __func__, golden_name, strerror(errno));
+        goto fail;
+    }
+
+    if ((fv->q = ring_queue_new(queue_depth)) == NULL)
+        goto fail;
+    if (pthread_create(&fv->thread, NULL, verify_thread, fv) != 0)
+        goto fail;
+    fv->thread_ok = true;
+
+    return fv;
+
+fail:
+    frame_verify_delete(&fv);
+    return NULL;
+}
+
@@ -0,0 +1,37 @@
+#ifndef _FRAME_VERIFY_H
+#define _FRAME_VERIFY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bit-exact output check
+// Every frame gets a crc32c per plane (visible pixels only) computed on a
+// worker thread, reading linear dmabufs directly through their maps.
+// If the golden file exists the crcs are compared against it, otherwise
+// it is created.
+//
+// Golden file is text: a header line then one line per frame
+//   <frame no> <w>x<h> <pix fmt> <plane 0 crc> [<plane 1 crc> ...]
+
+struct AVFrame;
+struct frame_verify_s;
+typedef struct frame_verify_s frame_verify_t;
+
+frame_verify_t * frame_verify_new(const char * const golden_name, const unsigned int queue_depth);
+// Waits for all queued frames to be checked & prints stats
+// Returns 0 if everything matched (or the golden file was written OK),
+// -1 on mismatch or error
+int frame_verify_delete(frame_verify_t ** const ppfv);
+
+// Queue a frame for checking. Takes a new ref to frame.
+// Waits (and counts a stall) if the checker has fallen behind as a skipped
+// frame would be a false failure
+int frame_verify_frame(frame_verify_t * const fv, const struct AVFrame * const frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -1,6 +1,7 @@
 #include "generic_pool.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <pthread.h>
 #include <stdatomic.h>
@@ -8,6 +9,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 //----------------------------------------------------------------------------
 //
@@ -25,6 +27,12 @@ typedef struct generic_fb_list_s {
     generic_fb_slot_t * unused;    // Single linked list of unused slots
 } generic_fb_list_t;
 
+typedef struct generic_pool_waiter_s {
+    struct generic_pool_waiter_s * next;
+    generic_pool_on_put_fn fn;
+    void * v;
+} generic_pool_waiter_t;
+
 struct generic_pool_s {
     atomic_int ref_count;       // 0 == 1 ref for ease of init
     bool dead;                  // Pool killed - never alloc again
@@ -36,6 +44,10 @@ struct generic_pool_s {
     void * callback_v;
 
     pthread_mutex_t lock;
+    pthread_cond_t put_cond;    // Broadcast on put & kill (CLOCK_MONOTONIC)
+    uint64_t put_seq;           // Incremented on put & kill
+    generic_pool_waiter_t * waiters;    // Async waiters - FIFO
+    generic_pool_waiter_t ** waiters_tail;
 
     generic_fb_list_t free_fbs;    // Free FB list header
     generic_fb_slot_t * slots;     // [fb_max]
@@ -111,7 +123,10 @@ pool_free(generic_pool_t * const pool)
     void *const v = pool->callback_v;
     const generic_pool_on_delete_fn on_delete_fn = pool->callback_fns.on_delete_fn;
     pool_free_pool(pool);
+    // Waiters hold refs so there can't be any left
+    assert(pool->waiters == NULL);
     free(pool->slots);
+    pthread_cond_destroy(&pool->put_cond);
     pthread_mutex_destroy(&pool->lock);
     free(pool);
 
@@ -147,6 +162,7 @@ generic_pool_new(const unsigned int total_fbs_max,
                  void * const v)
 {
     generic_pool_t * const pool = calloc(1, sizeof(*pool));
+    pthread_condattr_t attr;
     unsigned int i;
 
     if (pool == NULL)
@@ -163,6 +179,11 @@ generic_pool_new(const unsigned int total_fbs_max,
     pool->free_fbs.unused = pool->slots + 0;
 
     pthread_mutex_init(&pool->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->put_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pool->waiters_tail = &pool->waiters;
 
     return pool;
 
@@ -174,29 +195,103 @@ fail0:
     return NULL;
 }
 
+static void
+waiter_add_tail(generic_pool_t * const pool, generic_pool_waiter_t * const w)
+{
+    w->next = NULL;
+    *pool->waiters_tail = w;
+    pool->waiters_tail = &w->next;
+}
+
+// Give each async waiter a go. Called without the lock as waiters will
+// want to get from the pool. A waiter that fails is requeued unless
+// something was put whilst it was trying in which case it tries again.
+static void
+waiters_run(generic_pool_t * const pool)
+{
+    generic_pool_waiter_t * w;
+    uint64_t seq;
+    bool dead;
+
+    pthread_mutex_lock(&pool->lock);
+    w = pool->waiters;
+    pool->waiters = NULL;
+    pool->waiters_tail = &pool->waiters;
+    seq = pool->put_seq;
+    dead = pool->dead;
+    pthread_mutex_unlock(&pool->lock);
+
+    while (w != NULL) {
+        generic_pool_waiter_t * const next = w->next;
+
+        for (;;) {
+            if (w->fn(w->v, dead)) {
+                free(w);
+                break;
+            }
+            pthread_mutex_lock(&pool->lock);
+            if (seq == pool->put_seq) {
+                waiter_add_tail(pool, w);
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+            seq = pool->put_seq;
+            dead = pool->dead;
+            pthread_mutex_unlock(&pool->lock);
+        }
+        w = next;
+    }
+}
+
 int
 generic_pool_put(generic_pool_t * const pool, void * dfb)
 {
     int rv = -1;
+    bool has_waiters;
+
     pthread_mutex_lock(&pool->lock);
     if (!pool->dead) {
         fb_list_add_tail(&pool->free_fbs, dfb);
+        ++pool->put_seq;
+        pthread_cond_broadcast(&pool->put_cond);
         rv = 0;
     }
+    has_waiters = pool->waiters != NULL;
     pthread_mutex_unlock(&pool->lock);
+
+    if (rv == 0 && has_waiters)
+        waiters_run(pool);
     return rv;
 }
 
-void *
-generic_pool_get(generic_pool_t * const pool, ...)
+int
+generic_pool_on_put_add(generic_pool_t * const pool, const generic_pool_on_put_fn fn, void * const v)
+{
+    generic_pool_waiter_t * const w = malloc(sizeof(*w));
+
+    if (w == NULL)
+        return -ENOMEM;
+    w->fn = fn;
+    w->v = v;
+
+    pthread_mutex_lock(&pool->lock);
+    waiter_add_tail(pool, w);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Something may have been put (or the pool killed) before we were
+    // queued so give it a first go now
+    waiters_run(pool);
+    return 0;
+}
+
+// args used as-is for alloc so pass a copy
+static void *
+pool_vget(generic_pool_t * const pool, va_list args)
 {
     struct generic_h * dfb;
     generic_fb_slot_t * slot;
     generic_fb_slot_t * best_slot = NULL;
     int best_score = INT_MAX;
-    va_list args;
-
-    va_start(args, pool);
 
     pthread_mutex_lock(&pool->lock);
 
@@ -251,15 +346,73 @@ generic_pool_get(generic_pool_t * const pool, ...)
     }
 
 found:
-    va_end(args);
     return dfb;
 
 fail_unlock:
-    va_end(args);
     pthread_mutex_unlock(&pool->lock);
     return NULL;
 }
 
+void *
+generic_pool_get(generic_pool_t * const pool, ...)
+{
+    void * dfb;
+    va_list args;
+
+    va_start(args, pool);
+    dfb = pool_vget(pool, args);
+    va_end(args);
+    return dfb;
+}
+
+void *
+generic_pool_get_timeout(generic_pool_t * const pool, const int timeout_ms, ...)
+{
+    void * dfb;
+    va_list args;
+    struct timespec ts;
+    uint64_t seq;
+    bool give_up = false;
+
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ++ts.tv_sec;
+        }
+    }
+
+    va_start(args, timeout_ms);
+    for (;;) {
+        va_list a2;
+
+        // Sample seq before trying so a put whilst we try isn't missed
+        pthread_mutex_lock(&pool->lock);
+        seq = pool->put_seq;
+        pthread_mutex_unlock(&pool->lock);
+
+        va_copy(a2, args);
+        dfb = pool_vget(pool, a2);
+        va_end(a2);
+        if (dfb != NULL || timeout_ms == 0 || give_up)
+            break;
+
+        pthread_mutex_lock(&pool->lock);
+        while (seq == pool->put_seq && !pool->dead && !give_up) {
+            if (timeout_ms < 0)
+                pthread_cond_wait(&pool->put_cond, &pool->lock);
+            else if (pthread_cond_timedwait(&pool->put_cond, &pool->lock, &ts) == ETIMEDOUT)
+                give_up = true;
+        }
+        give_up = give_up || pool->dead;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    va_end(args);
+    return dfb;
+}
+
 // Mark pool as dead (i.e. no new allocs) and unref it
 // Simple unref will also work but this reclaims storage faster
 // Actual pool structure will persist until all referencing fbs are deleted too
@@ -272,8 +425,14 @@ generic_pool_kill(generic_pool_t ** const pppool)
         return;
     *pppool = NULL;
 
+    pthread_mutex_lock(&pool->lock);
     pool->dead = true;
+    ++pool->put_seq;
+    pthread_cond_broadcast(&pool->put_cond);
+    pthread_mutex_unlock(&pool->lock);
     pool_free_pool(pool);
+    // Tell anyone still waiting that it's over
+    waiters_run(pool);
 
     generic_pool_unref(&pool);
 }
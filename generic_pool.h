@@ -47,6 +47,21 @@ generic_pool_t * generic_pool_new(const unsigned int total_fbs_max,
 // Allocations need not be all of the same size but no guarantees are made about
 // efficient memory use if this is the case
 void * generic_pool_get(generic_pool_t * const pool, ...);
+// As _get but if nothing is available wait for a put & try again
+// timeout_ms -1 waits forever, 0 doesn't wait
+// Returns NULL on timeout or if the pool is killed
+void * generic_pool_get_timeout(generic_pool_t * const pool, const int timeout_ms, ...);
+
+// Async wait - called (without any pool lock held) after things are put
+// back into the pool so the waiter can try a get. Return true if done (the
+// waiter is then removed), false to keep waiting.
+// killed is set if the pool has been killed - gets will fail so the
+// waiter must clean up & return true.
+typedef bool (* generic_pool_on_put_fn)(void * v, bool killed);
+// Queue a waiter. fn is also called once before this returns in case
+// something was put before it was queued.
+// Waiters should hold a pool ref.
+int generic_pool_on_put_add(generic_pool_t * const pool, const generic_pool_on_put_fn fn, void * const v);
 
 // Put thing back in the pool
 // Return:
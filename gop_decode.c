@@ -0,0 +1,423 @@
+#include "gop_decode.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libavcodec/avcodec.h>
+
+// GOPs decoding or waiting to be output beyond one per worker. Each GOP in
+// flight holds all its decoded frames so keep this small - the output only
+// ever needs the oldest.
+#define GOP_IN_FLIGHT_EXTRA 1
+// Decoded frames (bounded by packets) held across all GOPs in flight.
+// A GOP only starts decoding if it fits, unless it is the oldest - so a
+// single long GOP still makes progress, just on its own.
+#define GOP_FRAMES_IN_FLIGHT 300
+
+typedef enum gop_state_e {
+    GOP_QUEUED = 0,
+    GOP_DECODING,
+    GOP_DONE,
+} gop_state_t;
+
+typedef struct gop_s {
+    struct gop_s * next;
+    gop_state_t state;
+
+    AVPacket ** pkts;
+    unsigned int n_pkts;
+    unsigned int size_pkts;
+
+    AVFrame ** frames;
+    unsigned int n_frames;
+    unsigned int size_frames;
+
+    unsigned int frames_reserved;   // Taken from frames_in_flight
+} gop_t;
+
+typedef struct gop_worker_s {
+    gop_decode_t * gd;
+    AVCodecContext * ctx;
+    uint64_t gops;
+    bool thread_ok;
+    pthread_t thread;
+} gop_worker_t;
+
+struct gop_decode_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Any state change
+
+    gop_decode_out_fn out_fn;
+    void * v;
+
+    gop_t * cur;                // Being filled - only touched by the submitter
+    gop_t * head;               // In flight in stream order
+    gop_t ** ptail;
+    unsigned int in_flight;
+    unsigned int in_flight_max;
+    unsigned int frames_in_flight;  // Reserved by GOPs decoding or waiting for output
+    bool eos;                   // No more GOPs will be submitted
+    bool stopped;               // Output has stopped
+
+    uint64_t gops;
+    uint64_t frames;
+    uint64_t full_waits;        // Submits that waited for space
+    uint64_t head_waits;        // Output waits for the oldest GOP
+    uint64_t frame_waits;       // Worker waits on the frame budget
+    uint64_t oversize;          // GOPs bigger than the whole frame budget
+
+    unsigned int n_workers;
+    gop_worker_t * workers;
+    bool out_thread_ok;
+    pthread_t out_thread;
+};
+
+static void
+gop_free(gop_t ** const ppg)
+{
+    gop_t * const g = *ppg;
+    unsigned int i;
+
+    if (g == NULL)
+        return;
+    *ppg = NULL;
+
+    for (i = 0; i != g->n_pkts; ++i)
+        av_packet_free(g->pkts + i);
+    for (i = 0; i != g->n_frames; ++i)
+        av_frame_free(g->frames + i);
+    free(g->pkts);
+    free(g->frames);
+    free(g);
+}
+
+static int
+gop_pkt_add(gop_t * const g, AVPacket * const pkt)
+{
+    if (g->n_pkts >= g->size_pkts) {
+        const unsigned int size = g->size_pkts == 0 ? 64 : g->size_pkts * 2;
+        AVPacket ** const pkts = realloc(g->pkts, size * sizeof(*pkts));
+        if (pkts == NULL)
+            return -ENOMEM;
+        g->pkts = pkts;
+        g->size_pkts = size;
+    }
+    g->pkts[g->n_pkts++] = pkt;
+    return 0;
+}
+
+static int
+gop_frame_add(gop_t * const g, AVFrame * const frame)
+{
+    if (g->n_frames >= g->size_frames) {
+        const unsigned int size = g->size_frames == 0 ? 64 : g->size_frames * 2;
+        AVFrame ** const frames = realloc(g->frames, size * sizeof(*frames));
+        if (frames == NULL)
+            return -ENOMEM;
+        g->frames = frames;
+        g->size_frames = size;
+    }
+    g->frames[g->n_frames++] = frame;
+    return 0;
+}
+
+static int
+frame_pts_cmp(const void * a, const void * b)
+{
+    const int64_t pa = (*(const AVFrame * const *)a)->best_effort_timestamp;
+    const int64_t pb = (*(const AVFrame * const *)b)->best_effort_timestamp;
+    return pa < pb ? -1 : pa > pb ? 1 : 0;
+}
+
+// Decode all of g with a clean decoder then drain it
+static void
+gop_decode_one(AVCodecContext * const ctx, gop_t * const g)
+{
+    unsigned int i;
+
+    avcodec_flush_buffers(ctx);
+
+    for (i = 0; i <= g->n_pkts; ++i) {
+        if (avcodec_send_packet(ctx, i < g->n_pkts ? g->pkts[i] : NULL) < 0)
+            fprintf(stderr, "GOP decode: error during decoding\n");
+
+        for (;;) {
+            AVFrame * frame = av_frame_alloc();
+            if (frame == NULL)
+                break;
+            if (avcodec_receive_frame(ctx, frame) != 0 ||
+                gop_frame_add(g, frame) != 0) {
+                av_frame_free(&frame);
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i != g->n_pkts; ++i)
+        av_packet_free(g->pkts + i);
+    g->n_pkts = 0;
+
+    // Decoders output in pts order anyway but make sure
+    qsort(g->frames, g->n_frames, sizeof(*g->frames), frame_pts_cmp);
+}
+
+static void *
+worker_thread(void * v)
+{
+    gop_worker_t * const w = v;
+    gop_decode_t * const gd = w->gd;
+
+    pthread_mutex_lock(&gd->lock);
+    for (;;) {
+        gop_t * g;
+
+        for (g = gd->head; g != NULL && g->state != GOP_QUEUED; g = g->next)
+            /* Loop */;
+        if (g == NULL) {
+            if (gd->eos)
+                break;
+            pthread_cond_wait(&gd->cond, &gd->lock);
+            continue;
+        }
+        // Decode in order so the oldest GOP is never starved by later ones
+        if (g != gd->head && gd->frames_in_flight + g->n_pkts > GOP_FRAMES_IN_FLIGHT) {
+            ++gd->frame_waits;
+            pthread_cond_wait(&gd->cond, &gd->lock);
+            continue;
+        }
+
+        g->state = GOP_DECODING;
+        g->frames_reserved = g->n_pkts;
+        gd->frames_in_flight += g->frames_reserved;
+        // No point decoding if nothing will be output
+        if (!gd->stopped) {
+            pthread_mutex_unlock(&gd->lock);
+            gop_decode_one(w->ctx, g);
+            pthread_mutex_lock(&gd->lock);
+            ++w->gops;
+        }
+        g->state = GOP_DONE;
+        pthread_cond_broadcast(&gd->cond);
+    }
+    pthread_mutex_unlock(&gd->lock);
+    return NULL;
+}
+
+static void *
+out_thread(void * v)
+{
+    gop_decode_t * const gd = v;
+    bool stopped = false;
+
+    pthread_mutex_lock(&gd->lock);
+    for (;;) {
+        gop_t * g = gd->head;
+        unsigned int reserved;
+        unsigned int i;
+
+        if (g == NULL) {
+            if (gd->eos)
+                break;
+            pthread_cond_wait(&gd->cond, &gd->lock);
+            continue;
+        }
+        if (g->state != GOP_DONE) {
+            ++gd->head_waits;
+            pthread_cond_wait(&gd->cond, &gd->lock);
+            continue;
+        }
+
+        if ((gd->head = g->next) == NULL)
+            gd->ptail = &gd->head;
+        --gd->in_flight;
+        reserved = g->frames_reserved;
+        pthread_cond_broadcast(&gd->cond);
+        pthread_mutex_unlock(&gd->lock);
+
+        for (i = 0; i != g->n_frames && !stopped; ++i) {
+            AVFrame * const frame = g->frames[i];
+            g->frames[i] = NULL;
+            ++gd->frames;
+            stopped = gd->out_fn(gd->v, frame) < 0;
+        }
+        gop_free(&g);
+
+        pthread_mutex_lock(&gd->lock);
+        ++gd->gops;
+        gd->frames_in_flight -= reserved;
+        pthread_cond_broadcast(&gd->cond);
+        if (stopped && !gd->stopped) {
+            gd->stopped = true;
+            pthread_cond_broadcast(&gd->cond);
+        }
+    }
+    pthread_mutex_unlock(&gd->lock);
+    return NULL;
+}
+
+// Queue the current GOP for decode
+static int
+gop_submit(gop_decode_t * const gd)
+{
+    gop_t * g = gd->cur;
+    int rv = 0;
+
+    gd->cur = NULL;
+    if (g == NULL)
+        return 0;
+
+    pthread_mutex_lock(&gd->lock);
+    if (g->n_pkts > GOP_FRAMES_IN_FLIGHT && gd->oversize++ == 0)
+        fprintf(stderr, "GOP decode: %u frame GOP is over the %d frame budget - decoding it alone\n",
+                g->n_pkts, GOP_FRAMES_IN_FLIGHT);
+    if (!gd->stopped && gd->in_flight >= gd->in_flight_max)
+        ++gd->full_waits;
+    while (!gd->stopped && gd->in_flight >= gd->in_flight_max)
+        pthread_cond_wait(&gd->cond, &gd->lock);
+
+    if (gd->stopped) {
+        rv = -EPIPE;
+    }
+    else {
+        *gd->ptail = g;
+        gd->ptail = &g->next;
+        ++gd->in_flight;
+        g = NULL;
+        pthread_cond_broadcast(&gd->cond);
+    }
+    pthread_mutex_unlock(&gd->lock);
+
+    gop_free(&g);
+    return rv;
+}
+
+int
+gop_decode_packet(gop_decode_t * const gd, AVPacket * pkt)
+{
+    int rv;
+
+    if (pkt == NULL) {
+        rv = gop_submit(gd);
+        pthread_mutex_lock(&gd->lock);
+        gd->eos = true;
+        pthread_cond_broadcast(&gd->cond);
+        pthread_mutex_unlock(&gd->lock);
+        return rv;
+    }
+
+    // A keyframe starts a new GOP
+    if ((pkt->flags & AV_PKT_FLAG_KEY) != 0 && (rv = gop_submit(gd)) != 0)
+        goto fail;
+
+    if (gd->cur == NULL && (gd->cur = calloc(1, sizeof(*gd->cur))) == NULL) {
+        rv = -ENOMEM;
+        goto fail;
+    }
+    if ((rv = gop_pkt_add(gd->cur, pkt)) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    av_packet_free(&pkt);
+    return rv;
+}
+
+void
+gop_decode_delete(gop_decode_t ** const ppgd, const char * const prefix)
+{
+    gop_decode_t * const gd = *ppgd;
+    unsigned int i;
+
+    if (gd == NULL)
+        return;
+    *ppgd = NULL;
+
+    // Anything not yet submitted is lost
+    gop_free(&gd->cur);
+    pthread_mutex_lock(&gd->lock);
+    gd->eos = true;
+    pthread_cond_broadcast(&gd->cond);
+    pthread_mutex_unlock(&gd->lock);
+
+    for (i = 0; i != gd->n_workers; ++i) {
+        if (gd->workers[i].thread_ok)
+            pthread_join(gd->workers[i].thread, NULL);
+    }
+    if (gd->out_thread_ok)
+        pthread_join(gd->out_thread, NULL);
+
+    // Only left if a thread failed to start
+    while (gd->head != NULL) {
+        gop_t * g = gd->head;
+        gd->head = g->next;
+        gop_free(&g);
+    }
+
+    if (gd->gops != 0) {
+        printf("%sGOP decode: %u decoders, %"PRIu64" GOPs, %"PRIu64" frames (%.1f/GOP), waits: submit %"PRIu64", output %"PRIu64", frame budget %"PRIu64"\n",
+               prefix, gd->n_workers, gd->gops, gd->frames, (double)gd->frames / (double)gd->gops,
+               gd->full_waits, gd->head_waits, gd->frame_waits);
+        if (gd->oversize != 0)
+            printf("%sGOP decode: %"PRIu64" GOPs over the frame budget\n", prefix, gd->oversize);
+        printf("%sGOP decode: per decoder GOPs:", prefix);
+        for (i = 0; i != gd->n_workers; ++i)
+            printf(" %"PRIu64, gd->workers[i].gops);
+        printf("\n");
+    }
+
+    for (i = 0; i != gd->n_workers; ++i)
+        avcodec_free_context(&gd->workers[i].ctx);
+    free(gd->workers);
+    pthread_cond_destroy(&gd->cond);
+    pthread_mutex_destroy(&gd->lock);
+    free(gd);
+}
+
+gop_decode_t *
+gop_decode_new(const unsigned int n, gop_decode_open_fn open_fn, gop_decode_out_fn out_fn, void * v)
+{
+    gop_decode_t * gd = calloc(1, sizeof(*gd));
+    unsigned int i;
+
+    if (gd == NULL)
+        return NULL;
+
+    pthread_mutex_init(&gd->lock, NULL);
+    pthread_cond_init(&gd->cond, NULL);
+    gd->out_fn = out_fn;
+    gd->v = v;
+    gd->ptail = &gd->head;
+    gd->in_flight_max = n + GOP_IN_FLIGHT_EXTRA;
+
+    if ((gd->workers = calloc(n, sizeof(*gd->workers))) == NULL)
+        goto fail;
+    gd->n_workers = n;
+
+    // Open all the decoders before starting anything so a failure is simple
+    for (i = 0; i != n; ++i) {
+        gd->workers[i].gd = gd;
+        if ((gd->workers[i].ctx = open_fn(v)) == NULL)
+            goto fail;
+    }
+
+    for (i = 0; i != n; ++i) {
+        if (pthread_create(&gd->workers[i].thread, NULL, worker_thread, gd->workers + i) != 0)
+            goto fail;
+        gd->workers[i].thread_ok = true;
+    }
+    if (pthread_create(&gd->out_thread, NULL, out_thread, gd) != 0)
+        goto fail;
+    gd->out_thread_ok = true;
+
+    return gd;
+
+fail:
+    gop_decode_delete(&gd, "");
+    return NULL;
+}
+
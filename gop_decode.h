@@ -0,0 +1,47 @@
+#ifndef _GOP_DECODE_H
+#define _GOP_DECODE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// GOP parallel decode
+// Packets are split into GOPs at keyframes & each GOP is decoded as a
+// whole by one of a pool of decoders, each on its own thread. Decoded GOPs
+// are handed to the output callback in stream order with the frames of
+// each GOP sorted by pts, so the output looks like that of a single
+// decoder.
+// Decoded frames held in flight are bounded - a GOP that doesn't fit waits
+// for the GOPs before it to be output.
+// Only valid for closed GOPs - a frame that references the previous GOP
+// has no reference when decoded on its own & will be dropped or broken.
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+struct gop_decode_s;
+typedef struct gop_decode_s gop_decode_t;
+
+// Called n times by gop_decode_new - once for each decoder in the pool
+// Returns an opened decoder or NULL
+typedef struct AVCodecContext * (* gop_decode_open_fn)(void * v);
+// Called from a single output thread in pts order. Takes ownership of frame.
+// Return < 0 to stop decode
+typedef int (* gop_decode_out_fn)(void * v, struct AVFrame * frame);
+
+gop_decode_t * gop_decode_new(const unsigned int n, gop_decode_open_fn open_fn, gop_decode_out_fn out_fn, void * v);
+// Waits for everything submitted to be decoded & output (if not stopped)
+// Prints stats
+void gop_decode_delete(gop_decode_t ** const ppgd, const char * const prefix);
+
+// Takes ownership of pkt. NULL = EOS - flushes the final GOP.
+// Blocks if too many GOPs are in flight.
+// Returns 0 OK, -EPIPE if output has stopped, -ENOMEM
+int gop_decode_packet(gop_decode_t * const gd, struct AVPacket * pkt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -33,8 +33,15 @@
  */
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -48,21 +55,208 @@
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 
+#include "bench.h"
+#include "frame_dump.h"
+#include "frame_verify.h"
+#include "gop_decode.h"
 #include "init_window.h"
+#include "kf_index.h"
+#include "mmap_avio.h"
+#include "proc_stats.h"
+#include "readahead.h"
+#include "ring_queue.h"
+#include "test_pattern.h"
+
+#define PKT_QUEUE_DEPTH_DEFAULT     1024
+#define READAHEAD_KB_DEFAULT        (16 * 1024)
+#define READAHEAD_MS_DEFAULT        2000
+#define FRAME_QUEUE_DEPTH_DEFAULT   3
+#define DUMP_QUEUE_DEPTH            4
+#define VERIFY_QUEUE_DEPTH          4
+#define BENCH_WARMUP_DEFAULT        30
+#define MOSAIC_MAX                  16
+#define DENSITY_MAX                 64
+#define DENSITY_FRAMES_DEFAULT      300 // Per stream per step
+#define DENSITY_SAMPLE_MS           250
+#define SLO_DROP_PCT_DEFAULT        0.5
+#define SLO_DISCARD_PCT_DEFAULT     0.5
+#define SLO_P99_MS_DEFAULT          100.0
+#define GOP_DECODERS_MAX            64
+#define PATTERN_RATE_DEFAULT        60.0
+#define PATTERN_FORMAT_DEFAULT      AV_PIX_FMT_NV12
+#define NULL_HOLD_FRAMES_DEFAULT    1   // Released when the next is presented
+#define IN_FLIGHT_DEFAULT           8
+#define IN_FLIGHT_MIN               2   // One on screen & one queued
+#define LIVE_PROBESIZE              32  // Smallest avformat allows
+#define LIVE_ANALYZE_US             1   // 0 would mean avformat's default (5s)
+#define LIVE_READAHEAD_KB_MAX       1024
+#define LIVE_READAHEAD_MS_MAX       100
+#define LIVE_IN_FLIGHT_MAX          3   // On screen, queued & one being released
 
-static enum AVPixelFormat hw_pix_fmt;
-static FILE *output_file = NULL;
-static long frames = 0;
 static bool no_wait = false;
-static bool wants_deinterlace = false;
-
-static AVFilterContext *buffersink_ctx = NULL;
-static AVFilterContext *buffersrc_ctx = NULL;
-static AVFilterGraph *filter_graph = NULL;
+static bool use_mmap = false;
+static bool live_mode = false;
+static bool use_kf_index = false;
 
 static AVDictionary *codec_opts = NULL;
 static int ffdebug_level = -1L;
 
+// Decoded frame passed from the decode thread to the present thread
+typedef struct frame_ent_s {
+    AVFrame * frame;
+    AVRational time_base;
+    AVRational frame_rate;
+    bool discont;               // First frame of a new playlist item
+    uint64_t tag;               // bench tag, 0 if not benchmarking
+} frame_ent_t;
+
+// Decode quality ladder - each level trades picture quality for decode time
+// Levels are cumulative. lowres can only be set when the decoder is opened
+// so it takes effect at the next playlist item (or loop). If there won't be
+// a reopen (last item, h/w or a codec without lowres) that rung is skipped.
+enum quality_level_e {
+    QUALITY_FULL = 0,
+    QUALITY_SKIP_LOOP_NONREF,   // No loop filter on non-ref frames
+    QUALITY_SKIP_LOOP_ALL,      // No loop filter at all
+    QUALITY_SKIP_IDCT,          // Skip IDCT on non-ref frames
+    QUALITY_LOWRES,             // Half resolution decode if the codec can
+    QUALITY_SKIP_NONREF,        // Drop non-ref frames
+    QUALITY_LEVELS
+};
+
+// Frames per measurement window
+#define QUALITY_WINDOW          30
+// Step down if decode takes more than this % of the frame period or
+// any frames were dropped / discarded in the window
+// Load is the time spent in send_packet / receive_frame on this thread.
+// That is only the real decode cost for single threaded s/w decode; with
+// frame threading the work happens on other threads & with h/w decode
+// mostly in the h/w, so load reads low & drops are what step us down.
+#define QUALITY_LOAD_HIGH       90
+// Step up after QUALITY_UP_WINDOWS consecutive windows under this %
+#define QUALITY_LOAD_LOW        60
+#define QUALITY_UP_WINDOWS      4
+
+typedef struct quality_s {
+    bool enabled;
+    unsigned int level;
+    unsigned int frames;        // Decoded in this window
+    int64_t busy_ns;            // Time in the decoder this window
+    unsigned int drops_last;    // late drops + discards at window start
+    unsigned int good_windows;  // Consecutive windows with headroom
+    bool lowres_ok;             // Decoder will be reopened with lowres
+    unsigned int changes;
+    uint64_t level_frames[QUALITY_LEVELS];
+} quality_t;
+
+// Packet arrival times keyed by timestamp so a decoded frame can be traced
+// back to the packet that carried it (--bench). Demux adds, decode finds.
+#define ARRIVAL_SLOTS 64
+typedef struct arrival_map_s {
+    pthread_mutex_t lock;
+    unsigned int n;
+    int64_t ts[ARRIVAL_SLOTS];
+    int64_t t_ns[ARRIVAL_SLOTS];
+} arrival_map_t;
+
+// Playback state shared by the demux, decode & present threads
+// Input, decoder & packet queue are per input file, the frame queue and
+// present thread persist for the whole run
+typedef struct play_env_s {
+    vid_out_env_t * dpo;
+    const char * name;          // Stats prefix - "" if only one stream
+
+    AVFormatContext * input_ctx;
+    AVCodecContext * decoder_ctx;
+    enum AVPixelFormat hw_pix_fmt;  // get_format wants this - decoder_ctx->opaque if h/w
+    const AVStream * video;
+    int video_stream;
+
+    AVFilterContext * buffersink_ctx;
+    AVFilterContext * buffersrc_ctx;
+    AVFilterGraph * filter_graph;
+    const char * wants_filter;  // Graph to build on the next frame, NULL = none
+
+    long frames;                // Frames left to decode; -ve = no limit
+    long pace_input_hz;
+    unsigned int trick;         // Keyframe only fast forward rate, 0 = normal
+    unsigned int gop_decoders;  // GOP parallel decoders, 0 = single decoder
+    kf_index_t * kfi;           // Keyframe index of the current input or NULL
+
+    readahead_limits_t pkt_limits;
+    readahead_t * pkt_ra;       // demux -> decode, NULL = EOS
+    ring_queue_t * frame_q;     // decode -> present, NULL = EOS
+    frame_dump_t * dump;        // -o output, NULL if none
+    frame_verify_t * verify;    // --verify checker, NULL if none
+    bench_t * bench;            // --bench timing, NULL if none
+    bool discont;               // Next frame is the first of a new item
+
+    pthread_t demux_thread;
+    pthread_t decode_thread;
+    pthread_t present_thread;
+
+    // display_wait state - times in ns in the presentation clock domain
+    clockid_t clock_id;
+    int64_t base_pts;
+    int64_t base_now;
+    int64_t last_conv;
+    int64_t last_target;        // Display time of the previous frame
+    int64_t last_dur;           // & its duration (for playlist joins)
+    bool vbl_offset_valid;
+    int64_t vbl_offset;         // Vblank chosen for the last frame - its target time
+    unsigned int late_run;      // Consecutive late drops
+
+    // Lateness policy - set by present, acted on by decode
+    bool no_skip;               // Never skip or drop late frames (--verify)
+    atomic_bool catch_up;       // Decoder should skip non-ref frames
+    atomic_uint late_drops;     // Frames dropped before display as too late
+    atomic_uint catch_up_runs;  // Times catch-up was entered
+    unsigned int catch_up_pkts; // Packets decoded with non-ref skipping on
+
+    quality_t quality;          // Load adaptive decode quality
+    arrival_map_t arrivals;     // Only used if bench != NULL
+
+    // Test pattern source - present checks the stamps arrive in order
+    bool pattern;
+    uint32_t pattern_next;      // Frame number expected next
+    unsigned int pattern_checked;
+    unsigned int pattern_errs;  // Frames missing, out of order or unreadable
+} play_env_t;
+
+static void
+arrival_add(arrival_map_t * const am, const int64_t ts, const int64_t t_ns)
+{
+    if (ts == AV_NOPTS_VALUE)
+        return;
+    pthread_mutex_lock(&am->lock);
+    am->ts[am->n % ARRIVAL_SLOTS] = ts;
+    am->t_ns[am->n % ARRIVAL_SLOTS] = t_ns;
+    ++am->n;
+    pthread_mutex_unlock(&am->lock);
+}
+
+// Returns arrival time or 0 if not found
+static int64_t
+arrival_find(arrival_map_t * const am, const int64_t ts)
+{
+    int64_t t_ns = 0;
+    unsigned int i;
+
+    if (ts == AV_NOPTS_VALUE)
+        return 0;
+    pthread_mutex_lock(&am->lock);
+    // Newest first - timestamps may repeat after a loop
+    for (i = 0; i != ARRIVAL_SLOTS && i != am->n; ++i) {
+        const unsigned int n = (am->n - 1 - i) % ARRIVAL_SLOTS;
+        if (am->ts[n] == ts) {
+            t_ns = am->t_ns[n];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&am->lock);
+    return t_ns;
+}
+
 static int64_t
 time_us()
 {
@@ -90,10 +284,10 @@ static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
 static enum AVPixelFormat get_hw_format(AVCodecContext *ctx,
                                         const enum AVPixelFormat *pix_fmts)
 {
+    // Wanted format is per decoder - several may be decoding at once
+    const enum AVPixelFormat hw_pix_fmt = *(const enum AVPixelFormat *)ctx->opaque;
     const enum AVPixelFormat *p;
 
-    (void)ctx;
-
     for (p = pix_fmts; *p != -1; p++) {
         if (*p == hw_pix_fmt)
             return *p;
@@ -109,40 +303,152 @@ frame_pts(const AVFrame * const frame)
     return frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
 }
 
+static int64_t
+time_ns(const clockid_t clock_id)
+{
+    struct timespec ts = {0,0};
+    clock_gettime(clock_id, &ts);
+    return (int64_t)ts.tv_nsec + (int64_t)ts.tv_sec * 1000000000;
+}
+
 static void
-display_wait(const AVFrame * const frame, const AVRational time_base)
+sleep_until_ns(const clockid_t clock_id, const int64_t t)
 {
-    static int64_t base_pts = 0;
-    static int64_t base_now = 0;
-    static int64_t last_conv = 0;
+    const struct timespec ts = {
+        .tv_sec = t / 1000000000,
+        .tv_nsec = t % 1000000000
+    };
+    while (clock_nanosleep(clock_id, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        /* loop */;
+}
 
-    int64_t now = time_us();
-    int64_t now_delta = now - base_now;
-    int64_t pts = frame_pts(frame);
-    int64_t pts_delta = pts - base_pts;
-    // If we haven't been given any clues then guess 60fps
-    int64_t pts_conv = (pts == AV_NOPTS_VALUE || time_base.den == 0 || time_base.num == 0) ?
-        last_conv + 1000000 / 60 :
-        av_rescale_q(pts_delta, time_base, (AVRational) {1, 1000000});  // frame->timebase seems invalid currently
-    int64_t delta = pts_conv - now_delta;
+// Frames later than this give up on the current timeline & rebase
+#define DISPLAY_LATE_REBASE_NS  100000000
+// Commit this long after the vblank before the target one
+#define DISPLAY_COMMIT_SLACK_NS 500000
+// Always show at least one frame in this many so the picture never freezes
+#define DISPLAY_LATE_DROP_MAX   8
 
-    last_conv = pts_conv;
+// A frame is late if it can no longer make its vblank. Late frames are
+// dropped (never imported) and the decoder is put into catch-up until a
+// frame arrives in time again.
+static void
+late_set(play_env_t * const pe, const bool late)
+{
+    if (atomic_exchange(&pe->catch_up, late) != late && late)
+        atomic_fetch_add(&pe->catch_up_runs, 1);
+}
 
-//    printf("PTS_delta=%" PRId64 ", Now_delta=%" PRId64 ", TB=%d/%d, Delta=%" PRId64 "\n", pts_delta, now_delta, time_base.num, time_base.den, delta);
+// Apply lateness policy. Returns true if the frame should be shown
+static bool
+display_late_check(play_env_t * const pe, const bool late)
+{
+    // Verify matches golden lines by frame number so a skip would shift
+    // everything after it - just show late frames late
+    if (!late || pe->no_skip) {
+        pe->late_run = 0;
+        late_set(pe, false);
+        return true;
+    }
 
-    if (delta < 0 || delta > 6000000) {
-        base_pts = pts;
-        base_now = now;
-        last_conv = 0;
-        return;
+    late_set(pe, true);
+    if (++pe->late_run >= DISPLAY_LATE_DROP_MAX) {
+        pe->late_run = 0;
+        return true;
+    }
+    ++pe->late_drops;
+    return false;
+}
+
+// Returns true if the frame should be displayed, false if it should be
+// dropped as late
+static bool
+display_wait(play_env_t * const pe, const AVFrame * const frame, const AVRational time_base, const bool discont)
+{
+    int64_t now = time_ns(pe->clock_id);
+    int64_t pts = frame_pts(frame);
+    int64_t pts_conv;
+    int64_t delta;
+    int64_t target;
+    int64_t vbl;
+    int64_t period;
+
+    if (discont && pe->base_now != 0) {
+        // New playlist item - show its first frame one frame time after
+        // the last frame of the previous item so the join is seamless
+        pe->base_pts = pts;
+        pe->base_now = pe->last_target + pe->last_dur;
+        pe->last_conv = -(1000000000 / 60);
+    }
+
+    // If we haven't been given any clues then guess 60fps
+    pts_conv = (pts == AV_NOPTS_VALUE || time_base.den == 0 || time_base.num == 0) ?
+        pe->last_conv + 1000000000 / 60 :
+        av_rescale_q(pts - pe->base_pts,
+                     (AVRational){time_base.num, time_base.den * (pe->trick != 0 ? (int)pe->trick : 1)},
+                     (AVRational) {1, 1000000000});  // frame->timebase seems invalid currently
+    delta = pts_conv - (now - pe->base_now);
+
+    pe->last_conv = pts_conv;
+
+    // Only rebase if we are a long way out - a frame that is a little late
+    // will just take the next vblank & rebasing on every slip gives judder
+    if (pe->base_now == 0 || delta < -DISPLAY_LATE_REBASE_NS || delta > 6000000000) {
+        pe->base_pts = pts;
+        pe->base_now = now;
+        pe->last_conv = 0;
+        pe->last_target = now;
+        pe->vbl_offset_valid = false;
+        pe->late_run = 0;
+        late_set(pe, false);
+        return true;
+    }
+
+    target = pe->base_now + pts_conv;
+    if (target > pe->last_target && target - pe->last_target < 1000000000)
+        pe->last_dur = target - pe->last_target;
+    pe->last_target = target;
+
+    if (vidout_wayland_vsync_next(pe->dpo, target, &vbl, &period) != 0) {
+        // No vblank estimate - just wait for PTS
+        // Late if the next frame is already due
+        pe->vbl_offset_valid = false;
+        if (delta > 0)
+            sleep_until_ns(pe->clock_id, target);
+        return display_late_check(pe, pe->last_dur != 0 && -delta > pe->last_dur && !discont);
     }
 
-    if (delta > 0)
-        usleep(delta);
+    // Nearest vblank to target
+    if (vbl - target > period / 2)
+        vbl -= period;
+
+    // If the frame time sits close to a vblank boundary then jitter will
+    // make it flip between the two. Keep the same phase as the previous
+    // frame unless that has drifted too far
+    if (pe->vbl_offset_valid) {
+        int64_t vbl2;
+        if (vidout_wayland_vsync_next(pe->dpo, target + pe->vbl_offset - period / 2, &vbl2, NULL) == 0 &&
+            llabs(vbl2 - target) <= period * 5 / 8)
+            vbl = vbl2;
+    }
+    pe->vbl_offset = vbl - target;
+    pe->vbl_offset_valid = true;
+
+    // Too late to commit for our vblank - the compositor would show it a
+    // frame late & push everything after it back
+    if (now + DISPLAY_COMMIT_SLACK_NS > vbl)
+        return display_late_check(pe, !discont);
+
+    // Commit just after the previous vblank so the compositor has the
+    // whole period to pick it up. If we are already past that then commit
+    // immediately
+    sleep_until_ns(pe->clock_id, vbl - period + DISPLAY_COMMIT_SLACK_NS);
+    return display_late_check(pe, false);
 }
 
 // Copied almost directly from ffmpeg filtering_video.c example
-static int init_filters(const AVStream * const stream,
+static int init_filters(play_env_t * const pe,
+                        const AVStream * const stream,
                         const AVCodecContext * const dec_ctx,
                         const char * const filters_descr,
                         AVFrame * const frame)
@@ -153,16 +459,21 @@ static int init_filters(const AVStream * const stream,
     AVFilterInOut *outputs = avfilter_inout_alloc();
     AVFilterInOut *inputs  = avfilter_inout_alloc();
     AVRational time_base = stream->time_base;
-    enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_DRM_PRIME, AV_PIX_FMT_NONE };
-
-    filter_graph = avfilter_graph_alloc();
-    if (!outputs || !inputs || !filter_graph) {
+    // H/w filters stay in DRM_PRIME; s/w filters are converted to something
+    // the compositor is likely to take
+    enum AVPixelFormat pix_fmts[] = {
+        AV_PIX_FMT_DRM_PRIME, AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P,
+        AV_PIX_FMT_BGR0, AV_PIX_FMT_RGB0, AV_PIX_FMT_NONE
+    };
+
+    pe->filter_graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !pe->filter_graph) {
         ret = AVERROR(ENOMEM);
         goto end;
     }
 
-    buffersrc_ctx = avfilter_graph_alloc_filter(filter_graph, buffersrc, "in");
-    if (buffersrc_ctx == NULL) {
+    pe->buffersrc_ctx = avfilter_graph_alloc_filter(pe->filter_graph, buffersrc, "in");
+    if (pe->buffersrc_ctx == NULL) {
         av_log(NULL, AV_LOG_ERROR, "Cannot create buffer source\n");
         ret = AVERROR(EINVAL);
         goto end;
@@ -185,7 +496,7 @@ static int init_filters(const AVStream * const stream,
         par->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
         // Buffersrc will take a ref - no need to keep locally
         par->hw_frames_ctx = frame->hw_frames_ctx;
-        ret = av_buffersrc_parameters_set(buffersrc_ctx, par);
+        ret = av_buffersrc_parameters_set(pe->buffersrc_ctx, par);
         av_freep(&par);
         if (ret < 0) {
             av_log(NULL, AV_LOG_ERROR, "Failed to set buffersc parameters\n");
@@ -193,25 +504,25 @@ static int init_filters(const AVStream * const stream,
         }
     }
 
-    if ((ret = avfilter_init_dict(buffersrc_ctx, NULL)) < 0) {
+    if ((ret = avfilter_init_dict(pe->buffersrc_ctx, NULL)) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Failed to init src dict\n");
         goto end;
     }
 
-    buffersink_ctx = avfilter_graph_alloc_filter(filter_graph, buffersink, "out");
-    if (buffersink_ctx == NULL) {
+    pe->buffersink_ctx = avfilter_graph_alloc_filter(pe->filter_graph, buffersink, "out");
+    if (pe->buffersink_ctx == NULL) {
         av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
         ret = AVERROR(EINVAL);
         goto end;
     }
 
 #if LIBAVFILTER_BUILD >= AV_VERSION_INT(10, 6, 100)
-    ret = av_opt_set_array(buffersink_ctx, "pixel_formats",
+    ret = av_opt_set_array(pe->buffersink_ctx, "pixel_formats",
                            AV_OPT_SEARCH_CHILDREN | AV_OPT_ARRAY_REPLACE,
                            0, sizeof(pix_fmts)/sizeof(pix_fmts[0]) - 1,
                            AV_OPT_TYPE_PIXEL_FMT, pix_fmts);
 #else
-    ret = av_opt_set_int_list(buffersink_ctx, "pix_fmts", pix_fmts,
+    ret = av_opt_set_int_list(pe->buffersink_ctx, "pix_fmts", pix_fmts,
                               AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
 #endif
 
@@ -220,7 +531,7 @@ static int init_filters(const AVStream * const stream,
         goto end;
     }
 
-    if ((ret = avfilter_init_dict(buffersink_ctx, NULL)) < 0) {
+    if ((ret = avfilter_init_dict(pe->buffersink_ctx, NULL)) < 0) {
         av_log(NULL, AV_LOG_ERROR, "Failed to init src dict\n");
         goto end;
     }
@@ -237,7 +548,7 @@ static int init_filters(const AVStream * const stream,
      * default.
      */
     outputs->name       = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx;
+    outputs->filter_ctx = pe->buffersrc_ctx;
     outputs->pad_idx    = 0;
     outputs->next       = NULL;
 
@@ -248,15 +559,15 @@ static int init_filters(const AVStream * const stream,
      * default.
      */
     inputs->name       = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
+    inputs->filter_ctx = pe->buffersink_ctx;
     inputs->pad_idx    = 0;
     inputs->next       = NULL;
 
-    if ((ret = avfilter_graph_parse_ptr(filter_graph, filters_descr,
+    if ((ret = avfilter_graph_parse_ptr(pe->filter_graph, filters_descr,
                                     &inputs, &outputs, NULL)) < 0)
         goto end;
 
-    if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
+    if ((ret = avfilter_graph_config(pe->filter_graph, NULL)) < 0)
         goto end;
 
 end:
@@ -272,57 +583,256 @@ fail:
     return -1;
 }
 
-static int decode_write(const AVStream * const stream,
-                        AVCodecContext * const avctx,
-                        vid_out_env_t * const dpo,
+static void
+frame_ent_free(frame_ent_t ** const ppfe)
+{
+    frame_ent_t * const fe = *ppfe;
+
+    if (fe == NULL)
+        return;
+    *ppfe = NULL;
+
+    av_frame_free(&fe->frame);
+    free(fe);
+}
+
+// Takes the ref from frame leaving it blank
+static frame_ent_t *
+frame_ent_new(AVFrame * const frame, const AVRational time_base)
+{
+    frame_ent_t * const fe = malloc(sizeof(*fe));
+
+    if (fe == NULL)
+        return NULL;
+    if ((fe->frame = av_frame_alloc()) == NULL) {
+        free(fe);
+        return NULL;
+    }
+    av_frame_move_ref(fe->frame, frame);
+    fe->time_base = time_base;
+    fe->frame_rate = (AVRational){0, 0};
+    fe->discont = false;
+    fe->tag = 0;
+    return fe;
+}
+
+static void
+readahead_stats_print(const char * const prefix, readahead_t * const ra)
+{
+    readahead_stats_t stats;
+
+    readahead_stats_get(ra, &stats);
+    printf("%sReadahead: max %zu bytes, max %"PRId64"ms, high water waits %"PRIu64", underruns %"PRIu64" (%"PRId64"ms)\n",
+           prefix, stats.max_bytes, stats.max_duration_us / 1000, stats.high_waits,
+           stats.underruns, stats.underrun_us / 1000);
+}
+
+static void
+queue_stats_print(const char * const prefix, const char * const name, const ring_queue_t * const rq)
+{
+    ring_queue_stats_t stats;
+
+    ring_queue_stats_get(rq, &stats);
+    printf("%s%s queue: depth %u, max %u, mean %.2f, producer waits %"PRIu64", consumer waits %"PRIu64"\n",
+           prefix, name, stats.depth, stats.max_count,
+           stats.puts == 0 ? 0.0 : (double)stats.occupancy_sum / (double)stats.puts,
+           stats.full_waits, stats.empty_waits);
+}
+
+static const char * const quality_names[QUALITY_LEVELS] = {
+    [QUALITY_FULL] =             "full",
+    [QUALITY_SKIP_LOOP_NONREF] = "skip_loop_filter=nonref",
+    [QUALITY_SKIP_LOOP_ALL] =    "skip_loop_filter=all",
+    [QUALITY_SKIP_IDCT] =        "skip_idct=nonref",
+    [QUALITY_LOWRES] =           "lowres",
+    [QUALITY_SKIP_NONREF] =      "skip_frame=nonref",
+};
+
+// lowres the decoder should be opened with
+static unsigned int
+quality_lowres(const quality_t * const q)
+{
+    return q->level >= QUALITY_LOWRES ? 1 : 0;
+}
+
+// Next level in direction dir (+1 down in quality, -1 up)
+static unsigned int
+quality_step(const quality_t * const q, const unsigned int level, const int dir)
+{
+    unsigned int n = level + dir;
+    if (n == QUALITY_LOWRES && !q->lowres_ok)
+        n += dir;
+    return n;
+}
+
+// Set the skip levels that can be changed on an open decoder
+// skip_frame is set per packet as catch-up also uses it
+static void
+quality_apply(const quality_t * const q, AVCodecContext * const avctx)
+{
+    avctx->skip_loop_filter = q->level >= QUALITY_SKIP_LOOP_ALL ? AVDISCARD_ALL :
+        q->level >= QUALITY_SKIP_LOOP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    avctx->skip_idct = q->level >= QUALITY_SKIP_IDCT ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+static int64_t
+quality_period_ns(const play_env_t * const pe)
+{
+    AVRational rate = pe->video->avg_frame_rate;
+    if (rate.num <= 0 || rate.den <= 0)
+        rate = pe->video->r_frame_rate;
+    if (rate.num <= 0 || rate.den <= 0)
+        return 1000000000 / 60;
+    return av_rescale(1000000000, rate.den, rate.num);
+}
+
+// Called for each decoded frame. Re-evaluates the level once per window
+static void
+quality_update(play_env_t * const pe)
+{
+    quality_t * const q = &pe->quality;
+    unsigned int drops;
+    unsigned int load;
+    unsigned int level = q->level;
+
+    ++q->level_frames[q->level];
+    if (!q->enabled || ++q->frames < QUALITY_WINDOW)
+        return;
+
+    drops = atomic_load(&pe->late_drops) + vidout_wayland_discarded(pe->dpo);
+    load = (unsigned int)(q->busy_ns * 100 / (quality_period_ns(pe) * q->frames));
+
+    if (load > QUALITY_LOAD_HIGH || drops != q->drops_last) {
+        q->good_windows = 0;
+        if (level + 1 < QUALITY_LEVELS)
+            level = quality_step(q, level, 1);
+    }
+    else if (load < QUALITY_LOAD_LOW && ++q->good_windows >= QUALITY_UP_WINDOWS) {
+        q->good_windows = 0;
+        if (level > 0)
+            level = quality_step(q, level, -1);
+    }
+
+    if (level != q->level) {
+        ++q->changes;
+        printf("%sQuality: %s -> %s (decode load %u%%, %u new drops)\n", pe->name,
+               quality_names[q->level], quality_names[level], load, drops - q->drops_last);
+        q->level = level;
+        quality_apply(q, pe->decoder_ctx);
+    }
+
+    q->frames = 0;
+    q->busy_ns = 0;
+    q->drops_last = drops;
+}
+
+static void
+quality_stats_print(const char * const prefix, const quality_t * const q)
+{
+    unsigned int i;
+
+    if (!q->enabled)
+        return;
+    printf("%sQuality: %u level changes, final %s; frames per level:", prefix, q->changes, quality_names[q->level]);
+    for (i = 0; i != QUALITY_LEVELS; ++i)
+        printf(" %"PRIu64, q->level_frames[i]);
+    printf("\n");
+}
+
+// Pass a decoded frame to the present thread
+// Takes the ref from frame leaving it blank
+static int
+frame_queue_put(play_env_t * const pe, AVFrame * const frame, const AVRational time_base)
+{
+    frame_ent_t * fe;
+    int ret;
+
+    if ((fe = frame_ent_new(frame, time_base)) == NULL)
+        return AVERROR(ENOMEM);
+    fe->discont = pe->discont;
+    fe->tag = bench_frame_new(pe->bench);
+    if (fe->tag != 0) {
+        const int64_t t_arrive = arrival_find(&pe->arrivals,
+            fe->frame->pts != AV_NOPTS_VALUE ? fe->frame->pts : fe->frame->pkt_dts);
+        if (t_arrive != 0)
+            bench_stamp(pe->bench, fe->tag, BENCH_STAGE_ARRIVE, t_arrive);
+    }
+    pe->discont = false;
+    if (pe->dump != NULL)
+        fe->frame_rate = av_guess_frame_rate(pe->input_ctx, (AVStream *)pe->video, fe->frame);
+    // Blocks if the present thread is behind - the queue depth is
+    // our lookahead
+    if ((ret = ring_queue_put(pe->frame_q, fe, true)) != 0)
+        frame_ent_free(&fe);
+    return ret;
+}
+
+static int decode_write(play_env_t * const pe,
                         AVPacket *packet)
 {
-    AVFrame *frame = NULL, *sw_frame = NULL;
-    uint8_t *buffer = NULL;
-    int size;
+    AVCodecContext * const avctx = pe->decoder_ctx;
+    vid_out_env_t * const dpo = pe->dpo;
+    AVFrame *frame = NULL;
+    int64_t t0;
     int ret = 0;
 
+    // Skip non-ref frames whilst display is running late. Not all decoders
+    // honour this but it costs nothing to ask.
+    {
+        const bool catch_up = atomic_load(&pe->catch_up);
+        if (catch_up && packet != NULL)
+            ++pe->catch_up_pkts;
+        avctx->skip_frame = pe->trick != 0 ? AVDISCARD_NONKEY :
+            catch_up || pe->quality.level >= QUALITY_SKIP_NONREF ?
+                AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    }
+
+    t0 = time_ns(CLOCK_MONOTONIC);
     ret = avcodec_send_packet(avctx, packet);
+    pe->quality.busy_ns += time_ns(CLOCK_MONOTONIC) - t0;
     if (ret < 0) {
         fprintf(stderr, "Error during decoding\n");
         return ret;
     }
 
     for (;;) {
-        if (!(frame = av_frame_alloc()) || !(sw_frame = av_frame_alloc())) {
+        if (!(frame = av_frame_alloc())) {
             fprintf(stderr, "Can not alloc frame\n");
             ret = AVERROR(ENOMEM);
             goto fail;
         }
 
+        t0 = time_ns(CLOCK_MONOTONIC);
         ret = avcodec_receive_frame(avctx, frame);
+        pe->quality.busy_ns += time_ns(CLOCK_MONOTONIC) - t0;
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
             av_frame_free(&frame);
-            av_frame_free(&sw_frame);
             return 0;
         } else if (ret < 0) {
             fprintf(stderr, "Error while decoding\n");
             goto fail;
         }
+        quality_update(pe);
 
-        if (wants_deinterlace) {
-            if (init_filters(stream, avctx, "deinterlace_v4l2m2m", frame) < 0)
-                fprintf(stderr, "Failed to init deinterlace\n");
-            wants_deinterlace = false;
+        if (pe->wants_filter != NULL) {
+            if (init_filters(pe, pe->video, avctx, pe->wants_filter, frame) < 0)
+                fprintf(stderr, "Failed to init filter '%s'\n", pe->wants_filter);
+            pe->wants_filter = NULL;
         }
 
         // push the decoded frame into the filtergraph if it exists
-        if (filter_graph != NULL &&
-            (ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF)) < 0) {
+        if (pe->filter_graph != NULL &&
+            (ret = av_buffersrc_add_frame_flags(pe->buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF)) < 0) {
             fprintf(stderr, "Error while feeding the filtergraph\n");
             goto fail;
         }
 
         do {
-            AVRational time_base = stream->time_base;
-            if (filter_graph != NULL) {
+            AVRational time_base = pe->video->time_base;
+
+            if (pe->filter_graph != NULL) {
                 av_frame_unref(frame);
-                ret = av_buffersink_get_frame(buffersink_ctx, frame);
+                ret = av_buffersink_get_frame(pe->buffersink_ctx, frame);
                 if (ret == AVERROR(EAGAIN)) {
                     ret = 0;
                     break;
@@ -332,213 +842,1546 @@ static int decode_write(const AVStream * const stream,
                         fprintf(stderr, "Failed to get frame: %s", av_err2str(ret));
                     goto fail;
                 }
-                vidout_wayland_modeset(dpo, av_buffersink_get_w(buffersink_ctx), av_buffersink_get_h(buffersink_ctx), av_buffersink_get_time_base(buffersink_ctx));
-                time_base = av_buffersink_get_time_base(buffersink_ctx);
+                // S/w filters allocate their own output - it must be in a
+                // display buffer before we can show it
+                if ((ret = vidout_wayland_frame_to_pool(dpo, frame)) < 0) {
+                    fprintf(stderr, "Failed to move filter output to a display buffer\n");
+                    goto fail;
+                }
+                vidout_wayland_modeset(dpo, av_buffersink_get_w(pe->buffersink_ctx), av_buffersink_get_h(pe->buffersink_ctx), av_buffersink_get_time_base(pe->buffersink_ctx));
+                time_base = av_buffersink_get_time_base(pe->buffersink_ctx);
             }
             else {
                 vidout_wayland_modeset(dpo, avctx->coded_width, avctx->coded_height, avctx->framerate);
             }
 
-            if (!no_wait)
-                display_wait(frame, time_base);
-            vidout_wayland_display(dpo, frame);
-
-            if (output_file != NULL) {
-                AVFrame *tmp_frame;
-
-                if (frame->format == hw_pix_fmt) {
-                    /* retrieve data from GPU to CPU */
-                    if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0) {
-                        fprintf(stderr, "Error transferring the data to system memory\n");
-                        goto fail;
-                    }
-                    tmp_frame = sw_frame;
-                } else
-                    tmp_frame = frame;
-
-                size = av_image_get_buffer_size(tmp_frame->format, tmp_frame->width,
-                                                tmp_frame->height, 1);
-                buffer = av_malloc(size);
-                if (!buffer) {
-                    fprintf(stderr, "Can not alloc buffer\n");
-                    ret = AVERROR(ENOMEM);
-                    goto fail;
-                }
-                ret = av_image_copy_to_buffer(buffer, size,
-                                              (const uint8_t * const *)tmp_frame->data,
-                                              (const int *)tmp_frame->linesize, tmp_frame->format,
-                                              tmp_frame->width, tmp_frame->height, 1);
-                if (ret < 0) {
-                    fprintf(stderr, "Can not copy image to buffer\n");
-                    goto fail;
-                }
-
-                if ((ret = fwrite(buffer, 1, size, output_file)) < 0) {
-                    fprintf(stderr, "Failed to dump raw data.\n");
-                    goto fail;
-                }
-            }
-        } while (buffersink_ctx != NULL);  // Loop if we have a filter to drain
+            if ((ret = frame_queue_put(pe, frame, time_base)) != 0)
+                goto fail;
+        } while (pe->buffersink_ctx != NULL);  // Loop if we have a filter to drain
 
-        if (frames == 0 || --frames == 0)
+        if (pe->frames == 0 || --pe->frames == 0)
             ret = -1;
 
     fail:
         av_frame_free(&frame);
-        av_frame_free(&sw_frame);
-        av_freep(&buffer);
         if (ret < 0)
             return ret;
     }
     return 0;
 }
 
-static void log_callback_help(void *ptr, int level, const char *fmt, va_list vl)
+static void *
+present_thread(void * v)
 {
-    (void)ptr;
-    if (level <= ffdebug_level * 8) {
-        static uint64_t t0 = 0;
-        uint64_t now = time_us();
-        if (t0 == 0)
-            t0 = now;
-        printf("%4"PRId64".%03d: [%d] ", (now - t0)/1000000, (unsigned int)((now - t0) % 1000000) / 1000, level / 8);
-        vfprintf(stdout, fmt, vl);
+    play_env_t * const pe = v;
+    void * p;
+
+    while (ring_queue_get(pe->frame_q, &p, true) == 0 && p != NULL) {
+        frame_ent_t * fe = p;
+
+        if (pe->pattern) {
+            test_pattern_stamp_t stamp;
+            ++pe->pattern_checked;
+            if (test_pattern_stamp_read(fe->frame, &stamp) != 0) {
+                // Next frame will tell us where we are
+                ++pe->pattern_errs;
+                ++pe->pattern_next;
+            }
+            else {
+                // Count the gap (or reorder) once & resync on this frame
+                if (stamp.frame_no != pe->pattern_next)
+                    ++pe->pattern_errs;
+                pe->pattern_next = stamp.frame_no + 1;
+            }
+        }
+
+        if (no_wait || display_wait(pe, fe->frame, fe->time_base, fe->discont)) {
+            bench_stamp(pe->bench, fe->tag, BENCH_STAGE_DISPLAY_QUEUE, 0);
+            vidout_wayland_display_tag(pe->dpo, fe->frame, fe->tag);
+        }
+        else {
+            bench_drop(pe->bench, fe->tag);
+        }
+
+        if (pe->dump != NULL)
+            frame_dump_frame(pe->dump, fe->frame, fe->frame_rate);
+        if (pe->verify != NULL)
+            frame_verify_frame(pe->verify, fe->frame);
+
+        frame_ent_free(&fe);
     }
+    return NULL;
 }
 
-struct log_xlat_ss {
-    int lvl;
-    const char * name;
-} log_xlat[] =
+// Decode thread - runs until packet EOS, frame limit or error
+static void *
+decode_thread(void * v)
 {
-    {AV_LOG_QUIET,   "QUIET"},
-    {AV_LOG_PANIC,   "PANIC"},
-    {AV_LOG_FATAL,   "FATAL"},
-    {AV_LOG_ERROR,   "ERROR"},
-    {AV_LOG_WARNING, "WARNING"},
-    {AV_LOG_INFO,    "INFO"},
-    {AV_LOG_VERBOSE, "VERBOSE"},
-    {AV_LOG_DEBUG,   "DEBUG"},
-    {AV_LOG_TRACE,   "TRACE"},
-    {0, NULL}
-};
+    play_env_t * const pe = v;
+    AVPacket * pkt;
 
-int strtologlvl(const char * s)
+    while (readahead_get(pe->pkt_ra, &pkt) == 0) {
+        int ret;
+
+        if (pkt == NULL) {
+            /* flush the decoder */
+            decode_write(pe, NULL);
+            break;
+        }
+
+        ret = decode_write(pe, pkt);
+        av_packet_free(&pkt);
+
+        if (ret < 0) {
+            // Stop demux - anything left in the queue is freed once it exits
+            readahead_abort(pe->pkt_ra);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Another s/w decoder like pe->decoder_ctx for GOP parallel decode
+// Each one is single threaded - the parallelism comes from decoding
+// GOPs side by side
+static AVCodecContext *
+gop_decoder_open(void * v)
 {
-    size_t slen = strlen(s);
-    long lvl;
-    char * p;
+    play_env_t * const pe = v;
+    const AVCodecContext * const src = pe->decoder_ctx;
+    AVCodecContext * ctx;
+    AVDictionary * opts = NULL;
+    int ret;
+
+    if ((ctx = avcodec_alloc_context3(src->codec)) == NULL)
+        return NULL;
+    if (avcodec_parameters_to_context(ctx, pe->video->codecpar) < 0)
+        goto fail;
+
+    // Default allocator - GOPs in flight hold many frames which would pin
+    // the output's dmabuf pool. Frames are copied into it on display.
+    ctx->thread_count = 1;
+    ctx->flags = src->flags;
+    ctx->lowres = src->lowres;
+    // Quality is fixed at the level the item started with
+    ctx->skip_frame = pe->trick != 0 ? AVDISCARD_NONKEY : src->skip_frame;
+    ctx->skip_loop_filter = src->skip_loop_filter;
+    ctx->skip_idct = src->skip_idct;
+
+    av_dict_copy(&opts, codec_opts, 0);
+    ret = avcodec_open2(ctx, src->codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0)
+        goto fail;
+    return ctx;
 
-    if (slen == 0)
-        return -99;
+fail:
+    avcodec_free_context(&ctx);
+    return NULL;
+}
 
-    for (int i = 0; log_xlat[i].name != NULL; ++i) {
-        if (strncasecmp(s, log_xlat[i].name, slen) == 0)
-            return log_xlat[i].lvl;
+// Called in pts order from the GOP output thread
+static int
+gop_frame_out(void * v, AVFrame * frame)
+{
+    play_env_t * const pe = v;
+    int ret;
+
+    vidout_wayland_modeset(pe->dpo, frame->width, frame->height, pe->decoder_ctx->framerate);
+    ret = frame_queue_put(pe, frame, pe->video->time_base);
+    av_frame_free(&frame);
+    if (ret == 0 && (pe->frames == 0 || --pe->frames == 0))
+        ret = -1;
+    return ret;
+}
+
+// GOP parallel replacement for decode_thread
+static void *
+gop_decode_thread(void * v)
+{
+    play_env_t * const pe = v;
+    gop_decode_t * gd;
+    AVPacket * pkt;
+
+    if ((gd = gop_decode_new(pe->gop_decoders, gop_decoder_open, gop_frame_out, pe)) == NULL) {
+        fprintf(stderr, "Failed to start %u GOP decoders\n", pe->gop_decoders);
+        readahead_abort(pe->pkt_ra);
+        return NULL;
     }
 
-    lvl = strtol(s, &p, 0);
-    if (*p == 0)
-        return (int)(lvl * 8);
+    while (readahead_get(pe->pkt_ra, &pkt) == 0) {
+        const bool eos = (pkt == NULL);
 
-    return -99;
+        if (gop_decode_packet(gd, pkt) != 0) {
+            readahead_abort(pe->pkt_ra);
+            break;
+        }
+        if (eos)
+            break;
+    }
+
+    // Waits for the last GOPs to be output
+    gop_decode_delete(&gd, pe->name);
+    return NULL;
 }
 
-void usage()
+// Input pacing (--pace-input)
+// Packets are released on an absolute CLOCK_MONOTONIC schedule
+// start + n * period so wakeup jitter never accumulates. If we fall more
+// than PACE_REBASE_PERIODS behind the schedule restarts from now.
+#define PACE_REBASE_PERIODS 8
+
+typedef struct pace_s {
+    int64_t start_ns;
+    uint64_t n;                 // Packets released since start
+    long hz;
+    // Wakeup error stats - how late we woke vs the deadline
+    uint64_t count;
+    uint64_t overruns;          // Deadline already passed before sleeping
+    uint64_t rebases;
+    int64_t err_max;
+    double err_sum;
+    double err_sum2;
+} pace_t;
+
+static void
+pace_init(pace_t * const pc, const long hz)
 {
-    fprintf(stderr,
-            "Usage: hello_wayland [-e]\n"
-            "                     [-l <loop_count>] [-f <frames>] [-o <yuv_output_file>]\n"
-            "                     [--deinterlace] [--pace-input <hz>] [--fullscreen]\n"
-            "                     [-O <codec opts>] [--ffdebug <debug level>] [--low-delay]\n"
-            "                     "
-#if HAS_RUNTICKER
-            "[--ticker <text>] "
-#endif
-#if HAS_RUNCUBE
-            "[--cube] "
-#endif
-            "[--no-wait]\n"
-            "                     <input file> [<input_file> ...]\n\n"
-            " -e        Use EGL to render video (otherwise direct dmabuf)\n"
-            " -l        Loop video playback <loop_count> times. -1 means forever\n"
-            " --cube    Show rotating cube\n"
-            " --ticker  Show scrolling ticker with <text> repeated indefinitely\n"
-            " --no-wait Decode at max speed, do not wait for display\n");
-    exit(1);
+    *pc = (pace_t){.hz = hz};
+    // Allow a few ms so we aren't behind at startup
+    pc->start_ns = time_ns(CLOCK_MONOTONIC) + 3000000;
 }
 
-int main(int argc, char *argv[])
+static void
+pace_wait(pace_t * const pc)
 {
-    AVFormatContext *input_ctx = NULL;
-    int video_stream, ret;
-    AVStream *video = NULL;
-    AVCodecContext *decoder_ctx = NULL;
-#if LIBAVFORMAT_VERSION_MAJOR >= 59
-    const AVCodec *decoder = NULL;
-#else
-    AVCodec *decoder = NULL;
-#endif
-    AVPacket packet;
-    enum AVHWDeviceType type;
-    const char * in_file;
-    char * const * in_filelist;
-    unsigned int in_count;
-    unsigned int in_n = 0;
-    const char * hwdev = "drm";
-    int i;
-    vid_out_env_t * dpo;
-    long loop_count = 1;
-    long frame_count = -1;
-    const char * out_name = NULL;
-    bool low_delay = false;
-    long pace_input_hz = 0;
-    bool try_hw = true;
-    bool use_dmabuf = true;
-    bool fullscreen = false;
-#if HAS_RUNCUBE
-    bool wants_cube = false;
-#endif
-#if HAS_RUNTICKER
-    const char * ticker_text = NULL;
-#endif
+    const int64_t deadline = pc->start_ns + (int64_t)(pc->n * 1000000000 / pc->hz);
+    int64_t now = time_ns(CLOCK_MONOTONIC);
+    int64_t err;
+
+    if (now >= deadline) {
+        ++pc->overruns;
+        if (now - deadline > PACE_REBASE_PERIODS * 1000000000LL / pc->hz) {
+            ++pc->rebases;
+            pc->start_ns = now;
+            pc->n = 1;
+            return;
+        }
+    }
+    else {
+        sleep_until_ns(CLOCK_MONOTONIC, deadline);
+        now = time_ns(CLOCK_MONOTONIC);
+    }
 
-    {
-        char * const * a = argv + 1;
-        int n = argc - 1;
+    err = now - deadline;
+    ++pc->count;
+    pc->err_sum += (double)err;
+    pc->err_sum2 += (double)err * (double)err;
+    if (err > pc->err_max)
+        pc->err_max = err;
+    ++pc->n;
+}
 
-        while (n-- > 0 && a[0][0] == '-') {
-            const char *arg = *a++;
-            char *e;
+static void
+pace_stats_print(const char * const prefix, const pace_t * const pc)
+{
+    const double mean = pc->count == 0 ? 0 : pc->err_sum / pc->count;
+    const double var = pc->count < 2 ? 0 : (pc->err_sum2 - pc->count * mean * mean) / (pc->count - 1);
 
-            if (strcmp(arg, "-l") == 0 || strcmp(arg, "--loop") == 0) {
-                if (n == 0)
-                    usage();
-                loop_count = strtol(*a, &e, 0);
-                if (*e != 0)
-                    usage();
-                --n;
-                ++a;
+    printf("%sPace: %"PRIu64" packets at %ldHz, wakeup error mean %.1fus, sd %.1fus, max %.1fus; %"PRIu64" overruns, %"PRIu64" rebases\n",
+           prefix, pc->count, pc->hz, mean / 1000, var <= 0 ? 0.0 : sqrt(var) / 1000, pc->err_max / 1000.0,
+           pc->overruns, pc->rebases);
+}
+
+// Demux thread - reads until EOF or the decoder stops
+static void *
+demux_thread(void * v)
+{
+    play_env_t * const pe = v;
+    AVPacket * packet = NULL;
+    pace_t pace;
+    int pts_seen = 0;
+    int64_t fake_ts = 0;
+    int64_t last_key_ts = INT64_MIN;
+
+    if (pe->pace_input_hz > 0)
+        pace_init(&pace, pe->pace_input_hz);
+
+    for (;;) {
+        int64_t key_ts = AV_NOPTS_VALUE;
+
+        if (packet == NULL && (packet = av_packet_alloc()) == NULL)
+            break;
+
+        if (av_read_frame(pe->input_ctx, packet) < 0)
+            break;
+
+        if (pe->video_stream != packet->stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        // Trick play: only keyframes go to the decoder. A seek may land a
+        // little early so ignore any keyframe we have already sent.
+        if (pe->trick != 0) {
+            key_ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+            if ((packet->flags & AV_PKT_FLAG_KEY) == 0 ||
+                (key_ts != AV_NOPTS_VALUE && key_ts <= last_key_ts)) {
+                av_packet_unref(packet);
+                continue;
+            }
+        }
+
+        if (pe->pace_input_hz > 0) {
+            pace_wait(&pace);
+
+            if (packet->pts != AV_NOPTS_VALUE) {
+                pts_seen = 1;
+            }
+            else if (!pts_seen) {
+                packet->dts = fake_ts;
+                packet->pts = fake_ts;
+                fake_ts += 90000 / pe->pace_input_hz;
+            }
+        }
+
+        if (pe->bench != NULL)
+            arrival_add(&pe->arrivals, packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts,
+                        time_ns(pe->clock_id));
+
+        if (readahead_put(pe->pkt_ra, packet) != 0) {
+            // Decoder has stopped
+            av_packet_free(&packet);
+            break;
+        }
+        packet = NULL;
+
+        // With an index we can jump straight to the next keyframe rather
+        // than reading everything in between
+        if (key_ts != AV_NOPTS_VALUE) {
+            kf_index_entry_t ent;
+            last_key_ts = key_ts;
+            if (pe->kfi != NULL && kf_index_next(pe->kfi, key_ts, &ent) == 0)
+                kf_index_seek(pe->kfi, pe->input_ctx, pe->video_stream, ent.pts);
+        }
+    }
+
+    av_packet_free(&packet);
+    // EOS - fails harmlessly if the decoder has already stopped
+    readahead_put(pe->pkt_ra, NULL);
+    if (pe->pace_input_hz > 0)
+        pace_stats_print(pe->name, &pace);
+    return NULL;
+}
+
+// Run demux & decode for the currently open input
+// Returns when the input is exhausted or the decoder stops
+static int
+play_input_run(play_env_t * const pe)
+{
+    if ((pe->pkt_ra = readahead_new(&pe->pkt_limits)) == NULL)
+        return AVERROR(ENOMEM);
+    readahead_time_base_set(pe->pkt_ra, pe->video->time_base);
+
+    if (pthread_create(&pe->decode_thread, NULL,
+                       pe->gop_decoders != 0 ? gop_decode_thread : decode_thread, pe) != 0) {
+        fprintf(stderr, "Failed to create decode thread\n");
+        readahead_delete(&pe->pkt_ra);
+        return AVERROR(EINVAL);
+    }
+    if (pthread_create(&pe->demux_thread, NULL, demux_thread, pe) != 0) {
+        fprintf(stderr, "Failed to create demux thread\n");
+        // Let the decoder see EOS
+        readahead_put(pe->pkt_ra, NULL);
+    }
+    else {
+        pthread_join(pe->demux_thread, NULL);
+    }
+    pthread_join(pe->decode_thread, NULL);
+
+    readahead_stats_print(pe->name, pe->pkt_ra);
+    readahead_delete(&pe->pkt_ra);
+    return 0;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+typedef const AVCodec * avcodec_ptr_t;
+#else
+typedef AVCodec * avcodec_ptr_t;
+#endif
+
+// An opened & probed input
+// The next playlist item is opened on a background thread whilst the
+// current one plays so that the probe time doesn't show as a gap
+typedef struct input_ent_s {
+    const char * name;
+    AVFormatContext * ctx;
+    AVIOContext * pb;           // Custom (mmap) I/O, NULL if normal I/O
+    kf_index_t * kfi;           // NULL if not indexing
+    int video_stream;
+    avcodec_ptr_t decoder;
+    int ret;
+    bool thread_ok;
+    pthread_t thread;
+} input_ent_t;
+
+static void
+input_close(input_ent_t * const ie)
+{
+    kf_index_close(&ie->kfi);
+    avformat_close_input(&ie->ctx);
+    // Custom I/O isn't freed by avformat
+    mmap_avio_close(&ie->pb);
+    ie->decoder = NULL;
+    ie->video_stream = -1;
+}
+
+static int
+input_open(input_ent_t * const ie)
+{
+    int ret;
+
+    // Falls back to the normal file protocol if the input can't be mapped
+    if (use_mmap && (ie->pb = mmap_avio_open(ie->name)) != NULL) {
+        if ((ie->ctx = avformat_alloc_context()) == NULL)
+            goto fail;
+        ie->ctx->pb = ie->pb;
+        ie->ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    // Live: start on the first decodable packet rather than waiting to
+    // learn about the stream & don't hold packets back once we have
+    if (live_mode) {
+        if (ie->ctx == NULL && (ie->ctx = avformat_alloc_context()) == NULL)
+            goto fail;
+        ie->ctx->probesize = LIVE_PROBESIZE;
+        ie->ctx->max_analyze_duration = LIVE_ANALYZE_US;
+        ie->ctx->flags |= AVFMT_FLAG_NOBUFFER | AVFMT_FLAG_FLUSH_PACKETS;
+    }
+
+    if (avformat_open_input(&ie->ctx, ie->name, NULL, NULL) != 0) {
+        fprintf(stderr, "Cannot open input file '%s'\n", ie->name);
+        goto fail;
+    }
+
+    if (avformat_find_stream_info(ie->ctx, NULL) < 0) {
+        fprintf(stderr, "Cannot find input stream information.\n");
+        goto fail;
+    }
+
+    /* find the video stream information */
+    ret = av_find_best_stream(ie->ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &ie->decoder, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot find a video stream in the input file\n");
+        goto fail;
+    }
+    ie->video_stream = ret;
+
+    // Loads the sidecar or starts indexing in the background
+    if (use_kf_index)
+        ie->kfi = kf_index_open(ie->name);
+    return 0;
+
+fail:
+    input_close(ie);
+    return -1;
+}
+
+static void *
+input_open_thread(void * v)
+{
+    input_ent_t * const ie = v;
+    ie->ret = input_open(ie);
+    return NULL;
+}
+
+// Start opening name in the background
+static void
+input_preopen_start(input_ent_t * const ie, const char * const name)
+{
+    *ie = (input_ent_t){.name = name, .video_stream = -1};
+    if (pthread_create(&ie->thread, NULL, input_open_thread, ie) == 0)
+        ie->thread_ok = true;
+}
+
+// Wait for the background open to complete - opens synchronously if the
+// thread couldn't be started
+static int
+input_preopen_wait(input_ent_t * const ie)
+{
+    if (!ie->thread_ok)
+        return input_open(ie);
+    pthread_join(ie->thread, NULL);
+    ie->thread_ok = false;
+    return ie->ret;
+}
+
+// Wait for any background open & discard the result
+static void
+input_preopen_cancel(input_ent_t * const ie)
+{
+    if (ie->thread_ok) {
+        pthread_join(ie->thread, NULL);
+        ie->thread_ok = false;
+    }
+    input_close(ie);
+}
+
+// Seek back to the start rather than reopen for single file loops
+static int
+input_rewind(input_ent_t * const ie)
+{
+    const AVStream * const st = ie->ctx->streams[ie->video_stream];
+    const int64_t ts = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+
+    if (av_seek_frame(ie->ctx, ie->video_stream, ts, AVSEEK_FLAG_BACKWARD) < 0)
+        return -1;
+    avformat_flush(ie->ctx);
+    return 0;
+}
+
+// Can a decoder opened with params a decode a stream with params b after
+// a flush?
+static bool
+decoder_reusable(const AVCodecParameters * const a, const AVCodecParameters * const b)
+{
+    return a->codec_id == b->codec_id &&
+        a->width == b->width && a->height == b->height &&
+        a->format == b->format &&
+        a->profile == b->profile &&
+        a->extradata_size == b->extradata_size &&
+        (b->extradata_size == 0 ||
+         memcmp(a->extradata, b->extradata, b->extradata_size) == 0);
+}
+
+static AVCodecContext *
+decoder_open(const input_ent_t * const ie, vid_out_env_t * const dpo, const enum AVHWDeviceType type,
+             bool * const p_try_hw, const bool low_delay, const unsigned int lowres,
+             enum AVPixelFormat * const p_hw_pix_fmt)
+{
+    enum AVPixelFormat hw_pix_fmt;
+    const AVStream * const video = ie->ctx->streams[ie->video_stream];
+    avcodec_ptr_t decoder = ie->decoder;
+    AVCodecContext * decoder_ctx;
+    AVDictionary * opts = NULL;
+    int i;
+    int ret;
+
+retry_hw:
+    hw_pix_fmt = AV_PIX_FMT_NONE;
+    if (!*p_try_hw) {
+        /* Nothing */
+    }
+    else if (decoder->id == AV_CODEC_ID_H264) {
+        if ((decoder = avcodec_find_decoder_by_name("h264_v4l2m2m")) == NULL)
+            fprintf(stderr, "Cannot find the h264 v4l2m2m decoder\n");
+        else
+            hw_pix_fmt = AV_PIX_FMT_DRM_PRIME;
+    }
+    else {
+        for (i = 0;; i++) {
+            const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
+            if (!config) {
+                fprintf(stderr, "Decoder %s does not support device type %s.\n",
+                        decoder->name, av_hwdevice_get_type_name(type));
+                break;
+            }
+            if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
+                config->device_type == type) {
+                hw_pix_fmt = config->pix_fmt;
+                break;
+            }
+        }
+    }
+
+    if (hw_pix_fmt == AV_PIX_FMT_NONE && *p_try_hw) {
+        fprintf(stderr, "No h/w format found - trying s/w\n");
+        *p_try_hw = false;
+        decoder = ie->decoder;
+    }
+
+    if (!(decoder_ctx = avcodec_alloc_context3(decoder)))
+        return NULL;
+
+    if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
+        goto fail;
+
+    if (*p_try_hw) {
+        // Must outlive the decoder
+        *p_hw_pix_fmt = hw_pix_fmt;
+        decoder_ctx->opaque = p_hw_pix_fmt;
+        decoder_ctx->get_format  = get_hw_format;
+
+        if (hw_decoder_init(decoder_ctx, type) < 0)
+            goto fail;
+
+        decoder_ctx->pix_fmt = AV_PIX_FMT_DRM_PRIME;
+        decoder_ctx->sw_pix_fmt = AV_PIX_FMT_NONE;
+
+        decoder_ctx->thread_count = 3;
+    }
+    else {
+        decoder_ctx->get_buffer2 = vidout_wayland_get_buffer2;
+        decoder_ctx->opaque = dpo;
+        decoder_ctx->thread_count = 0; // FFmpeg will pick a default
+    }
+    decoder_ctx->flags = low_delay ? AV_CODEC_FLAG_LOW_DELAY : 0;
+    decoder_ctx->lowres = FFMIN((int)lowres, decoder->max_lowres);
+    // Pick any threading method
+    decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+#if LIBAVCODEC_VERSION_MAJOR < 60
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+    decoder_ctx->thread_safe_callbacks = 1;
+#pragma GCC diagnostic pop
+#endif
+
+    // Open with a copy so every decoder gets the full set
+    av_dict_copy(&opts, codec_opts, 0);
+    ret = avcodec_open2(decoder_ctx, decoder, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        if (*p_try_hw) {
+            *p_try_hw = false;
+            avcodec_free_context(&decoder_ctx);
+            decoder = ie->decoder;
+
+            printf("H/w init failed - trying s/w\n");
+            goto retry_hw;
+        }
+        fprintf(stderr, "Failed to open codec for stream #%u\n", ie->video_stream);
+        goto fail;
+    }
+
+    printf("Pixfmt after init: %s / %s\n", av_get_pix_fmt_name(decoder_ctx->pix_fmt), av_get_pix_fmt_name(decoder_ctx->sw_pix_fmt));
+    return decoder_ctx;
+
+fail:
+    avcodec_free_context(&decoder_ctx);
+    return NULL;
+}
+
+// Settings shared by every stream
+typedef struct play_opts_s {
+    enum AVHWDeviceType type;
+    bool try_hw;
+    bool low_delay;
+    bool wants_deinterlace;
+    const char * vf;            // S/w (or h/w) filter graph, NULL = none
+    long frame_count;           // Per item, -1 = no limit
+    long loop_count;            // Items to play in total, -1 = forever
+    long items_per_run;         // Items per bench run, 0 = a single run
+    bool adapt_quality;
+    int64_t seek_us;            // Start position of the first item, -1 = none
+    unsigned int trick;         // Keyframe only fast forward rate, 0 = off
+    unsigned int gop_decoders;  // GOP parallel decoders, 0 = off
+} play_opts_t;
+
+static int
+present_start(play_env_t * const pe, const unsigned int depth)
+{
+    if ((pe->frame_q = ring_queue_new(depth)) == NULL)
+        return -1;
+    if (pthread_create(&pe->present_thread, NULL, present_thread, pe) != 0) {
+        ring_queue_delete(&pe->frame_q);
+        return -1;
+    }
+    return 0;
+}
+
+// Let the present thread finish what it has queued
+static void
+present_stop(play_env_t * const pe)
+{
+    ring_queue_put(pe->frame_q, NULL, true);
+    pthread_join(pe->present_thread, NULL);
+    queue_stats_print(pe->name, "Frame", pe->frame_q);
+    printf("%sLate: dropped %u frames before display, %u catch-ups, %u packets decoded in catch-up\n",
+           pe->name, atomic_load(&pe->late_drops), atomic_load(&pe->catch_up_runs), pe->catch_up_pkts);
+    quality_stats_print(pe->name, &pe->quality);
+    if (pe->pattern)
+        printf("%sPattern: %u frames checked, %u stamp errors\n", pe->name, pe->pattern_checked, pe->pattern_errs);
+    ring_queue_delete(&pe->frame_q);
+}
+
+// Play the count files in filelist in order until opts->loop_count items
+// have been played. pe's present thread must be running.
+static int
+playlist_run(play_env_t * const pe, const play_opts_t * const opts,
+             char * const * const filelist, const unsigned int count)
+{
+    int ret = 0;
+    AVCodecContext *decoder_ctx = NULL;
+    AVCodecParameters *decoder_par = NULL;  // Params decoder_ctx was opened with
+    input_ent_t cur = {.video_stream = -1};
+    input_ent_t next = {.video_stream = -1};
+    unsigned int in_n = 0;
+    long loop_count = opts->loop_count;
+    long item_no = 0;
+    bool try_hw = opts->try_hw;
+    unsigned int lowres = 0;    // lowres decoder_ctx was opened with
+
+    pe->quality.enabled = opts->adapt_quality;
+
+    if ((decoder_par = avcodec_parameters_alloc()) == NULL)
+        return -1;
+    input_preopen_start(&next, filelist[in_n]);
+
+    for (;;) {
+        const bool more = (loop_count == -1 || loop_count > 1);
+        const AVCodecParameters * par;
+
+        if (item_no == 0 || (opts->items_per_run != 0 && item_no % opts->items_per_run == 0))
+            bench_run_start(pe->bench);
+        ++item_no;
+
+        if (next.name != NULL) {
+            // Switch to the pre-opened input
+            input_close(&cur);
+            if (input_preopen_wait(&next) != 0) {
+                ret = -1;
+                break;
+            }
+            cur = next;
+            next = (input_ent_t){.video_stream = -1};
+        }
+        if (++in_n >= count)
+            in_n = 0;
+
+        // Open the next item whilst this one plays
+        if (more && count > 1)
+            input_preopen_start(&next, filelist[in_n]);
+
+        // Reuse the decoder if we can - a flush is much quicker than
+        // close & reopen, especially for h/w decoders
+        par = cur.ctx->streams[cur.video_stream]->codecpar;
+        // lowres can only change on open
+        if (decoder_ctx != NULL && decoder_reusable(decoder_par, par) &&
+            lowres == quality_lowres(&pe->quality)) {
+            avcodec_flush_buffers(decoder_ctx);
+        }
+        else {
+            if (decoder_ctx != NULL) {
+                avcodec_free_context(&decoder_ctx);
+                // Don't keep the old decoder's buffers alive
+                vidout_wayland_import_cache_flush(pe->dpo);
+            }
+            lowres = quality_lowres(&pe->quality);
+            decoder_ctx = decoder_open(&cur, pe->dpo, opts->type, &try_hw, opts->low_delay, lowres,
+                                       &pe->hw_pix_fmt);
+            if (decoder_ctx == NULL || avcodec_parameters_copy(decoder_par, par) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+        quality_apply(&pe->quality, decoder_ctx);
+        // lowres is only worth stepping to if a reopen will pick it up
+        pe->quality.lowres_ok = more && decoder_ctx->hw_device_ctx == NULL &&
+            decoder_ctx->codec->max_lowres > 0;
+
+        /* actual decoding and dump the raw data */
+        pe->input_ctx = cur.ctx;
+        pe->decoder_ctx = decoder_ctx;
+        pe->video = cur.ctx->streams[cur.video_stream];
+        pe->video_stream = cur.video_stream;
+        pe->wants_filter = opts->vf != NULL ? opts->vf :
+            opts->wants_deinterlace ? "deinterlace_v4l2m2m" : NULL;
+        pe->frames = opts->frame_count;
+        pe->trick = opts->trick;
+        pe->gop_decoders = opts->gop_decoders;
+        pe->kfi = cur.kfi;
+
+        if (item_no == 1 && opts->seek_us >= 0) {
+            const AVStream * const st = cur.ctx->streams[cur.video_stream];
+            const int64_t ts = av_rescale_q(opts->seek_us, AV_TIME_BASE_Q, st->time_base) +
+                (st->start_time != AV_NOPTS_VALUE ? st->start_time : 0);
+            if (kf_index_seek(cur.kfi, cur.ctx, cur.video_stream, ts) < 0)
+                fprintf(stderr, "Seek to %"PRId64"ms failed\n", opts->seek_us / 1000);
+        }
+        pe->discont = true;
+        play_input_run(pe);
+
+        // Filter output pools go with the graph
+        if (pe->filter_graph != NULL) {
+            avfilter_graph_free(&pe->filter_graph);
+            vidout_wayland_import_cache_flush(pe->dpo);
+        }
+        pe->buffersrc_ctx = NULL;
+        pe->buffersink_ctx = NULL;
+
+        if (!more)
+            break;
+        if (loop_count != -1)
+            --loop_count;
+
+        // Single file loop - seek back to the start if possible
+        if (count == 1 && input_rewind(&cur) != 0)
+            input_preopen_start(&next, filelist[0]);
+    }
+
+    input_preopen_cancel(&next);
+    avcodec_free_context(&decoder_ctx);
+    vidout_wayland_import_cache_flush(pe->dpo);
+    avcodec_parameters_free(&decoder_par);
+    input_close(&cur);
+
+    return ret;
+}
+
+// Synthetic source (--pattern) - frames are drawn straight into display
+// buffers & queued for present with no demux or decode so the display
+// path can be measured on its own. Runs until opts->frame_count frames
+// (-1 = forever). pe's present thread must be running.
+static int
+pattern_run(play_env_t * const pe, const play_opts_t * const opts,
+            const int format, const int width, const int height, const double rate)
+{
+    const AVRational frame_rate = av_d2q(rate, 1000000);
+    const AVRational time_base = av_inv_q(frame_rate);
+    long frames = opts->frame_count;
+    uint32_t n;
+    int ret = 0;
+
+    pe->pattern = true;
+    bench_run_start(pe->bench);
+    vidout_wayland_modeset(pe->dpo, width, height, frame_rate);
+
+    for (n = 0; frames != 0; ++n) {
+        const test_pattern_stamp_t stamp = {
+            .frame_no = n,
+            .t_us = (uint32_t)(time_ns(pe->clock_id) / 1000),
+        };
+        AVFrame * frame = vidout_wayland_frame_alloc(pe->dpo, format, width, height);
+        frame_ent_t * fe;
+
+        if (frame == NULL) {
+            fprintf(stderr, "Failed to allocate pattern frame\n");
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        test_pattern_draw(frame, &stamp);
+        frame->pts = n;
+        frame->best_effort_timestamp = n;
+
+        fe = frame_ent_new(frame, time_base);
+        av_frame_free(&frame);
+        if (fe == NULL) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        fe->discont = (n == 0);
+        fe->frame_rate = frame_rate;
+        fe->tag = bench_frame_new(pe->bench);
+        // Paced by present (unless --no-wait) through the queue depth
+        if ((ret = ring_queue_put(pe->frame_q, fe, true)) != 0) {
+            frame_ent_free(&fe);
+            break;
+        }
+
+        if (frames > 0)
+            --frames;
+    }
+
+    printf("Pattern: %u %dx%d %s frames generated at %.3ffps\n", n, width, height,
+           av_get_pix_fmt_name(format), rate);
+    return ret;
+}
+
+// Mosaic tile - one input playing in its own part of the window
+typedef struct mosaic_tile_s {
+    play_env_t pe;
+    char name[24];
+    char * const * filelist;
+    const play_opts_t * opts;
+    int ret;
+    bool thread_ok;
+    pthread_t thread;
+} mosaic_tile_t;
+
+static void *
+mosaic_tile_thread(void * v)
+{
+    mosaic_tile_t * const mt = v;
+    mt->ret = playlist_run(&mt->pe, mt->opts, mt->filelist, 1);
+    return NULL;
+}
+
+// Play every input at once, each in its own tile of dpo's window
+// Each tile has its own demux, decode & present threads so independent
+// streams spread across cores; tmpl gives the queue settings.
+// If benches isn't NULL tile n is timed by benches[n].
+static int
+mosaic_run(vid_out_env_t * const dpo, const play_env_t * const tmpl, const play_opts_t * const opts,
+           char * const * const filelist, const unsigned int count, const unsigned int frame_q_depth,
+           bench_t * const * const benches)
+{
+    mosaic_tile_t * const tiles = calloc(count, sizeof(*tiles));
+    unsigned int i;
+    int ret = 0;
+
+    if (tiles == NULL)
+        return -1;
+
+    for (i = 0; i != count; ++i) {
+        mosaic_tile_t * const mt = tiles + i;
+        play_env_t * const pe = &mt->pe;
+
+        snprintf(mt->name, sizeof(mt->name), "Tile %u: ", i);
+        mt->filelist = filelist + i;
+        mt->opts = opts;
+        pe->name = mt->name;
+        pe->pace_input_hz = tmpl->pace_input_hz;
+        pe->pkt_limits = tmpl->pkt_limits;
+
+        if ((pe->dpo = vidout_wayland_tile_new(dpo, i, count)) == NULL) {
+            fprintf(stderr, "Failed to create tile %u\n", i);
+            ret = -1;
+            break;
+        }
+        pe->clock_id = vidout_wayland_clock_id(pe->dpo);
+        if (benches != NULL) {
+            pthread_mutex_init(&pe->arrivals.lock, NULL);
+            pe->bench = benches[i];
+            vidout_wayland_bench_set(pe->dpo, pe->bench);
+        }
+        if (present_start(pe, frame_q_depth) != 0) {
+            fprintf(stderr, "Failed to start present thread for tile %u\n", i);
+            ret = -1;
+            break;
+        }
+        if (pthread_create(&mt->thread, NULL, mosaic_tile_thread, mt) != 0) {
+            fprintf(stderr, "Failed to start tile %u\n", i);
+            ret = -1;
+            break;
+        }
+        mt->thread_ok = true;
+    }
+
+    for (i = 0; i != count; ++i) {
+        mosaic_tile_t * const mt = tiles + i;
+
+        if (mt->thread_ok) {
+            pthread_join(mt->thread, NULL);
+            if (mt->ret != 0)
+                ret = mt->ret;
+        }
+        if (mt->pe.frame_q != NULL)
+            present_stop(&mt->pe);
+        vidout_wayland_delete(mt->pe.dpo);
+        if (mt->pe.bench != NULL)
+            pthread_mutex_destroy(&mt->pe.arrivals.lock);
+    }
+    free(tiles);
+    return ret;
+}
+
+// Capacity limits for --density - a step that exceeds any of them fails
+typedef struct density_slo_s {
+    double drop_pct;            // Dropped before display
+    double discard_pct;         // Discarded by the compositor
+    double p99_ms;              // Receive to presented latency
+} density_slo_t;
+
+typedef struct density_sampler_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    uint64_t dmabuf_peak_bytes;
+    unsigned int dmabuf_peak_count;
+    pthread_t thread;
+} density_sampler_t;
+
+// dmabuf usage is only interesting whilst the streams are running so
+// sample it periodically & keep the peak
+static void *
+density_sampler_thread(void * v)
+{
+    density_sampler_t * const ds = v;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ds->lock);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    while (!ds->stop) {
+        proc_stats_t ps;
+
+        pthread_mutex_unlock(&ds->lock);
+        proc_stats_sample(&ps);
+        pthread_mutex_lock(&ds->lock);
+        if (ps.dmabuf_bytes > ds->dmabuf_peak_bytes) {
+            ds->dmabuf_peak_bytes = ps.dmabuf_bytes;
+            ds->dmabuf_peak_count = ps.dmabuf_count;
+        }
+
+        ts.tv_nsec += DENSITY_SAMPLE_MS * 1000000;
+        while (ts.tv_nsec >= 1000000000) {
+            ts.tv_nsec -= 1000000000;
+            ++ts.tv_sec;
+        }
+        while (!ds->stop && pthread_cond_timedwait(&ds->cond, &ds->lock, &ts) == 0)
+            /* loop */;
+    }
+    pthread_mutex_unlock(&ds->lock);
+    return NULL;
+}
+
+// Ramp the number of streams played at once (as mosaic tiles, inputs used
+// in rotation) from 1 until a step breaks the SLOs or max_streams is
+// reached. Each step plays opts->frame_count frames per stream.
+// Prints the stats for every step & the highest count that passed.
+static int
+density_run(vid_out_env_t * const dpo, const play_env_t * const tmpl, const play_opts_t * const opts,
+            char * const * const filelist, const unsigned int count, const unsigned int frame_q_depth,
+            const unsigned int max_streams, const unsigned int bench_warmup, const density_slo_t * const slo)
+{
+    const unsigned int cpus = proc_stats_cpus();
+    char ** const names = calloc(max_streams, sizeof(*names));
+    bench_t ** const benches = calloc(max_streams, sizeof(*benches));
+    unsigned int best = 0;
+    unsigned int n;
+    int ret = 0;
+
+    if (names == NULL || benches == NULL) {
+        ret = -1;
+        goto fail;
+    }
+    for (n = 0; n != max_streams; ++n)
+        names[n] = filelist[n % count];
+
+    printf("Density: up to %u streams, SLOs: drops <= %.2f%%, discards <= %.2f%%, p99 latency <= %.1fms\n",
+           max_streams, slo->drop_pct, slo->discard_pct, slo->p99_ms);
+
+    for (n = 1; n <= max_streams; ++n) {
+        density_sampler_t ds = {.stop = false};
+        pthread_condattr_t attr;
+        proc_stats_t ps0, ps1;
+        uint64_t pq_busy0, pq_idle0, pq_busy1, pq_idle1;
+        bench_summary_t total = {0};
+        int64_t p99_ns = 0;
+        double drop_pct, discard_pct, cpu_pct, pq_pct;
+        const char * fail_why = NULL;
+        unsigned int i;
+        int rv;
+
+        for (i = 0; i != n; ++i) {
+            if ((benches[i] = bench_new(tmpl->clock_id, bench_warmup)) == NULL) {
+                ret = -1;
+                goto fail;
+            }
+        }
+
+        pthread_mutex_init(&ds.lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&ds.cond, &attr);
+        pthread_condattr_destroy(&attr);
+        if (pthread_create(&ds.thread, NULL, density_sampler_thread, &ds) != 0) {
+            pthread_cond_destroy(&ds.cond);
+            pthread_mutex_destroy(&ds.lock);
+            ret = -1;
+            goto fail;
+        }
+
+        proc_stats_sample(&ps0);
+        vidout_wayland_pollqueue_load(dpo, &pq_busy0, &pq_idle0);
+        rv = mosaic_run(dpo, tmpl, opts, names, n, frame_q_depth, benches);
+        vidout_wayland_pollqueue_load(dpo, &pq_busy1, &pq_idle1);
+        proc_stats_sample(&ps1);
+
+        pthread_mutex_lock(&ds.lock);
+        ds.stop = true;
+        pthread_cond_signal(&ds.cond);
+        pthread_mutex_unlock(&ds.lock);
+        pthread_join(ds.thread, NULL);
+        pthread_cond_destroy(&ds.cond);
+        pthread_mutex_destroy(&ds.lock);
+
+        // Worst stream sets the latency
+        for (i = 0; i != n; ++i) {
+            bench_summary_t bs;
+            bench_summary_get(benches[i], &bs);
+            total.received += bs.received;
+            total.presented += bs.presented;
+            total.dropped += bs.dropped;
+            total.discarded += bs.discarded;
+            total.present_fps += bs.present_fps;
+            if (bs.latency_p99_ns > p99_ns)
+                p99_ns = bs.latency_p99_ns;
+            bench_delete(benches + i);
+        }
+
+        drop_pct = total.received == 0 ? 0.0 : total.dropped * 100.0 / total.received;
+        discard_pct = total.received == 0 ? 0.0 : total.discarded * 100.0 / total.received;
+        cpu_pct = ps1.wall_ns <= ps0.wall_ns ? 0.0 :
+            (ps1.cpu_ns - ps0.cpu_ns) * 100.0 / ((double)(ps1.wall_ns - ps0.wall_ns) * cpus);
+        pq_pct = pq_busy1 + pq_idle1 <= pq_busy0 + pq_idle0 ? 0.0 :
+            (pq_busy1 - pq_busy0) * 100.0 / (double)(pq_busy1 + pq_idle1 - pq_busy0 - pq_idle0);
+
+        if (rv != 0)
+            fail_why = "playback error";
+        else if (total.presented == 0)
+            fail_why = "nothing presented";
+        else if (drop_pct > slo->drop_pct)
+            fail_why = "drops";
+        else if (discard_pct > slo->discard_pct)
+            fail_why = "discards";
+        else if (p99_ns / 1e6 > slo->p99_ms)
+            fail_why = "latency";
+
+        printf("Density: %2u streams: %.1f fps presented, drops %.2f%%, discards %.2f%%, p99 %.1fms, "
+               "cpu %.1f%% of %u, dmabuf peak %.1fMB (%u bufs), pollqueue %.1f%% busy: %s%s\n",
+               n, total.present_fps, drop_pct, discard_pct, p99_ns / 1e6,
+               cpu_pct, cpus, ds.dmabuf_peak_bytes / (1024.0 * 1024.0), ds.dmabuf_peak_count, pq_pct,
+               fail_why == NULL ? "OK" : "FAIL ", fail_why == NULL ? "" : fail_why);
+
+        if (fail_why != NULL)
+            break;
+        best = n;
+    }
+
+    printf("Density: max sustainable streams: %u%s\n", best, best == max_streams ? " (limit reached)" : "");
+
+fail:
+    if (benches != NULL) {
+        for (n = 0; n != max_streams; ++n)
+            bench_delete(benches + n);
+    }
+    free(benches);
+    free(names);
+    return ret;
+}
+
+static void log_callback_help(void *ptr, int level, const char *fmt, va_list vl)
+{
+    (void)ptr;
+    if (level <= ffdebug_level * 8) {
+        static uint64_t t0 = 0;
+        uint64_t now = time_us();
+        if (t0 == 0)
+            t0 = now;
+        printf("%4"PRId64".%03d: [%d] ", (now - t0)/1000000, (unsigned int)((now - t0) % 1000000) / 1000, level / 8);
+        vfprintf(stdout, fmt, vl);
+    }
+}
+
+struct log_xlat_ss {
+    int lvl;
+    const char * name;
+} log_xlat[] =
+{
+    {AV_LOG_QUIET,   "QUIET"},
+    {AV_LOG_PANIC,   "PANIC"},
+    {AV_LOG_FATAL,   "FATAL"},
+    {AV_LOG_ERROR,   "ERROR"},
+    {AV_LOG_WARNING, "WARNING"},
+    {AV_LOG_INFO,    "INFO"},
+    {AV_LOG_VERBOSE, "VERBOSE"},
+    {AV_LOG_DEBUG,   "DEBUG"},
+    {AV_LOG_TRACE,   "TRACE"},
+    {0, NULL}
+};
+
+int strtologlvl(const char * s)
+{
+    size_t slen = strlen(s);
+    long lvl;
+    char * p;
+
+    if (slen == 0)
+        return -99;
+
+    for (int i = 0; log_xlat[i].name != NULL; ++i) {
+        if (strncasecmp(s, log_xlat[i].name, slen) == 0)
+            return log_xlat[i].lvl;
+    }
+
+    lvl = strtol(s, &p, 0);
+    if (*p == 0)
+        return (int)(lvl * 8);
+
+    return -99;
+}
+
+void usage()
+{
+    fprintf(stderr,
+            "Usage: hello_wayland [-e]\n"
+            "                     [-l <loop_count>] [-f <frames>] [-o <yuv_output_file>] [--y4m]\n"
+            "                     [--deinterlace] [--pace-input <hz>] [--fullscreen]\n"
+            "                     [-O <codec opts>] [--ffdebug <debug level>] [--low-delay]\n"
+            "                     [--pkt-queue <depth>] [--frame-queue <depth>]\n"
+            "                     [--readahead-kb <kbytes>] [--readahead-ms <ms>] [--mmap]\n"
+            "                     [--bench] [--bench-warmup <frames>] [--bench-repeat <n>]\n"
+            "                     [--bench-json <file>] [--mosaic] [--adapt-quality] [--live]\n"
+            "                     [--kf-index] [--seek <secs>] [--trick <rate>]\n"
+            "                     [--gop-parallel <n>] [--pattern <w>x<h>[:<fmt>]]\n"
+            "                     [--pattern-rate <fps>] [--null-out]\n"
+            "                     [--null-hold-ms <ms>] [--null-hold-frames <n>]\n"
+            "                     [--vf <filter graph>] [--verify <golden file>]\n"
+            "                     [--density <max streams>] [--slo-drop-pct <pct>]\n"
+            "                     [--slo-discard-pct <pct>] [--slo-p99-ms <ms>]\n"
+            "                     [--backpressure drop|block] [--in-flight <n>|auto]\n"
+            "                     "
+#if HAS_RUNTICKER
+            "[--ticker <text>] "
+#endif
+#if HAS_RUNCUBE
+            "[--cube] "
+#endif
+            "[--no-wait]\n"
+            "                     <input file> [<input_file> ...]\n\n"
+            " -e        Use EGL to render video (otherwise direct dmabuf)\n"
+            " -l        Loop video playback <loop_count> times. -1 means forever\n"
+            " --cube    Show rotating cube\n"
+            " --ticker  Show scrolling ticker with <text> repeated indefinitely\n"
+            " --no-wait Decode at max speed, do not wait for display\n"
+            " -o        Dump raw frames to file, '-' for stdout. Frames are dropped\n"
+            "           rather than stalling display if the output can't keep up\n"
+            " --y4m     Dump in y4m format (default if -o name ends in .y4m)\n"
+            " --pkt-queue   Max packets queued between demux & decode (default %d)\n"
+            " --frame-queue Max frames queued between decode & display (default %d)\n"
+            " --readahead-kb  Demux read-ahead high watermark in kbytes (default %d)\n"
+            " --readahead-ms  Demux read-ahead high watermark in ms (default %d, 0 = bytes only)\n"
+            "                 Reading resumes once below half of both watermarks\n"
+            " --mmap    Read local files through mmap rather than read()\n"
+            " --bench   Time every frame through the pipeline & report JSON stats at exit\n"
+            " --bench-warmup  Frames at the start of each run excluded from stats (default %d)\n"
+            " --bench-repeat  Play the whole playlist <n> times as separate runs\n"
+            " --bench-json    Write the bench report to <file> (default stdout)\n"
+            " --mosaic  Play all inputs at once in a grid, one tile each (max %d)\n"
+            " --adapt-quality Reduce decode quality (loop filter, idct, lowres, non-ref\n"
+            "                 frames) when decode can't keep up & restore it when it can\n"
+            " --live    Minimise latency for live (e.g. piped camera) input: minimal probe,\n"
+            "           no demux buffering, low delay decode, no PTS pacing, a frame\n"
+            "           queue of 1, read-ahead capped at %dkB / %dms & --in-flight at\n"
+            "           most %d. Use with --bench to measure packet arrival to present\n"
+            " --kf-index Build a keyframe index in the background & cache it in <input>.kfidx\n"
+            " --seek    Start the first input at <secs>, via the keyframe index if cached\n"
+            " --trick   Fast forward at <rate>x (2-64) decoding & showing only keyframes\n"
+            " --gop-parallel  Decode in s/w with <n> (2-%d) single threaded decoders, each\n"
+            "                 taking a whole GOP, output in pts order. Closed GOP streams\n"
+            "                 only. Mostly useful with --no-wait to measure decode capacity\n",
+            PKT_QUEUE_DEPTH_DEFAULT, FRAME_QUEUE_DEPTH_DEFAULT,
+            READAHEAD_KB_DEFAULT, READAHEAD_MS_DEFAULT,
+            BENCH_WARMUP_DEFAULT, MOSAIC_MAX,
+            LIVE_READAHEAD_KB_MAX, LIVE_READAHEAD_MS_MAX, LIVE_IN_FLIGHT_MAX, GOP_DECODERS_MAX);
+    // Split to stay inside the max string literal length
+    fprintf(stderr,
+            " --pattern Display a generated moving test pattern (fmt nv12, yuv420p, rgb0,\n"
+            "           bgr0, 0rgb or 0bgr; default nv12) instead of input files. Each frame\n"
+            "           carries a frame number / timestamp stamp that is checked at present\n"
+            " --pattern-rate  Test pattern frame rate (default %.0f). Use --no-wait for max\n"
+            " --null-out      Headless - no wayland. Frames are counted as presented on\n"
+            "                 arrival & released after --null-hold-frames newer frames\n"
+            "                 (default %d) or --null-hold-ms (default 0 = frames only)\n"
+            " --vf      Filter decoded frames with an avfilter graph e.g. bwdif or\n"
+            "           scale=1280:720 (--sw). S/w output goes into display buffers.\n"
+            "           Overrides --deinterlace\n"
+            " --verify  Check a crc32c of every frame against <golden file>, or create it\n"
+            "           if it doesn't exist. Exits with an error on any mismatch\n"
+            " --density Capacity test: play 1, 2, ... <max streams> (max %d) copies of the\n"
+            "           inputs at once as mosaic tiles, -f frames each (default %d), until\n"
+            "           a step breaks an SLO. Reports fps, drops, latency, CPU, peak dmabuf\n"
+            "           memory & wayland thread load for each step & the max that passed\n"
+            " --slo-drop-pct    Max %% of frames dropped before display (default %.1f)\n"
+            " --slo-discard-pct Max %% of frames discarded by the compositor (default %.1f)\n"
+            " --slo-p99-ms      Max p99 decode to present latency of any stream (default %.0f)\n"
+            " --backpressure    When the compositor holds --in-flight buffers: drop the\n"
+            "                   next frame (default) or block until one is released\n"
+            " --in-flight       Max buffers held by the compositor (2-8, default %d) or\n"
+            "                   auto to fit its observed release latency\n",
+            PATTERN_RATE_DEFAULT, NULL_HOLD_FRAMES_DEFAULT, DENSITY_MAX, DENSITY_FRAMES_DEFAULT,
+            SLO_DROP_PCT_DEFAULT, SLO_DISCARD_PCT_DEFAULT, SLO_P99_MS_DEFAULT, IN_FLIGHT_DEFAULT);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int ret = 0;
+    enum AVHWDeviceType type;
+    char * const * in_filelist;
+    unsigned int in_count;
+    const char * hwdev = "drm";
+    vid_out_env_t * dpo;
+    long loop_count = 1;
+    long frame_count = -1;
+    const char * out_name = NULL;
+    const char * verify_name = NULL;
+    bool low_delay = false;
+    long pace_input_hz = 0;
+    bool try_hw = true;
+    bool use_dmabuf = true;
+    bool fullscreen = false;
+    bool wants_deinterlace = false;
+    const char * vf = NULL;
+    bool wants_y4m = false;
+    unsigned long pkt_q_depth = PKT_QUEUE_DEPTH_DEFAULT;
+    unsigned long readahead_kb = READAHEAD_KB_DEFAULT;
+    unsigned long readahead_ms = READAHEAD_MS_DEFAULT;
+    unsigned long frame_q_depth = FRAME_QUEUE_DEPTH_DEFAULT;
+    play_env_t pe = {.dpo = NULL, .name = ""};
+    play_opts_t opts;
+    bool mosaic = false;
+    unsigned long density_max = 0;
+    density_slo_t slo = {
+        .drop_pct = SLO_DROP_PCT_DEFAULT,
+        .discard_pct = SLO_DISCARD_PCT_DEFAULT,
+        .p99_ms = SLO_P99_MS_DEFAULT,
+    };
+    bool adapt_quality = false;
+    double seek_s = -1.0;
+    unsigned long trick = 0;
+    unsigned long gop_decoders = 0;
+    bool pattern = false;
+    int pattern_fmt = PATTERN_FORMAT_DEFAULT;
+    int pattern_w = 0;
+    int pattern_h = 0;
+    double pattern_rate = PATTERN_RATE_DEFAULT;
+    bool null_out = false;
+    vidout_backpressure_t backpressure = VIDOUT_BACKPRESSURE_DROP;
+    unsigned long in_flight = IN_FLIGHT_DEFAULT;
+    unsigned long null_hold_ms = 0;
+    unsigned long null_hold_frames = NULL_HOLD_FRAMES_DEFAULT;
+    bool wants_bench = false;
+    unsigned long bench_warmup = BENCH_WARMUP_DEFAULT;
+    unsigned long bench_repeat = 1;
+    const char * bench_json = NULL;
+    long items_per_run = 0;
+#if HAS_RUNCUBE
+    bool wants_cube = false;
+#endif
+#if HAS_RUNTICKER
+    const char * ticker_text = NULL;
+#endif
+
+    {
+        char * const * a = argv + 1;
+        int n = argc - 1;
+
+        while (n-- > 0 && a[0][0] == '-') {
+            const char *arg = *a++;
+            char *e;
+
+            if (strcmp(arg, "-l") == 0 || strcmp(arg, "--loop") == 0) {
+                if (n == 0)
+                    usage();
+                loop_count = strtol(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--frames") == 0) {
+                if (n == 0)
+                    usage();
+                frame_count = strtol(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "-F") == 0 || strcmp(arg, "--fullscreen") == 0) {
+                fullscreen = true;
+            }
+            else if (strcmp(arg, "-o") == 0) {
+                if (n == 0)
+                    usage();
+                out_name = *a;
+                --n;
+                ++a;
             }
-            else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--frames") == 0) {
+            else if (strcmp(arg, "--mmap") == 0) {
+                use_mmap = true;
+            }
+            else if (strcmp(arg, "--mosaic") == 0) {
+                mosaic = true;
+            }
+            else if (strcmp(arg, "--adapt-quality") == 0) {
+                adapt_quality = true;
+            }
+            else if (strcmp(arg, "--live") == 0) {
+                live_mode = true;
+            }
+            else if (strcmp(arg, "--kf-index") == 0) {
+                use_kf_index = true;
+            }
+            else if (strcmp(arg, "--seek") == 0) {
                 if (n == 0)
                     usage();
-                frame_count = strtol(*a, &e, 0);
+                seek_s = strtod(*a, &e);
+                if (*e != 0 || seek_s < 0)
+                    usage();
+                use_kf_index = true;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--trick") == 0) {
+                if (n == 0)
+                    usage();
+                trick = strtoul(*a, &e, 0);
+                if (*e != 0 || trick < 2 || trick > 64)
+                    usage();
+                use_kf_index = true;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--gop-parallel") == 0) {
+                if (n == 0)
+                    usage();
+                gop_decoders = strtoul(*a, &e, 0);
+                if (*e != 0 || gop_decoders < 2 || gop_decoders > GOP_DECODERS_MAX)
+                    usage();
+                // Parallel h/w decoders don't buy anything
+                try_hw = false;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--pattern") == 0) {
+                if (n == 0)
+                    usage();
+                pattern_w = (int)strtol(*a, &e, 10);
+                if (*e != 'x')
+                    usage();
+                pattern_h = (int)strtol(e + 1, &e, 10);
+                if (*e == ':')
+                    pattern_fmt = av_get_pix_fmt(e + 1);
+                else if (*e != 0)
+                    usage();
+                if (pattern_w < TEST_PATTERN_MIN_WIDTH || pattern_h < TEST_PATTERN_MIN_HEIGHT ||
+                    !test_pattern_format_ok(pattern_fmt)) {
+                    fprintf(stderr, "Test pattern must be at least %dx%d & a supported format\n",
+                            TEST_PATTERN_MIN_WIDTH, TEST_PATTERN_MIN_HEIGHT);
+                    usage();
+                }
+                pattern = true;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--pattern-rate") == 0) {
+                if (n == 0)
+                    usage();
+                pattern_rate = strtod(*a, &e);
+                if (*e != 0 || pattern_rate <= 0.0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--null-out") == 0) {
+                null_out = true;
+            }
+            else if (strcmp(arg, "--backpressure") == 0) {
+                if (n == 0)
+                    usage();
+                if (strcmp(*a, "drop") == 0)
+                    backpressure = VIDOUT_BACKPRESSURE_DROP;
+                else if (strcmp(*a, "block") == 0)
+                    backpressure = VIDOUT_BACKPRESSURE_BLOCK;
+                else
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--in-flight") == 0) {
+                if (n == 0)
+                    usage();
+                if (strcmp(*a, "auto") == 0)
+                    in_flight = 0;
+                else {
+                    in_flight = strtoul(*a, &e, 0);
+                    if (*e != 0 || in_flight < IN_FLIGHT_MIN || in_flight > IN_FLIGHT_DEFAULT)
+                        usage();
+                }
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--null-hold-ms") == 0) {
+                if (n == 0)
+                    usage();
+                null_hold_ms = strtoul(*a, &e, 0);
                 if (*e != 0)
                     usage();
+                null_out = true;
                 --n;
                 ++a;
             }
-            else if (strcmp(arg, "-F") == 0 || strcmp(arg, "--fullscreen") == 0) {
-                fullscreen = true;
+            else if (strcmp(arg, "--null-hold-frames") == 0) {
+                if (n == 0)
+                    usage();
+                null_hold_frames = strtoul(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                null_out = true;
+                --n;
+                ++a;
             }
-            else if (strcmp(arg, "-o") == 0) {
+            else if (strcmp(arg, "--bench") == 0) {
+                wants_bench = true;
+            }
+            else if (strcmp(arg, "--bench-warmup") == 0) {
                 if (n == 0)
                     usage();
-                out_name = *a;
+                bench_warmup = strtoul(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                wants_bench = true;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--bench-repeat") == 0) {
+                if (n == 0)
+                    usage();
+                bench_repeat = strtoul(*a, &e, 0);
+                if (*e != 0 || bench_repeat == 0)
+                    usage();
+                wants_bench = true;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--bench-json") == 0) {
+                if (n == 0)
+                    usage();
+                bench_json = *a;
+                wants_bench = true;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--density") == 0) {
+                if (n == 0)
+                    usage();
+                density_max = strtoul(*a, &e, 0);
+                if (*e != 0 || density_max == 0 || density_max > DENSITY_MAX)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--slo-drop-pct") == 0 ||
+                     strcmp(arg, "--slo-discard-pct") == 0 ||
+                     strcmp(arg, "--slo-p99-ms") == 0) {
+                double x;
+                if (n == 0)
+                    usage();
+                x = strtod(*a, &e);
+                if (*e != 0 || x < 0)
+                    usage();
+                if (strcmp(arg, "--slo-drop-pct") == 0)
+                    slo.drop_pct = x;
+                else if (strcmp(arg, "--slo-discard-pct") == 0)
+                    slo.discard_pct = x;
+                else
+                    slo.p99_ms = x;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--verify") == 0) {
+                if (n == 0)
+                    usage();
+                verify_name = *a;
                 --n;
                 ++a;
             }
+            else if (strcmp(arg, "--y4m") == 0) {
+                wants_y4m = true;
+            }
             else if (strcmp(arg, "-O") == 0) {
                 if (av_dict_parse_string(&codec_opts, *a, "=", ":", 0) != 0) {
                     fprintf(stderr, "Bad codec opts '%s': usage: <opt>=<value[:<opt>=<value>]^\n", *a);
@@ -563,6 +2406,13 @@ int main(int argc, char *argv[])
             } else if (strcmp(arg, "--deinterlace") == 0) {
                 wants_deinterlace = true;
             }
+            else if (strcmp(arg, "--vf") == 0) {
+                if (n == 0)
+                    usage();
+                vf = *a;
+                --n;
+                ++a;
+            }
             else if (strcmp(arg, "--ffdebug") == 0) {
                 if (n == 0)
                     usage();
@@ -575,6 +2425,42 @@ int main(int argc, char *argv[])
             else if (strcmp(arg, "--low-delay") == 0) {
                 low_delay = true;
             }
+            else if (strcmp(arg, "--pkt-queue") == 0) {
+                if (n == 0)
+                    usage();
+                pkt_q_depth = strtoul(*a, &e, 0);
+                if (*e != 0 || pkt_q_depth == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--readahead-kb") == 0) {
+                if (n == 0)
+                    usage();
+                readahead_kb = strtoul(*a, &e, 0);
+                if (*e != 0 || readahead_kb == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--readahead-ms") == 0) {
+                if (n == 0)
+                    usage();
+                readahead_ms = strtoul(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--frame-queue") == 0) {
+                if (n == 0)
+                    usage();
+                frame_q_depth = strtoul(*a, &e, 0);
+                if (*e != 0 || frame_q_depth == 0)
+                    usage();
+                --n;
+                ++a;
+            }
 #if HAS_RUNCUBE
             else if (strcmp(arg, "--cube") == 0) {
                 wants_cube = true;
@@ -600,14 +2486,75 @@ int main(int argc, char *argv[])
                 usage();
         }
 
-        // Last args are input files
-        if (n < 0)
+        // Last args are input files - none for a test pattern
+        if (n < 0 && !pattern)
+            usage();
+        if (pattern && (n >= 0 || mosaic || density_max != 0)) {
+            fprintf(stderr, "--pattern takes no input files & can't be used with --mosaic or --density\n");
+            usage();
+        }
+
+        if (gop_decoders != 0 && (vf != NULL || wants_deinterlace)) {
+            fprintf(stderr, "--gop-parallel output isn't filtered - can't be used with --vf or --deinterlace\n");
+            usage();
+        }
+        if (null_out && (mosaic
+#if HAS_RUNCUBE
+                         || wants_cube
+#endif
+#if HAS_RUNTICKER
+                         || ticker_text != NULL
+#endif
+                         )) {
+            fprintf(stderr, "--null-out has no window so can't be used with --mosaic, --cube or --ticker\n");
+            usage();
+        }
+
+        // Verify needs every frame decoded at full quality
+        if (verify_name != NULL && adapt_quality) {
+            fprintf(stderr, "--adapt-quality changes decoded output so can't be used with --verify\n");
             usage();
+        }
+
+        // Live: present frames as soon as they are decoded with nothing
+        // queued behind the one being shown
+        if (live_mode) {
+            low_delay = true;
+            no_wait = true;
+            frame_q_depth = 1;
+            // Anything buffered behind the decoder or the compositor is latency
+            readahead_kb = FFMIN(readahead_kb, LIVE_READAHEAD_KB_MAX);
+            if (readahead_ms == 0 || readahead_ms > LIVE_READAHEAD_MS_MAX)
+                readahead_ms = LIVE_READAHEAD_MS_MAX;
+            if (in_flight == 0 || in_flight > LIVE_IN_FLIGHT_MAX)
+                in_flight = LIVE_IN_FLIGHT_MAX;
+        }
 
         in_filelist = a;
         in_count = n + 1;
-        if (loop_count > 0)
+        // Mosaic plays every input at once - otherwise they are a playlist
+        // Density plays a growing mosaic of them
+        if (density_max != 0) {
+            if (mosaic || null_out || out_name != NULL || verify_name != NULL || wants_bench || !use_dmabuf) {
+                fprintf(stderr, "--density can't be used with --mosaic, --null-out, -o, --verify, --bench or -e\n");
+                usage();
+            }
+            if (frame_count < 0)
+                frame_count = DENSITY_FRAMES_DEFAULT;
+        }
+        else if (mosaic) {
+            if (in_count > MOSAIC_MAX || out_name != NULL || verify_name != NULL || wants_bench || !use_dmabuf) {
+                fprintf(stderr, "--mosaic takes up to %d inputs & can't be used with -o, --verify, --bench or -e\n", MOSAIC_MAX);
+                usage();
+            }
+        }
+        else if (loop_count > 0)
             loop_count *= in_count;
+        // Each bench run is a complete pass of the (looped) playlist
+        if (wants_bench && loop_count > 0) {
+            items_per_run = loop_count;
+            loop_count *= bench_repeat;
+        }
     }
 
     if (ffdebug_level >= 0)
@@ -627,19 +2574,86 @@ int main(int argc, char *argv[])
         unsigned int flags =
             (fullscreen ? WOUT_FLAG_FULLSCREEN : 0) |
             (no_wait ? WOUT_FLAG_NO_WAIT : 0);
-        dpo = use_dmabuf ? dmabuf_wayland_out_new(flags) : vidout_wayland_new(flags);
+        dpo = null_out ? dmabuf_null_out_new(flags, null_hold_ms, null_hold_frames) :
+            use_dmabuf ? dmabuf_wayland_out_new(flags) : vidout_wayland_new(flags);
         if (dpo == NULL) {
             fprintf(stderr, "Failed to open egl_wayland output\n");
             return 1;
         }
+        vidout_wayland_backpressure_set(dpo, backpressure, in_flight);
     }
 
     /* open the file to dump raw data */
     if (out_name != NULL) {
-        if ((output_file = fopen(out_name, "w+")) == NULL) {
+        const size_t len = strlen(out_name);
+        int fd;
+
+        if (strcmp(out_name, "-") == 0) {
+            // Take stdout for ourselves & send all the logging to stderr
+            // If the reader goes away we want EPIPE not death
+            signal(SIGPIPE, SIG_IGN);
+            fflush(stdout);
+            if ((fd = dup(1)) != -1)
+                dup2(2, 1);
+        }
+        else {
+            fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        }
+        if (fd == -1) {
             fprintf(stderr, "Failed to open output file %s: %s\n", out_name, strerror(errno));
             return -1;
         }
+        if (len > 4 && strcmp(out_name + len - 4, ".y4m") == 0)
+            wants_y4m = true;
+        if ((pe.dump = frame_dump_new(fd, wants_y4m ? FRAME_DUMP_FLAG_Y4M : 0, DUMP_QUEUE_DEPTH)) == NULL) {
+            fprintf(stderr, "Failed to create frame dump\n");
+            return -1;
+        }
+    }
+
+    if (verify_name != NULL &&
+        (pe.verify = frame_verify_new(verify_name, VERIFY_QUEUE_DEPTH)) == NULL) {
+        fprintf(stderr, "Failed to start verify with %s\n", verify_name);
+        return -1;
+    }
+    pe.no_skip = (pe.verify != NULL);
+
+    opts = (play_opts_t){
+        .type = type,
+        .try_hw = try_hw,
+        .low_delay = low_delay,
+        .wants_deinterlace = wants_deinterlace,
+        .vf = vf,
+        .frame_count = frame_count,
+        .loop_count = loop_count,
+        .items_per_run = items_per_run,
+        .adapt_quality = adapt_quality,
+        .seek_us = seek_s < 0 ? -1 : (int64_t)(seek_s * 1000000),
+        .trick = trick,
+        .gop_decoders = gop_decoders,
+    };
+
+    pe.dpo = dpo;
+    pe.clock_id = vidout_wayland_clock_id(dpo);
+    if (wants_bench) {
+        pthread_mutex_init(&pe.arrivals.lock, NULL);
+        if ((pe.bench = bench_new(pe.clock_id, bench_warmup)) == NULL) {
+            fprintf(stderr, "Failed to create bench timer\n");
+            return -1;
+        }
+        vidout_wayland_bench_set(dpo, pe.bench);
+    }
+    pe.pace_input_hz = pace_input_hz;
+    pe.pkt_limits = (readahead_limits_t){
+        .max_packets = pkt_q_depth,
+        .high_bytes = readahead_kb * 1024,
+        .low_bytes = readahead_kb * 1024 / 2,
+        .high_us = (int64_t)readahead_ms * 1000,
+        .low_us = (int64_t)readahead_ms * 1000 / 2,
+    };
+    if (!mosaic && density_max == 0 && present_start(&pe, frame_q_depth) != 0) {
+        fprintf(stderr, "Failed to start present thread\n");
+        return -1;
     }
 
 #if HAS_RUNTICKER
@@ -651,163 +2665,42 @@ int main(int argc, char *argv[])
         vidout_wayland_runcube(dpo);
 #endif
 
-loopy:
-    in_file = in_filelist[in_n];
-    if (++in_n >= in_count)
-        in_n = 0;
-
-    /* open the input file */
-    if (avformat_open_input(&input_ctx, in_file, NULL, NULL) != 0) {
-        fprintf(stderr, "Cannot open input file '%s'\n", in_file);
-        return -1;
-    }
-
-    if (avformat_find_stream_info(input_ctx, NULL) < 0) {
-        fprintf(stderr, "Cannot find input stream information.\n");
-        return -1;
-    }
-
-retry_hw:
-    /* find the video stream information */
-    ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Cannot find a video stream in the input file\n");
-        return -1;
-    }
-    video_stream = ret;
-
-    hw_pix_fmt = AV_PIX_FMT_NONE;
-    if (!try_hw) {
-        /* Nothing */
-    }
-    else if (decoder->id == AV_CODEC_ID_H264) {
-        if ((decoder = avcodec_find_decoder_by_name("h264_v4l2m2m")) == NULL)
-            fprintf(stderr, "Cannot find the h264 v4l2m2m decoder\n");
-        else
-            hw_pix_fmt = AV_PIX_FMT_DRM_PRIME;
-    }
-    else {
-        for (i = 0;; i++) {
-            const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
-            if (!config) {
-                fprintf(stderr, "Decoder %s does not support device type %s.\n",
-                        decoder->name, av_hwdevice_get_type_name(type));
-                break;
-            }
-            if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
-                config->device_type == type) {
-                hw_pix_fmt = config->pix_fmt;
-                break;
-            }
-        }
+    if (density_max != 0) {
+        ret = density_run(dpo, &pe, &opts, in_filelist, in_count, frame_q_depth,
+                          density_max, bench_warmup, &slo);
     }
-
-    if (hw_pix_fmt == AV_PIX_FMT_NONE && try_hw) {
-        fprintf(stderr, "No h/w format found - trying s/w\n");
-        try_hw = false;
+    else if (mosaic) {
+        ret = mosaic_run(dpo, &pe, &opts, in_filelist, in_count, frame_q_depth, NULL);
     }
-
-    if (!(decoder_ctx = avcodec_alloc_context3(decoder)))
-        return AVERROR(ENOMEM);
-
-    video = input_ctx->streams[video_stream];
-    if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
-        return -1;
-
-    if (try_hw) {
-        decoder_ctx->get_format  = get_hw_format;
-
-        if (hw_decoder_init(decoder_ctx, type) < 0)
-            return -1;
-
-        decoder_ctx->pix_fmt = AV_PIX_FMT_DRM_PRIME;
-        decoder_ctx->sw_pix_fmt = AV_PIX_FMT_NONE;
-
-        decoder_ctx->thread_count = 3;
+    else if (pattern) {
+        ret = pattern_run(&pe, &opts, pattern_fmt, pattern_w, pattern_h, pattern_rate);
+        present_stop(&pe);
     }
     else {
-        decoder_ctx->get_buffer2 = vidout_wayland_get_buffer2;
-        decoder_ctx->opaque = dpo;
-        decoder_ctx->thread_count = 0; // FFmpeg will pick a default
+        ret = playlist_run(&pe, &opts, in_filelist, in_count);
+        present_stop(&pe);
     }
-    decoder_ctx->flags = low_delay ? AV_CODEC_FLAG_LOW_DELAY : 0;
-    // Pick any threading method
-    decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
-#if LIBAVCODEC_VERSION_MAJOR < 60
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
-    decoder_ctx->thread_safe_callbacks = 1;
-#pragma GCC diagnostic pop
-#endif
+    frame_dump_delete(&pe.dump);
+    if (frame_verify_delete(&pe.verify) != 0 && ret == 0)
+        ret = 1;
 
-    if ((ret = avcodec_open2(decoder_ctx, decoder, &codec_opts)) < 0) {
-        if (try_hw) {
-            try_hw = false;
-            avcodec_free_context(&decoder_ctx);
+    // No more stamps once the output has gone
+    vidout_wayland_delete(dpo);
 
-            printf("H/w init failed - trying s/w\n");
-            goto retry_hw;
+    if (pe.bench != NULL) {
+        FILE * const f = bench_json == NULL ? stdout : fopen(bench_json, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Failed to open bench output %s: %s\n", bench_json, strerror(errno));
+            ret = -1;
         }
-        fprintf(stderr, "Failed to open codec for stream #%u\n", video_stream);
-        return -1;
-    }
-
-    printf("Pixfmt after init: %s / %s\n", av_get_pix_fmt_name(decoder_ctx->pix_fmt), av_get_pix_fmt_name(decoder_ctx->sw_pix_fmt));
-
-    /* actual decoding and dump the raw data */
-    {
-        int64_t t0 = time_us() + 3000; // Allow a few ms so we aren't behind at startup
-        int pts_seen = 0;
-        int64_t fake_ts = 0;
-
-        frames = frame_count;
-        while (ret >= 0) {
-            if ((ret = av_read_frame(input_ctx, &packet)) < 0)
-                break;
-
-            if (video_stream == packet.stream_index) {
-                if (pace_input_hz > 0) {
-                    const int64_t now = time_us();
-                    if (now < t0)
-                        usleep(t0 - now);
-                    else
-                        fprintf(stderr, "input pace failure by %"PRId64"us\n", now - t0);
-
-                    t0 += 1000000 / pace_input_hz;
-
-                    if (packet.pts != AV_NOPTS_VALUE) {
-                        pts_seen = 1;
-                    }
-                    else if (!pts_seen) {
-                        packet.dts = fake_ts;
-                        packet.pts = fake_ts;
-                        fake_ts += 90000 / pace_input_hz;
-                    }
-                }
-
-                ret = decode_write(video, decoder_ctx, dpo, &packet);
-            }
-
-            av_packet_unref(&packet);
+        else {
+            bench_report_json(pe.bench, f);
+            if (f != stdout)
+                fclose(f);
         }
+        bench_delete(&pe.bench);
+        pthread_mutex_destroy(&pe.arrivals.lock);
     }
-
-    /* flush the decoder */
-    packet.data = NULL;
-    packet.size = 0;
-    ret = decode_write(video, decoder_ctx, dpo, &packet);
-    av_packet_unref(&packet);
-
-    if (output_file)
-        fclose(output_file);
-    avfilter_graph_free(&filter_graph);
-    avcodec_free_context(&decoder_ctx);
-    avformat_close_input(&input_ctx);
-
-    if (loop_count == -1 || --loop_count > 0)
-        goto loopy;
-
-    vidout_wayland_delete(dpo);
-    return 0;
+    return ret;
 }
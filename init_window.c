@@ -10,6 +10,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <wayland-egl.h> // Wayland EGL MUST be included before EGL headers
@@ -26,11 +29,16 @@
 #include <libavutil/imgutils.h>
 
 // Local headers
+#include "bench.h"
 #include "dmabuf_alloc.h"
 #include "dmabuf_pool.h"
 #include "pollqueue.h"
+#include "upload_pool.h"
+#include "vsync_clock.h"
 #include "wayout.h"
 
+#include "presentation-time-client-protocol.h"
+
 #include "freetype/runticker.h"
 #include "cube/runcube.h"
 
@@ -39,6 +47,44 @@
 
 #define TRACE_ALL 0
 
+// Display buffers per output (each tile has its own pool)
+#define DMABUF_POOL_SIZE 32
+
+// wl_buffer import cache - the pool hands out its least recently used
+// free buffer so anything smaller than the pool can miss every frame
+#define IMPORT_CACHE_SIZE DMABUF_POOL_SIZE
+// Entries unused for this many displays are dropped so buffers from a
+// torn down pool aren't kept alive for long
+#define IMPORT_CACHE_AGE_MAX 64
+
+// Identifies a dmabuf frame layout - an open fd pins the inode so
+// (dev, ino) can't be reused whilst we hold a cache entry
+typedef struct import_key_s {
+    uint32_t format;
+    uint64_t mod;
+    unsigned int width;
+    unsigned int height;
+    unsigned int nb_objects;
+    dev_t dev[AV_DRM_MAX_PLANES];
+    ino_t ino[AV_DRM_MAX_PLANES];
+    unsigned int nb_planes;
+    unsigned int obj_no[AV_DRM_MAX_PLANES];
+    size_t offset[AV_DRM_MAX_PLANES];
+    size_t pitch[AV_DRM_MAX_PLANES];
+} import_key_t;
+
+// EGLImage & texture cache for EGL output - sized & aged as the import cache
+#define EGL_CACHE_SIZE IMPORT_CACHE_SIZE
+#define EGL_CACHE_AGE_MAX IMPORT_CACHE_AGE_MAX
+
+typedef struct egl_ent_s {
+    import_key_t key;
+    EGLImage image;             // EGL_NO_IMAGE_KHR if empty
+    GLuint texture;
+    int fds[AV_DRM_MAX_PLANES]; // Dups of the objects' fds - pin the key
+    uint64_t last_used;
+} egl_ent_t;
+
 typedef struct window_ctx_s {
 
     struct wl_callback *frame_callback;
@@ -52,8 +98,32 @@ typedef struct window_ctx_s {
     uint32_t last_fmt;
     uint64_t last_mod;
 
+    // EGLImage cache - only touched on the GL thread
+    egl_ent_t egl_cache[EGL_CACHE_SIZE];
+    uint64_t egl_seq;
+    unsigned int egl_hits;
+    unsigned int egl_misses;
+    atomic_bool egl_flush;      // Flush requested from another thread
+
 } window_ctx_t;
 
+typedef struct import_ent_s {
+    import_key_t key;
+    struct wo_fb_s * wofb;      // Cache's ref, NULL if empty
+    uint64_t gen;               // Unique per fill so stale releases can be spotted
+    uint64_t last_used;
+    bool busy;                  // Attached & not yet released
+} import_ent_t;
+
+typedef struct import_cache_s {
+    pthread_mutex_t lock;
+    uint64_t seq;               // Lookups
+    uint64_t gen;
+    unsigned int hits;
+    unsigned int misses;
+    import_ent_t ents[IMPORT_CACHE_SIZE];
+} import_cache_t;
+
 typedef struct vid_out_env_s {
     atomic_int ref_count;
 
@@ -69,12 +139,70 @@ typedef struct vid_out_env_s {
     int fullscreen;
 
     bool is_egl;
+    struct null_out_s * null_out;   // Headless - NULL for wayland output
 
     struct pollqueue * vid_pq;
     struct dmabufs_ctl * dbsc;
     dmabuf_pool_t * dpool;
 
     atomic_int in_flight;
+    unsigned int in_flight_drops;   // Frames dropped as too many in flight
+    unsigned int in_flight_waits;   // _display calls that had to wait (or EAGAIN)
+    bool in_flight_reserved;        // Slot taken by in_flight_ready for w_buf_alloc
+
+    // Backpressure - tiles wait on root's lock, cond & eventfd as they
+    // share its budget
+    vidout_backpressure_t backpressure;
+    atomic_int in_flight_max;       // Current limit (<= IN_FLIGHT_MAX), written under flight_lock
+    bool in_flight_adapt;           // in_flight_max follows release latency
+    pthread_mutex_t flight_lock;
+    pthread_cond_t flight_cond;     // Broadcast on every release
+    int release_efd;                // Written on every release, -1 if none
+    // Adaptive depth estimate - under flight_lock
+    int64_t last_attach_ns;
+    int64_t interval_ewma_ns;       // Between frames
+    int64_t hold_ewma_ns;           // Attach to release
+    unsigned int hold_samples;
+
+    import_cache_t icache;          // dmabuf output only
+
+    // EGL output renders on its own thread which owns the context so
+    // display never waits on swap. The mailbox holds one frame - a frame
+    // not yet picked up when the next arrives is dropped.
+    pthread_t egl_thread;
+    bool egl_thread_ok;
+    pthread_mutex_t egl_lock;
+    pthread_cond_t egl_cond;
+    int egl_setup_rv;               // 1 until the thread has done setup
+    bool egl_stop;
+    AVFrame * egl_frame;            // Mailbox
+    unsigned int egl_rendered;
+    unsigned int egl_replaced;
+
+    // Mosaic tiles share the window, env & pollqueue of root but each has
+    // its own pool so one busy tile can't starve the rest
+    // root is NULL if this isn't a tile
+    struct vid_out_env_s * root;
+    unsigned int tile_n;
+    unsigned int tile_cols;
+    unsigned int tile_rows;
+    // On root: buffers in flight across all tiles & the limit
+    atomic_int tiles_in_flight;
+    int tiles_in_flight_max;
+
+    vsync_clock_t * vsync;
+    // Last modeset - a change drops vsync lock
+    int mode_w;
+    int mode_h;
+    AVRational mode_rate;
+    bench_t * bench;  // Not owned
+
+    // Copies of frames that aren't in our buffers - tiles use root's pool
+    upload_pool_t * upload;
+    pthread_mutex_t upload_lock;    // Stats
+    unsigned int upload_count;
+    int64_t upload_ns_total;
+    int64_t upload_ns_max;
 
 #if HAS_RUNCUBE
     runcube_env_t * rce;
@@ -92,15 +220,31 @@ struct dmabuf_w_env_s {
     window_ctx_t *wc;
 };
 
+// Marks a sw_dmabuf_t for vidout_wayland_frame_dmabuf
+#define SW_DMABUF_MAGIC 0x53574442  // "SWDB"
+
 typedef struct sw_dmabuf_s {
     AVDRMFrameDescriptor desc;
     struct dmabuf_h * dh;
+    uint32_t magic;
 } sw_dmabuf_t;
 
 
 #define WINDOW_WIDTH 1280
 #define WINDOW_HEIGHT 720
 
+// Max buffers held by the compositor per surface
+#define IN_FLIGHT_MAX 8
+// Least depth - one on screen & one queued. The compositor only releases
+// the on-screen buffer once the next is committed so 1 would stall.
+#define IN_FLIGHT_MIN 2
+// Releases seen before the adaptive depth is used
+#define IN_FLIGHT_ADAPT_SAMPLES 8
+// EWMA weight is 1/(1 << this)
+#define IN_FLIGHT_EWMA_SHIFT 3
+// Mosaic: shared budget across all tiles is this * tile count
+#define TILE_IN_FLIGHT 4
+
 
 static inline int frame_cropped_width(const AVFrame * const frame)
 {
@@ -227,12 +371,12 @@ box_rect(const unsigned int par_num, const unsigned int par_den, const wo_rect_t
     if (par_num * win_rect.h < par_den * win_rect.w) {
         // Pillarbox
         r.w = win_rect.h * par_num / par_den;
-        r.x = (win_rect.w - r.w) / 2;
+        r.x = win_rect.x + (win_rect.w - r.w) / 2;
     }
     else {
         // Letterbox
         r.h = win_rect.w * par_den / par_num;
-        r.y = (win_rect.h - r.h) / 2;
+        r.y = win_rect.y + (win_rect.h - r.h) / 2;
     }
     return r;
 }
@@ -265,44 +409,378 @@ set_vid_par(vid_out_env_t * const ve, const AVFrame * const frame)
 typedef struct w_buf_env_s {
     AVBufferRef *buf;
     vid_out_env_t * ve;
+    uint64_t tag;
+    int64_t attach_ns;
+    int cache_slot;             // -1 if not from the import cache
+    uint64_t cache_gen;
 } w_buf_env_t;
 
-static w_buf_env_t *
-w_buf_alloc(vid_out_env_t * ve, AVBufferRef *buf)
+static int64_t
+mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Tiles share root's budget so wait on root
+static inline vid_out_env_t *
+flight_env(vid_out_env_t * const ve)
+{
+    return ve->root != NULL ? ve->root : ve;
+}
+
+// ---------------------------------------------------------------------------
+//
+// wl_buffer import cache
+// Decoders cycle through a small fixed set of buffers so rather than
+// re-importing every frame keep the wo_fb (& with it the compositor's
+// import) for each buffer we see & reattach it when the buffer comes round
+// again.
+
+static void
+import_ent_clear(import_ent_t * const ent)
+{
+    // Anything in flight has its own ref
+    wo_fb_unref(&ent->wofb);
+    ent->busy = false;
+}
+
+static void
+import_cache_flush(import_cache_t * const ic)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&ic->lock);
+    for (i = 0; i != IMPORT_CACHE_SIZE; ++i)
+        import_ent_clear(ic->ents + i);
+    pthread_mutex_unlock(&ic->lock);
+}
+
+static void
+import_cache_init(import_cache_t * const ic)
 {
-    if (atomic_fetch_add(&ve->in_flight, 1) < 8) {
-        w_buf_env_t *wbe = malloc(sizeof(*wbe));
-        if (wbe == NULL)
-            return NULL;
-        wbe->buf = av_buffer_ref(buf);
-        wbe->ve = ve;
-        return wbe;
+    pthread_mutex_init(&ic->lock, NULL);
+}
+
+static void
+import_cache_uninit(import_cache_t * const ic)
+{
+    import_cache_flush(ic);
+    pthread_mutex_destroy(&ic->lock);
+}
+
+// Returns -1 if any object can't be identified
+static int
+import_key_make(import_key_t * const key, const AVDRMFrameDescriptor * const desc,
+                const unsigned int width, const unsigned int height)
+{
+    unsigned int n = 0;
+    int i, j;
+
+    memset(key, 0, sizeof(*key));   // Compared with memcmp
+    if (desc->nb_objects > AV_DRM_MAX_PLANES)
+        return -1;
+
+    key->format = desc->layers[0].format;
+    key->mod = desc->objects[0].format_modifier;
+    key->width = width;
+    key->height = height;
+    key->nb_objects = desc->nb_objects;
+    for (i = 0; i != desc->nb_objects; ++i) {
+        struct stat st;
+        if (fstat(desc->objects[i].fd, &st) != 0)
+            return -1;
+        key->dev[i] = st.st_dev;
+        key->ino[i] = st.st_ino;
+    }
+    for (i = 0; i < desc->nb_layers; ++i) {
+        for (j = 0; j < desc->layers[i].nb_planes; ++j, ++n) {
+            const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
+            if (n >= AV_DRM_MAX_PLANES)
+                return -1;
+            key->obj_no[n] = p->object_index;
+            key->offset[n] = p->offset;
+            key->pitch[n] = p->pitch;
+        }
     }
+    key->nb_planes = n;
+    return 0;
+}
+
+// Find key & mark it in use by wbe. Also ages out stale entries.
+// Returns a new ref to the wo_fb or NULL if not found
+static wo_fb_t *
+import_cache_get(import_cache_t * const ic, const import_key_t * const key, w_buf_env_t * const wbe)
+{
+    wo_fb_t * wofb = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&ic->lock);
+    ++ic->seq;
+    for (i = 0; i != IMPORT_CACHE_SIZE; ++i) {
+        import_ent_t * const ent = ic->ents + i;
+
+        if (ent->wofb == NULL)
+            continue;
+        if (wofb == NULL && !ent->busy && memcmp(&ent->key, key, sizeof(*key)) == 0) {
+            ent->busy = true;
+            ent->last_used = ic->seq;
+            wbe->cache_slot = i;
+            wbe->cache_gen = ent->gen;
+            wofb = wo_fb_ref(ent->wofb);
+        }
+        else if (!ent->busy && ic->seq - ent->last_used > IMPORT_CACHE_AGE_MAX) {
+            import_ent_clear(ent);
+        }
+    }
+    if (wofb != NULL)
+        ++ic->hits;
     else
-    {
+        ++ic->misses;
+    pthread_mutex_unlock(&ic->lock);
+    return wofb;
+}
+
+// Add a newly imported wo_fb, replacing the least recently used idle entry
+// Nothing is added if every entry is in flight
+static void
+import_cache_add(import_cache_t * const ic, const import_key_t * const key, wo_fb_t * const wofb,
+                 w_buf_env_t * const wbe)
+{
+    import_ent_t * lru = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&ic->lock);
+    for (i = 0; i != IMPORT_CACHE_SIZE; ++i) {
+        import_ent_t * const ent = ic->ents + i;
+        if (ent->busy)
+            continue;
+        if (ent->wofb == NULL) {
+            lru = ent;
+            break;
+        }
+        if (lru == NULL || ent->last_used < lru->last_used)
+            lru = ent;
+    }
+    if (lru != NULL) {
+        import_ent_clear(lru);
+        lru->key = *key;
+        lru->wofb = wo_fb_ref(wofb);
+        lru->gen = ++ic->gen;
+        lru->last_used = ic->seq;
+        lru->busy = true;
+        wbe->cache_slot = (int)(lru - ic->ents);
+        wbe->cache_gen = lru->gen;
+    }
+    pthread_mutex_unlock(&ic->lock);
+}
+
+static void
+import_cache_released(import_cache_t * const ic, const w_buf_env_t * const wbe)
+{
+    import_ent_t * ent;
+
+    if (wbe->cache_slot < 0)
+        return;
+    pthread_mutex_lock(&ic->lock);
+    ent = ic->ents + wbe->cache_slot;
+    // Entry may have been flushed & reused whilst we were in flight
+    if (ent->wofb != NULL && ent->gen == wbe->cache_gen)
+        ent->busy = false;
+    pthread_mutex_unlock(&ic->lock);
+}
+
+// ---------------------------------------------------------------------------
+
+static void
+flight_init(vid_out_env_t * const ve)
+{
+    atomic_init(&ve->in_flight_max, IN_FLIGHT_MAX);
+    pthread_mutex_init(&ve->flight_lock, NULL);
+    pthread_cond_init(&ve->flight_cond, NULL);
+    ve->release_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    import_cache_init(&ve->icache);
+}
+
+static void
+flight_uninit(vid_out_env_t * const ve)
+{
+    import_cache_uninit(&ve->icache);
+    if (ve->release_efd != -1)
+        close(ve->release_efd);
+    pthread_cond_destroy(&ve->flight_cond);
+    pthread_mutex_destroy(&ve->flight_lock);
+}
+
+static inline int64_t
+ewma_update(const int64_t avg, const int64_t x)
+{
+    return avg == 0 ? x : avg + ((x - avg) >> IN_FLIGHT_EWMA_SHIFT);
+}
+
+// Enough buffers to cover the time the compositor holds each one plus one
+// for the next frame
+// Call with flight_lock held
+static void
+in_flight_adapt(vid_out_env_t * const ve, const int64_t hold_ns)
+{
+    int n;
+
+    ve->hold_ewma_ns = ewma_update(ve->hold_ewma_ns, hold_ns);
+    if (++ve->hold_samples < IN_FLIGHT_ADAPT_SAMPLES || ve->interval_ewma_ns <= 0)
+        return;
+
+    n = (int)((ve->hold_ewma_ns + ve->interval_ewma_ns - 1) / ve->interval_ewma_ns) + 1;
+    atomic_store_explicit(&ve->in_flight_max,
+                          n < IN_FLIGHT_MIN ? IN_FLIGHT_MIN : n > IN_FLIGHT_MAX ? IN_FLIGHT_MAX : n,
+                          memory_order_relaxed);
+}
+
+static void
+in_flight_put(vid_out_env_t * const ve, const int64_t attach_ns)
+{
+    vid_out_env_t * const fe = flight_env(ve);
+    static const uint64_t one = 1;
+    int n;
+
+    if (ve->root != NULL)
+        atomic_fetch_sub(&ve->root->tiles_in_flight, 1);
+    n = atomic_fetch_sub(&ve->in_flight, 1);
+    assert(n > 0);
+    (void)n;
+
+    pthread_mutex_lock(&fe->flight_lock);
+    if (ve->in_flight_adapt && attach_ns != 0)
+        in_flight_adapt(ve, mono_ns() - attach_ns);
+    pthread_cond_broadcast(&fe->flight_cond);
+    pthread_mutex_unlock(&fe->flight_lock);
+
+    if (fe->release_efd != -1 && write(fe->release_efd, &one, sizeof(one)) < 0) {
+        // Only fails if the count would overflow - the fd is readable anyway
+    }
+}
+
+// Take a slot from the per surface limit & for tiles the shared budget
+// Doesn't take flight_lock so may be called with it held
+static bool
+in_flight_get(vid_out_env_t * const ve)
+{
+    if (atomic_fetch_add(&ve->in_flight, 1) >= atomic_load_explicit(&ve->in_flight_max, memory_order_relaxed)) {
         atomic_fetch_sub(&ve->in_flight, 1);
+        return false;
+    }
+    if (ve->root != NULL &&
+        atomic_fetch_add(&ve->root->tiles_in_flight, 1) >= ve->root->tiles_in_flight_max) {
+        atomic_fetch_sub(&ve->root->tiles_in_flight, 1);
+        atomic_fetch_sub(&ve->in_flight, 1);
+        // Anyone that saw our transient count as full must look again
+        pthread_cond_broadcast(&flight_env(ve)->flight_cond);
+        return false;
+    }
+    return true;
+}
+
+// Apply the backpressure mode before a new frame is taken on
+// BLOCK & EAGAIN reserve the slot under flight_lock so another tile can't
+// take it before w_buf_alloc does.
+// Returns 0 if there is (or now is) room, AVERROR(EAGAIN) if full & not
+// blocking. DROP always returns 0 & leaves the drop to w_buf_alloc.
+static int
+in_flight_ready(vid_out_env_t * const ve)
+{
+    vid_out_env_t * const fe = flight_env(ve);
+    int rv = 0;
+
+    if (ve->backpressure == VIDOUT_BACKPRESSURE_DROP)
+        return 0;
+
+    pthread_mutex_lock(&fe->flight_lock);
+    if (!in_flight_get(ve)) {
+        ++ve->in_flight_waits;
+        while (!in_flight_get(ve)) {
+            if (ve->backpressure == VIDOUT_BACKPRESSURE_EAGAIN) {
+                rv = AVERROR(EAGAIN);
+                break;
+            }
+            pthread_cond_wait(&fe->flight_cond, &fe->flight_lock);
+        }
+    }
+    ve->in_flight_reserved = (rv == 0);
+    pthread_mutex_unlock(&fe->flight_lock);
+    return rv;
+}
+
+// Give back a reservation that no buffer used
+static void
+in_flight_unreserve(vid_out_env_t * const ve)
+{
+    if (!ve->in_flight_reserved)
+        return;
+    ve->in_flight_reserved = false;
+    in_flight_put(ve, 0);
+}
+
+static w_buf_env_t *
+w_buf_alloc(vid_out_env_t * ve, AVBufferRef *buf)
+{
+    w_buf_env_t *wbe;
+
+    if (ve->in_flight_reserved)
+        ve->in_flight_reserved = false;
+    else if (!in_flight_get(ve))
+        return NULL;
+    if ((wbe = malloc(sizeof(*wbe))) == NULL) {
+        in_flight_put(ve, 0);
         return NULL;
     }
+    wbe->buf = av_buffer_ref(buf);
+    wbe->ve = ve;
+    wbe->tag = 0;
+    wbe->attach_ns = 0;
+    wbe->cache_slot = -1;
+    wbe->cache_gen = 0;
+    return wbe;
 }
 
 static void
 w_buf_free(w_buf_env_t * wbe)
 {
     av_buffer_unref(&wbe->buf);
-    assert(atomic_fetch_sub(&wbe->ve->in_flight, 1) > 0);
+    in_flight_put(wbe->ve, wbe->attach_ns);
     free(wbe);
 }
 
+// Stamp the attach time for hold time & frame interval estimation
+static void
+w_buf_attached(w_buf_env_t * const wbe, const int64_t now)
+{
+    vid_out_env_t * const ve = wbe->ve;
+    vid_out_env_t * const fe = flight_env(ve);
+
+    wbe->attach_ns = now;
+    if (!ve->in_flight_adapt)
+        return;
+    pthread_mutex_lock(&fe->flight_lock);
+    if (ve->last_attach_ns != 0)
+        ve->interval_ewma_ns = ewma_update(ve->interval_ewma_ns, now - ve->last_attach_ns);
+    ve->last_attach_ns = now;
+    pthread_mutex_unlock(&fe->flight_lock);
+}
+
 static void
 w_buffer_release(void *data, wo_fb_t *wofb)
 {
     // Sent by the compositor when it's no longer using this buffer
+    w_buf_env_t * const wbe = data;
+    bench_stamp(wbe->ve->bench, wbe->tag, BENCH_STAGE_RELEASED, 0);
+    import_cache_released(&wbe->ve->icache, wbe);
     wo_fb_unref(&wofb);
-    w_buf_free(data);
+    w_buf_free(wbe);
 }
 
 static void
-do_display_dmabuf(vid_out_env_t * const ve, AVFrame *const frame)
+do_display_dmabuf(vid_out_env_t * const ve, AVFrame *const frame, const uint64_t tag)
 {
     const AVDRMFrameDescriptor *desc = frame->format == AV_PIX_FMT_DRM_PRIME ?
         (AVDRMFrameDescriptor * ) frame->data[0] :
@@ -315,6 +793,8 @@ do_display_dmabuf(vid_out_env_t * const ve, AVFrame *const frame)
     const uint64_t mod = desc->objects[0].format_modifier;
     int i;
     w_buf_env_t * wbe;
+    import_key_t key;
+    const bool key_ok = (import_key_make(&key, desc, width, height) == 0);
 
 #if TRACE_ALL
     LOG("<<< %s\n", __func__);
@@ -322,16 +802,23 @@ do_display_dmabuf(vid_out_env_t * const ve, AVFrame *const frame)
 
     if (!wo_surface_dmabuf_fmt_check(ve->vid, format, mod)) {
         LOG("No support for format %s mod %#"PRIx64"\n", av_fourcc2str(format), mod);
+        bench_drop(ve->bench, tag);
         return;
     }
 
     wbe = w_buf_alloc(ve, frame->buf[0]);
     if (wbe == NULL) {
         LOG("Frame discard due to in_flight\n");
+        ++ve->in_flight_drops;
+        bench_drop(ve->bench, tag);
         return;
     }
+    wbe->tag = tag;
 
-    {
+    if (key_ok)
+        wofb = import_cache_get(&ve->icache, &key, wbe);
+
+    if (wofb == NULL) {
         struct dmabuf_h * dhs[4];
         size_t offsets[4];
         size_t strides[4];
@@ -354,20 +841,175 @@ do_display_dmabuf(vid_out_env_t * const ve, AVFrame *const frame)
                             format, mod,
                             desc->nb_objects, dhs,
                             n, offsets, strides, obj_nos);
+        if (wofb != NULL && key_ok)
+            import_cache_add(&ve->icache, &key, wofb, wbe);
     }
 
     if (wofb == NULL) {
         LOG("Failed to create dmabuf\n");
+        bench_drop(ve->bench, tag);
         w_buf_free(wbe);
         return;
     }
 
     // **** Maybe better to attach buf delete to wofb delete?
     wo_fb_on_release_set(wofb, true, w_buffer_release, wbe);
+    wo_fb_tag_set(wofb, tag);
+    bench_stamp(ve->bench, tag, BENCH_STAGE_ATTACH, 0);
+    w_buf_attached(wbe, mono_ns());
 
     wo_surface_attach_fb(ve->vid, wofb, box_rect(ve->vid_par_num, ve->vid_par_den, ve->win_rect));
 }
 
+// ---------------------------------------------------------------------------
+//
+// Null (headless) display function
+// Frames are "presented" as soon as they arrive & held, as a compositor
+// would, until hold_frames newer ones have arrived or they are older
+// than hold_ns (if set). The release thread then frees them with the
+// same in_flight & bench accounting as a wayland release.
+
+typedef struct null_held_s {
+    w_buf_env_t * wbe;
+    int64_t release_ns;
+} null_held_t;
+
+typedef struct null_out_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool terminate;
+    int64_t hold_ns;            // 0 = release on count only
+    unsigned int hold_frames;
+
+    null_held_t held[IN_FLIGHT_MAX];
+    unsigned int held_n;        // Held frames start at held[0]
+    unsigned int presented;
+
+    pthread_t thread;
+} null_out_t;
+
+static void *
+null_release_thread(void * v)
+{
+    null_out_t * const no = v;
+
+    pthread_mutex_lock(&no->lock);
+    for (;;) {
+        w_buf_env_t * wbe;
+
+        if (no->held_n == 0) {
+            if (no->terminate)
+                break;
+            pthread_cond_wait(&no->cond, &no->lock);
+            continue;
+        }
+
+        if (!no->terminate && no->held_n <= no->hold_frames) {
+            struct timespec ts;
+
+            if (no->hold_ns == 0) {
+                pthread_cond_wait(&no->cond, &no->lock);
+                continue;
+            }
+            if (no->held[0].release_ns > mono_ns()) {
+                ts.tv_sec = no->held[0].release_ns / 1000000000;
+                ts.tv_nsec = no->held[0].release_ns % 1000000000;
+                pthread_cond_timedwait(&no->cond, &no->lock, &ts);
+                continue;
+            }
+        }
+
+        wbe = no->held[0].wbe;
+        --no->held_n;
+        memmove(no->held, no->held + 1, no->held_n * sizeof(*no->held));
+        pthread_mutex_unlock(&no->lock);
+
+        bench_stamp(wbe->ve->bench, wbe->tag, BENCH_STAGE_RELEASED, 0);
+        w_buf_free(wbe);
+
+        pthread_mutex_lock(&no->lock);
+    }
+    pthread_mutex_unlock(&no->lock);
+    return NULL;
+}
+
+// Releases anything still held
+static void
+null_out_delete(null_out_t ** const ppno)
+{
+    null_out_t * const no = *ppno;
+
+    if (no == NULL)
+        return;
+    *ppno = NULL;
+
+    pthread_mutex_lock(&no->lock);
+    no->terminate = true;
+    pthread_cond_signal(&no->cond);
+    pthread_mutex_unlock(&no->lock);
+    pthread_join(no->thread, NULL);
+
+    pthread_cond_destroy(&no->cond);
+    pthread_mutex_destroy(&no->lock);
+    free(no);
+}
+
+static null_out_t *
+null_out_new(const int64_t hold_ns, const unsigned int hold_frames)
+{
+    null_out_t * const no = calloc(1, sizeof(*no));
+    pthread_condattr_t attr;
+
+    if (no == NULL)
+        return NULL;
+
+    no->hold_ns = hold_ns;
+    // Can't hold more than can be in flight
+    no->hold_frames = hold_frames < IN_FLIGHT_MAX ? hold_frames : IN_FLIGHT_MAX - 1;
+    pthread_mutex_init(&no->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&no->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&no->thread, NULL, null_release_thread, no) != 0) {
+        pthread_cond_destroy(&no->cond);
+        pthread_mutex_destroy(&no->lock);
+        free(no);
+        return NULL;
+    }
+    return no;
+}
+
+static void
+do_display_null(vid_out_env_t * const ve, AVFrame *const frame, const uint64_t tag)
+{
+    null_out_t * const no = ve->null_out;
+    w_buf_env_t * wbe;
+    int64_t now;
+
+    wbe = w_buf_alloc(ve, frame->buf[0]);
+    if (wbe == NULL) {
+        ++ve->in_flight_drops;
+        bench_drop(ve->bench, tag);
+        return;
+    }
+    wbe->tag = tag;
+
+    now = mono_ns();
+    w_buf_attached(wbe, now);
+    bench_stamp(ve->bench, tag, BENCH_STAGE_ATTACH, now);
+    bench_stamp(ve->bench, tag, BENCH_STAGE_COMMIT, now);
+    bench_stamp(ve->bench, tag, BENCH_STAGE_PRESENTED, now);
+
+    // in_flight limits how many we can have so there is always room
+    pthread_mutex_lock(&no->lock);
+    no->held[no->held_n++] = (null_held_t){.wbe = wbe, .release_ns = now + no->hold_ns};
+    ++no->presented;
+    pthread_cond_signal(&no->cond);
+    pthread_mutex_unlock(&no->lock);
+}
+
 // ---------------------------------------------------------------------------
 //
 // EGL display function
@@ -403,17 +1045,109 @@ check_support_egl(window_ctx_t *const wc, const uint32_t fmt, const uint64_t mod
     return false;
 }
 
+// EGLImage cache
+// As with the wl_buffer import cache keep the image & texture for each
+// dmabuf we have seen so steady state is just bind & draw. Entries hold
+// dups of the buffer's fds so its identity can't be reused under us; they
+// are dropped when they go unused for a while (the buffer's pool has gone
+// away) or when a flush is requested on decoder / graph close.
+// Must only be called with the GL context current.
+
 static void
-do_display_egl(vid_out_env_t * const ve, AVFrame *const frame)
+egl_ent_clear(window_ctx_t * const wc, egl_ent_t * const ent)
+{
+    unsigned int i;
+
+    if (ent->image == EGL_NO_IMAGE_KHR)
+        return;
+    glDeleteTextures(1, &ent->texture);
+    eglDestroyImageKHR(wc->egl_display, ent->image);
+    for (i = 0; i != ent->key.nb_objects; ++i)
+        close(ent->fds[i]);
+    memset(ent, 0, sizeof(*ent));
+}
+
+static void
+egl_cache_flush(window_ctx_t * const wc)
+{
+    unsigned int i;
+
+    for (i = 0; i != EGL_CACHE_SIZE; ++i)
+        egl_ent_clear(wc, wc->egl_cache + i);
+}
+
+// Find key - also ages out stale entries
+static egl_ent_t *
+egl_cache_get(window_ctx_t * const wc, const import_key_t * const key)
+{
+    egl_ent_t * found = NULL;
+    unsigned int i;
+
+    if (atomic_exchange(&wc->egl_flush, false))
+        egl_cache_flush(wc);
+
+    ++wc->egl_seq;
+    for (i = 0; i != EGL_CACHE_SIZE; ++i) {
+        egl_ent_t * const ent = wc->egl_cache + i;
+
+        if (ent->image == EGL_NO_IMAGE_KHR)
+            continue;
+        if (found == NULL && memcmp(&ent->key, key, sizeof(*key)) == 0) {
+            ent->last_used = wc->egl_seq;
+            found = ent;
+        }
+        else if (wc->egl_seq - ent->last_used > EGL_CACHE_AGE_MAX) {
+            egl_ent_clear(wc, ent);
+        }
+    }
+    if (found != NULL)
+        ++wc->egl_hits;
+    else
+        ++wc->egl_misses;
+    return found;
+}
+
+// Takes ownership of image & texture on success, replacing the least
+// recently used entry
+static int
+egl_cache_add(window_ctx_t * const wc, const import_key_t * const key, const AVDRMFrameDescriptor * const desc,
+              const EGLImage image, const GLuint texture)
+{
+    egl_ent_t * lru = NULL;
+    unsigned int i;
+
+    for (i = 0; i != EGL_CACHE_SIZE; ++i) {
+        egl_ent_t * const ent = wc->egl_cache + i;
+        if (ent->image == EGL_NO_IMAGE_KHR) {
+            lru = ent;
+            break;
+        }
+        if (lru == NULL || ent->last_used < lru->last_used)
+            lru = ent;
+    }
+    egl_ent_clear(wc, lru);
+
+    for (i = 0; i != key->nb_objects; ++i) {
+        if ((lru->fds[i] = fcntl(desc->objects[i].fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+            while (i-- != 0)
+                close(lru->fds[i]);
+            return -1;
+        }
+    }
+    lru->key = *key;
+    lru->image = image;
+    lru->texture = texture;
+    lru->last_used = wc->egl_seq;
+    return 0;
+}
+
+static int
+egl_import(window_ctx_t * const wc, const AVFrame * const frame, const AVDRMFrameDescriptor * const desc,
+           EGLImage * const pimage, GLuint * const ptexture)
 {
-    window_ctx_t *const wc = &ve->wc;
-    const AVDRMFrameDescriptor *desc = frame->format == AV_PIX_FMT_DRM_PRIME ?
-        (AVDRMFrameDescriptor * ) frame->data[0] :
-        &((sw_dmabuf_t *)(frame->buf[0]->data))->desc;
     EGLint attribs[50];
     EGLint *a = attribs;
     int i, j;
-    GLuint texture;
     EGLImage image;
 
     static const EGLint anames[] = {
@@ -435,24 +1169,6 @@ do_display_egl(vid_out_env_t * const ve, AVFrame *const frame)
     };
     const EGLint *b = anames;
 
-#if TRACE_ALL
-    LOG("<<< %s\n", __func__);
-#endif
-
-    if (!check_support_egl(wc, desc->layers[0].format, desc->objects[0].format_modifier)) {
-        LOG("No support for format %s mod %#"PRIx64"\n", av_fourcc2str(desc->layers[0].format), desc->objects[0].format_modifier);
-        return;
-    }
-#if 0
-    if (wc->req_w != wc->window_width || wc->req_h != wc->window_height) {
-        LOG("%s: Resize %dx%d -> %dx%d\n", __func__, wc->window_width, wc->window_height, wc->req_w, wc->req_h);
-        wl_egl_window_resize(wc->w_egl_window, wc->req_w, wc->req_h, 0, 0);
-        wc->window_width = wc->req_w;
-        wc->window_height = wc->req_h;
-        wp_viewport_set_destination(wc->vid.viewport, wc->req_w, wc->req_h);
-        wl_surface_commit(wc->vid.surface);
-    }
-#endif
     *a++ = EGL_WIDTH;
     *a++ = frame_cropped_width(frame);
     *a++ = EGL_HEIGHT;
@@ -486,22 +1202,72 @@ do_display_egl(vid_out_env_t * const ve, AVFrame *const frame)
     if (!(image = eglCreateImageKHR(wc->egl_display, EGL_NO_CONTEXT,
                                     EGL_LINUX_DMA_BUF_EXT, NULL, attribs))) {
         LOG("Failed to import fd %d\n", desc->objects[0].fd);
-        return;
+        return -1;
     }
 
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+    glGenTextures(1, ptexture);
+    glBindTexture(GL_TEXTURE_EXTERNAL_OES, *ptexture);
     glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
 
-    eglDestroyImageKHR(wc->egl_display, image);
+    *pimage = image;
+    return 0;
+}
+
+static void
+do_display_egl(vid_out_env_t * const ve, AVFrame *const frame)
+{
+    window_ctx_t *const wc = &ve->wc;
+    const AVDRMFrameDescriptor *desc = frame->format == AV_PIX_FMT_DRM_PRIME ?
+        (AVDRMFrameDescriptor * ) frame->data[0] :
+        &((sw_dmabuf_t *)(frame->buf[0]->data))->desc;
+    import_key_t key;
+    const egl_ent_t * ent = NULL;
+    bool key_ok;
+    bool cached = true;
+    EGLImage image;
+    GLuint texture;
+
+#if TRACE_ALL
+    LOG("<<< %s\n", __func__);
+#endif
+
+    if (!check_support_egl(wc, desc->layers[0].format, desc->objects[0].format_modifier)) {
+        LOG("No support for format %s mod %#"PRIx64"\n", av_fourcc2str(desc->layers[0].format), desc->objects[0].format_modifier);
+        return;
+    }
+#if 0
+    if (wc->req_w != wc->window_width || wc->req_h != wc->window_height) {
+        LOG("%s: Resize %dx%d -> %dx%d\n", __func__, wc->window_width, wc->window_height, wc->req_w, wc->req_h);
+        wl_egl_window_resize(wc->w_egl_window, wc->req_w, wc->req_h, 0, 0);
+        wc->window_width = wc->req_w;
+        wc->window_height = wc->req_h;
+        wp_viewport_set_destination(wc->vid.viewport, wc->req_w, wc->req_h);
+        wl_surface_commit(wc->vid.surface);
+    }
+#endif
+
+    key_ok = (import_key_make(&key, desc, frame_cropped_width(frame), frame_cropped_height(frame)) == 0);
+    if (key_ok && (ent = egl_cache_get(wc, &key)) != NULL) {
+        texture = ent->texture;
+    }
+    else {
+        if (egl_import(wc, frame, desc, &image, &texture) != 0)
+            return;
+        // If uncacheable the texture keeps what it needs of the image
+        if (!key_ok || egl_cache_add(wc, &key, desc, image, texture) != 0) {
+            eglDestroyImageKHR(wc->egl_display, image);
+            cached = false;
+        }
+    }
 
     glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
     glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
     eglSwapBuffers(wc->egl_display, wc->egl_surface);
 
-    glDeleteTextures(1, &texture);
+    if (!cached)
+        glDeleteTextures(1, &texture);
 
     // A fence is set on the fd by the egl render - we can reuse the buffer once it goes away
     // (same as the direct wayland output after buffer release)
@@ -750,10 +1516,127 @@ fail:
     return -1;
 }
 
+// ---------------------------------------------------------------------------
+//
+// EGL render thread
+
+static void *
+egl_render_thread(void * v)
+{
+    vid_out_env_t * const ve = v;
+    window_ctx_t * const wc = &ve->wc;
+    AVFrame * frame;
+    int rv;
+
+    // Context is current on this thread only
+    if ((rv = do_egl_setup(ve)) == 0) {
+        // Swap mustn't wait for vblank - the compositor will pick up the
+        // newest buffer & we have already dropped anything older
+        if (!eglSwapInterval(wc->egl_display, 0))
+            LOG("%s: Failed to set swap interval 0\n", __func__);
+    }
+
+    pthread_mutex_lock(&ve->egl_lock);
+    ve->egl_setup_rv = rv;
+    pthread_cond_broadcast(&ve->egl_cond);
+
+    while (rv == 0) {
+        while (ve->egl_frame == NULL && !ve->egl_stop)
+            pthread_cond_wait(&ve->egl_cond, &ve->egl_lock);
+        if (ve->egl_stop)
+            break;
+
+        frame = ve->egl_frame;
+        ve->egl_frame = NULL;
+        pthread_mutex_unlock(&ve->egl_lock);
+
+        do_display_egl(ve, frame);
+        av_frame_free(&frame);
+
+        pthread_mutex_lock(&ve->egl_lock);
+        ++ve->egl_rendered;
+    }
+    pthread_mutex_unlock(&ve->egl_lock);
+
+    if (rv == 0) {
+        // GL objects must go whilst the context is still current
+        egl_cache_flush(wc);
+        eglMakeCurrent(wc->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    }
+    return NULL;
+}
+
+// Takes ownership of frame
+static void
+egl_mailbox_put(vid_out_env_t * const ve, AVFrame * frame)
+{
+    AVFrame * old;
+
+    pthread_mutex_lock(&ve->egl_lock);
+    old = ve->egl_frame;
+    ve->egl_frame = frame;
+    if (old != NULL)
+        ++ve->egl_replaced;
+    pthread_cond_broadcast(&ve->egl_cond);
+    pthread_mutex_unlock(&ve->egl_lock);
+
+    av_frame_free(&old);
+}
+
+static int
+egl_thread_start(vid_out_env_t * const ve)
+{
+    int rv;
+
+    pthread_mutex_init(&ve->egl_lock, NULL);
+    pthread_cond_init(&ve->egl_cond, NULL);
+    ve->egl_setup_rv = 1;
+
+    if (pthread_create(&ve->egl_thread, NULL, egl_render_thread, ve) != 0) {
+        pthread_cond_destroy(&ve->egl_cond);
+        pthread_mutex_destroy(&ve->egl_lock);
+        return -1;
+    }
+    ve->egl_thread_ok = true;
+
+    pthread_mutex_lock(&ve->egl_lock);
+    while (ve->egl_setup_rv == 1)
+        pthread_cond_wait(&ve->egl_cond, &ve->egl_lock);
+    rv = ve->egl_setup_rv;
+    pthread_mutex_unlock(&ve->egl_lock);
+    return rv;
+}
+
+static void
+egl_thread_stop(vid_out_env_t * const ve)
+{
+    if (!ve->egl_thread_ok)
+        return;
+    ve->egl_thread_ok = false;
+
+    pthread_mutex_lock(&ve->egl_lock);
+    ve->egl_stop = true;
+    pthread_cond_broadcast(&ve->egl_cond);
+    pthread_mutex_unlock(&ve->egl_lock);
+    pthread_join(ve->egl_thread, NULL);
+
+    av_frame_free(&ve->egl_frame);
+    pthread_cond_destroy(&ve->egl_cond);
+    pthread_mutex_destroy(&ve->egl_lock);
+
+    if (ve->egl_rendered + ve->egl_replaced != 0)
+        LOG("Video: EGL rendered %u, replaced in mailbox %u\n", ve->egl_rendered, ve->egl_replaced);
+}
+
 // ---------------------------------------------------------------------------
 //
 // get_buffer2 for s/w decoders
 
+// Line alignment for frames from vidout_wayland_frame_alloc
+#define SW_FRAME_STRIDE_ALIGN 64
+// Longest get_buffer2 will wait for a free dmabuf
+#define SW_DMABUF_WAIT_MS 200
+
 static void sw_dmabuf_free(void *opaque, uint8_t *data)
 {
     sw_dmabuf_t * const swd = opaque;
@@ -762,27 +1645,27 @@ static void sw_dmabuf_free(void *opaque, uint8_t *data)
     free(swd);
 }
 
+// w & h are the already aligned dimensions
 static AVBufferRef *
-sw_dmabuf_make(struct AVCodecContext * const avctx, vid_out_env_t * const vc, const AVFrame * const frame)
+sw_dmabuf_make(vid_out_env_t * const vc, const enum AVPixelFormat fmt, int w, const int h,
+               const int stride_align[AV_NUM_DATA_POINTERS])
 {
     sw_dmabuf_t * const swd = calloc(1, sizeof(*swd));
     AVBufferRef * buf;
     int linesize[4];
-    int w = frame->width;
-    int h = frame->height;
     int unaligned;
     ptrdiff_t linesize1[4];
     size_t size[4];
-    int stride_align[AV_NUM_DATA_POINTERS];
     size_t total_size;
     unsigned int i;
     unsigned int planes;
     uint64_t drm_mod;
-    const uint32_t drm_fmt = fmt_to_drm(frame->format, &drm_mod);
+    const uint32_t drm_fmt = fmt_to_drm(fmt, &drm_mod);
     int ret;
 
     if (swd == NULL)
         return NULL;
+    swd->magic = SW_DMABUF_MAGIC;
 
     if (drm_fmt == 0 ||
         (buf = av_buffer_create((uint8_t*)swd, sizeof(*swd), sw_dmabuf_free, swd, 0)) == NULL) {
@@ -791,12 +1674,10 @@ sw_dmabuf_make(struct AVCodecContext * const avctx, vid_out_env_t * const vc, co
     }
 
     // Size & align code taken from libavcodec/getbuffer.c:update_frame_pool
-    avcodec_align_dimensions2(avctx, &w, &h, stride_align);
-
     do {
         // NOTE: do not align linesizes individually, this breaks e.g. assumptions
         // that linesize[0] == 2*linesize[1] in the MPEG-encoder for 4:2:2
-        ret = av_image_fill_linesizes(linesize, avctx->pix_fmt, w);
+        ret = av_image_fill_linesizes(linesize, fmt, w);
         if (ret < 0)
             goto fail;
         // increase alignment of w for next try (rhs gives the lowest bit set in w)
@@ -809,7 +1690,7 @@ sw_dmabuf_make(struct AVCodecContext * const avctx, vid_out_env_t * const vc, co
 
     for (i = 0; i < 4; i++)
         linesize1[i] = linesize[i];
-    ret = av_image_fill_plane_sizes(size, avctx->pix_fmt, h, linesize1);
+    ret = av_image_fill_plane_sizes(size, fmt, h, linesize1);
     if (ret < 0)
         goto fail;
 
@@ -817,14 +1698,11 @@ sw_dmabuf_make(struct AVCodecContext * const avctx, vid_out_env_t * const vc, co
     for (planes = 0; planes != 4 && size[planes] != 0; ++planes)
         total_size += size[planes];
 
-    for (i = 0; i != 20; ++i) {
-        if ((swd->dh = dmabuf_pool_fb_new(vc->dpool, total_size)) != NULL)
-            break;
-        fprintf(stderr, "dmabuf_alloc fail #%d\n", i);
-        usleep(10000);  // **** Kludge
-    }
-    if (i >= 20)
+    // Pool may be exhausted by frames still on display - wait for a release
+    if ((swd->dh = dmabuf_pool_fb_new_wait(vc->dpool, total_size, SW_DMABUF_WAIT_MS)) == NULL) {
+        fprintf(stderr, "dmabuf_alloc fail: no buffer after %dms\n", SW_DMABUF_WAIT_MS);
         goto fail;
+    }
 
     swd->desc.nb_objects = 1;
     swd->desc.objects[0].fd = dmabuf_fd(swd->dh);
@@ -868,15 +1746,132 @@ sw_dmabuf_frame_fill(AVFrame * const frame, const AVBufferRef * const buf)
 int vidout_wayland_get_buffer2(struct AVCodecContext *s, AVFrame *frame, int flags)
 {
     vid_out_env_t * const vc = s->opaque;
+    int w = frame->width;
+    int h = frame->height;
+    int stride_align[AV_NUM_DATA_POINTERS];
     (void)flags;
 
+    avcodec_align_dimensions2(s, &w, &h, stride_align);
+
     frame->opaque = vc;
-    if ((frame->buf[0] = sw_dmabuf_make(s, vc, frame)) == NULL)
+    if ((frame->buf[0] = sw_dmabuf_make(vc, frame->format, w, h, stride_align)) == NULL)
         return -1;
     sw_dmabuf_frame_fill(frame, frame->buf[0]);
     return 0;
 }
 
+struct dmabuf_h *
+vidout_wayland_frame_dmabuf(const AVFrame * const frame)
+{
+    const sw_dmabuf_t * swd;
+
+    if (frame->format == AV_PIX_FMT_DRM_PRIME || frame->buf[0] == NULL ||
+        frame->buf[0]->size != sizeof(sw_dmabuf_t) ||
+        av_buffer_get_opaque(frame->buf[0]) != (void *)frame->buf[0]->data)
+        return NULL;
+    swd = (const sw_dmabuf_t *)frame->buf[0]->data;
+    return swd->magic == SW_DMABUF_MAGIC ? swd->dh : NULL;
+}
+
+// Filters copy opaque from their input frame so check that the buffer is
+// really one of ours too. Pass-through filters (crop, vflip) can move
+// the data pointers within our buffer - display uses the descriptor so
+// the planes must still be where it says.
+static bool
+frame_is_pooled(const vid_out_env_t * const vc, const AVFrame * const frame)
+{
+    const sw_dmabuf_t * swd;
+    const uint8_t * data;
+    int i;
+
+    if (frame->opaque != vc || vidout_wayland_frame_dmabuf(frame) == NULL)
+        return false;
+
+    swd = (const sw_dmabuf_t *)frame->buf[0]->data;
+    if ((data = dmabuf_map(swd->dh)) == NULL)
+        return false;
+    for (i = 0; i != swd->desc.layers[0].nb_planes; ++i) {
+        const AVDRMPlaneDescriptor * const p = swd->desc.layers[0].planes + i;
+        if (frame->data[i] != data + p->offset || frame->linesize[i] != (int)p->pitch)
+            return false;
+    }
+    return true;
+}
+
+static int64_t
+upload_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+vidout_wayland_frame_to_pool(vid_out_env_t * vc, AVFrame * frame)
+{
+    upload_pool_t * const up = vc->root != NULL ? vc->root->upload : vc->upload;
+    struct dmabuf_h * dh;
+    AVFrame * dst;
+    int64_t t0, dt;
+    int ret;
+
+    if (frame->format == AV_PIX_FMT_DRM_PRIME || frame_is_pooled(vc, frame))
+        return 0;
+
+    t0 = upload_time_ns();
+    if ((dst = vidout_wayland_frame_alloc(vc, frame->format, frame->width, frame->height)) == NULL)
+        return AVERROR(ENOMEM);
+    dh = ((sw_dmabuf_t *)dst->buf[0]->data)->dh;
+
+    dmabuf_write_start(dh);
+    ret = upload_pool_copy(up, dst, frame);
+    dmabuf_write_end(dh);
+    if (ret < 0 || (ret = av_frame_copy_props(dst, frame)) < 0) {
+        av_frame_free(&dst);
+        return ret;
+    }
+    dst->opaque = vc;
+
+    dt = upload_time_ns() - t0;
+    pthread_mutex_lock(&vc->upload_lock);
+    ++vc->upload_count;
+    vc->upload_ns_total += dt;
+    if (dt > vc->upload_ns_max)
+        vc->upload_ns_max = dt;
+    pthread_mutex_unlock(&vc->upload_lock);
+
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, dst);
+    av_frame_free(&dst);
+    return 0;
+}
+
+AVFrame *
+vidout_wayland_frame_alloc(vid_out_env_t * vc, const int format, const int width, const int height)
+{
+    AVFrame * frame = av_frame_alloc();
+    int stride_align[AV_NUM_DATA_POINTERS];
+    unsigned int i;
+
+    if (frame == NULL)
+        return NULL;
+
+    // Any alignment that suits a decoder will suit the display
+    for (i = 0; i != AV_NUM_DATA_POINTERS; ++i)
+        stride_align[i] = SW_FRAME_STRIDE_ALIGN;
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    frame->opaque = vc;
+    if ((frame->buf[0] = sw_dmabuf_make(vc, format, width, height, stride_align)) == NULL) {
+        av_frame_free(&frame);
+        return NULL;
+    }
+    sw_dmabuf_frame_fill(frame, frame->buf[0]);
+    return frame;
+}
+
 // ---------------------------------------------------------------------------
 //
 // External entry points
@@ -884,11 +1879,14 @@ int vidout_wayland_get_buffer2(struct AVCodecContext *s, AVFrame *frame, int fla
 void
 vidout_wayland_modeset(vid_out_env_t *vc, int w, int h, AVRational frame_rate)
 {
-    (void)vc;
-    (void)w;
-    (void)h;
-    (void)frame_rate;
-    /* NIF */
+    // We don't change the output mode ourselves but the compositor may
+    // (e.g. fullscreen refresh matching) so don't trust the old estimate
+    if (w == vc->mode_w && h == vc->mode_h && av_cmp_q(frame_rate, vc->mode_rate) == 0)
+        return;
+    vc->mode_w = w;
+    vc->mode_h = h;
+    vc->mode_rate = frame_rate;
+    vsync_clock_reset(vc->vsync);
 }
 
 int
@@ -897,14 +1895,89 @@ vidout_wayland_in_flight(const vid_out_env_t * vc)
     return atomic_load(&vc->in_flight);
 }
 
+unsigned int
+vidout_wayland_discarded(const vid_out_env_t * vc)
+{
+    return vc->vid == NULL ? 0 : wo_surface_stats_get(vc->vid)->discarded_count;
+}
+
+int
+vidout_wayland_clock_id(const vid_out_env_t * vc)
+{
+    return vc->woe == NULL ? CLOCK_MONOTONIC : wo_env_presentation_clock(vc->woe);
+}
+
+void
+vidout_wayland_backpressure_set(vid_out_env_t * vc, const vidout_backpressure_t mode, const unsigned int depth)
+{
+    vid_out_env_t * const fe = flight_env(vc);
+
+    pthread_mutex_lock(&fe->flight_lock);
+    vc->backpressure = mode;
+    vc->in_flight_adapt = (depth == 0);
+    atomic_store_explicit(&vc->in_flight_max,
+                          depth == 0 || depth > IN_FLIGHT_MAX ? IN_FLIGHT_MAX :
+                              depth < IN_FLIGHT_MIN ? IN_FLIGHT_MIN : (int)depth,
+                          memory_order_relaxed);
+    vc->hold_samples = 0;
+    // Limit may have gone up
+    pthread_cond_broadcast(&fe->flight_cond);
+    pthread_mutex_unlock(&fe->flight_lock);
+}
+
+void
+vidout_wayland_import_cache_flush(vid_out_env_t * vc)
+{
+    import_cache_flush(&vc->icache);
+    // GL objects can only be freed on the render thread - leave it a note
+    atomic_store(&vc->wc.egl_flush, true);
+}
+
+int
+vidout_wayland_release_fd(const vid_out_env_t * vc)
+{
+    return vc->root != NULL ? vc->root->release_efd : vc->release_efd;
+}
+
+int
+vidout_wayland_in_flight_max(const vid_out_env_t * vc)
+{
+    return atomic_load_explicit(&vc->in_flight_max, memory_order_relaxed);
+}
+
+void
+vidout_wayland_pollqueue_load(const vid_out_env_t * vc, uint64_t * const busy_ns, uint64_t * const idle_ns)
+{
+    if (vc->woe == NULL) {
+        *busy_ns = 0;
+        *idle_ns = 0;
+        return;
+    }
+    wo_env_pollqueue_load(vc->woe, busy_ns, idle_ns);
+}
+
+int
+vidout_wayland_vsync_next(const vid_out_env_t * vc, const int64_t t_ns, int64_t * const vblank_ns, int64_t * const period_ns)
+{
+    return vsync_clock_next(vc->vsync, t_ns, vblank_ns, period_ns);
+}
+
+void
+vidout_wayland_bench_set(vid_out_env_t * vc, bench_t * const bench)
+{
+    vc->bench = bench;
+}
+
 int
 vidout_wayland_display(vid_out_env_t *vc, AVFrame *src_frame)
 {
-    AVFrame *frame = NULL;
+    return vidout_wayland_display_tag(vc, src_frame, 0);
+}
 
-#if TRACE_ALL
-    LOG("<<< %s\n", __func__);
-#endif
+static int
+display_frame(vid_out_env_t *vc, AVFrame *src_frame, const uint64_t tag)
+{
+    AVFrame *frame = NULL;
 
     if (src_frame->format == AV_PIX_FMT_DRM_PRIME) {
         frame = av_frame_alloc();
@@ -916,28 +1989,64 @@ vidout_wayland_display(vid_out_env_t *vc, AVFrame *src_frame)
         if (av_hwframe_map(frame, src_frame, 0) != 0) {
             LOG("Failed to map frame (format=%d) to DRM_PRiME\n", src_frame->format);
             av_frame_free(&frame);
+            bench_drop(vc->bench, tag);
             return AVERROR(EINVAL);
         }
     }
-    else if (src_frame->opaque == vc) {
+    else if (frame_is_pooled(vc, src_frame)) {
         frame = av_frame_alloc();
         av_frame_ref(frame, src_frame);
     }
+    else if (fmt_to_drm(src_frame->format, NULL) != 0) {
+        // System memory in a format we can show - copy into a buffer of ours
+        frame = av_frame_alloc();
+        av_frame_ref(frame, src_frame);
+        if (vidout_wayland_frame_to_pool(vc, frame) != 0) {
+            LOG("Failed to upload frame (format=%d)\n", src_frame->format);
+            av_frame_free(&frame);
+            bench_drop(vc->bench, tag);
+            return AVERROR(ENOMEM);
+        }
+    }
     else {
         LOG("Frame (format=%d) not DRM_PRiME\n", src_frame->format);
+        bench_drop(vc->bench, tag);
         return AVERROR(EINVAL);
     }
 
     set_vid_par(vc, frame);
-    if (vc->is_egl)
-        do_display_egl(vc, frame);
+    if (vc->null_out != NULL)
+        do_display_null(vc, frame, tag);
+    else if (vc->is_egl) {
+        egl_mailbox_put(vc, frame);
+        frame = NULL;
+    }
     else
-        do_display_dmabuf(vc, frame);
+        do_display_dmabuf(vc, frame, tag);
     av_frame_free(&frame);
 
     return 0;
 }
 
+int
+vidout_wayland_display_tag(vid_out_env_t *vc, AVFrame *src_frame, const uint64_t tag)
+{
+    int rv;
+
+#if TRACE_ALL
+    LOG("<<< %s\n", __func__);
+#endif
+
+    // EGL doesn't hold buffers after display so has no in_flight limit
+    if (!vc->is_egl && (rv = in_flight_ready(vc)) != 0)
+        return rv;
+
+    rv = display_frame(vc, src_frame, tag);
+    // Anything that failed before w_buf_alloc leaves its reservation
+    in_flight_unreserve(vc);
+    return rv;
+}
+
 
 void
 vidout_wayland_delete(vid_out_env_t *vc)
@@ -954,21 +2063,61 @@ vidout_wayland_delete(vid_out_env_t *vc)
     runticker_stop(&vc->rte);
 #endif
 
-    // **** EGL teardown
+    // Render thread releases its GL objects & context. Must be before the
+    // pollqueue goes as that runs the fence waits.
+    // **** EGL context & surface not destroyed
+    egl_thread_stop(vc);
 
-    pollqueue_finish(&vc->vid_pq);
+    if (vc->null_out != NULL) {
+        const unsigned int presented = vc->null_out->presented;
+        null_out_delete(&vc->null_out);
+        LOG("Video: null presented %u, discarded 0; dropped in_flight %u\n",
+            presented, vc->in_flight_drops);
+    }
+
+    // Tiles only hold refs on the shared parts - root tears them down
+    if (vc->root == NULL)
+        pollqueue_finish(&vc->vid_pq);
 
     wo_surface_detach_fb(vc->vid);
-    {
+    if (vc->vid != NULL)
+        wo_surface_on_presented_set(vc->vid, NULL, NULL);
+    if (vc->vid != NULL) {
         const wo_surface_stats_t * const stats = wo_surface_stats_get(vc->vid);
-        LOG("Video: wayland presented %u, discarded %u\n", stats->presented_count, stats->discarded_count);
+        char tile_name[24] = "";
+        if (vc->root != NULL)
+            snprintf(tile_name, sizeof(tile_name), "Tile %u: ", vc->tile_n);
+        LOG("%sVideo: wayland presented %u, discarded %u; dropped in_flight %u\n",
+            tile_name, stats->presented_count, stats->discarded_count, vc->in_flight_drops);
     }
-
+    if (vc->icache.hits + vc->icache.misses != 0)
+        LOG("Video: import cache %u hits, %u misses\n", vc->icache.hits, vc->icache.misses);
+    if (vc->wc.egl_hits + vc->wc.egl_misses != 0)
+        LOG("Video: EGL image cache %u hits, %u misses\n", vc->wc.egl_hits, vc->wc.egl_misses);
+    if (vc->in_flight_waits != 0)
+        LOG("Video: %u frames waited for a buffer release\n", vc->in_flight_waits);
+    if (vc->upload_count != 0)
+        LOG("Video: uploaded %u frames, mean %.3fms, max %.3fms\n", vc->upload_count,
+            (double)vc->upload_ns_total / (double)vc->upload_count / 1000000.0,
+            (double)vc->upload_ns_max / 1000000.0);
+
+    // Cached wo_fbs need the wayland env
+    import_cache_flush(&vc->icache);
     wo_surface_unref(&vc->vid);
     wo_window_unref(&vc->win);
-    wo_env_finish(&vc->woe);
+    if (vc->root == NULL) {
+        wo_env_finish(&vc->woe);
+    }
+    else {
+        pollqueue_unref(&vc->vid_pq);
+        wo_env_unref(&vc->woe);
+    }
     dmabuf_pool_kill(&vc->dpool);
     dmabufs_ctl_unref(&vc->dbsc);
+    vsync_clock_delete(&vc->vsync);
+    upload_pool_delete(&vc->upload);
+    pthread_mutex_destroy(&vc->upload_lock);
+    flight_uninit(vc);
     free(vc);
     LOG(">>> %s\n", __func__);
 }
@@ -982,6 +2131,41 @@ vid_resize_dmabuf_cb(void * v, wo_surface_t * wos, const wo_rect_t win_pos)
     wo_surface_dst_pos_set(wos, box_rect(ve->vid_par_num, ve->vid_par_den, ve->win_rect));
 }
 
+static wo_rect_t
+tile_rect(const vid_out_env_t * const ve, const wo_rect_t win_pos)
+{
+    return wo_rect_rescale((wo_rect_t){ve->tile_n % ve->tile_cols, ve->tile_n / ve->tile_cols, 1, 1},
+                           win_pos,
+                           (wo_rect_t){0, 0, ve->tile_cols, ve->tile_rows});
+}
+
+static void
+vid_resize_tile_cb(void * v, wo_surface_t * wos, const wo_rect_t win_pos)
+{
+    vid_out_env_t *const ve = v;
+
+    ve->win_rect = tile_rect(ve, win_pos);
+    wo_surface_dst_pos_set(wos, box_rect(ve->vid_par_num, ve->vid_par_den, ve->win_rect));
+}
+
+static void
+vid_presented_cb(void * v, wo_surface_t * wos, const wo_presented_t * pres)
+{
+    vid_out_env_t *const ve = v;
+    (void)wos;
+
+    bench_stamp(ve->bench, pres->tag, BENCH_STAGE_COMMIT, pres->commit_ns);
+    if (pres->discarded) {
+        bench_discard(ve->bench, pres->tag);
+        return;
+    }
+    bench_stamp(ve->bench, pres->tag, BENCH_STAGE_PRESENTED, pres->time_ns);
+
+    // Only vblank aligned timestamps are any use for clock recovery
+    if ((pres->flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC) != 0)
+        vsync_clock_update(ve->vsync, pres->time_ns, pres->refresh_ns, pres->seq);
+}
+
 static vid_out_env_t*
 wayland_out_new(const bool is_egl, const unsigned int flags)
 {
@@ -990,17 +2174,29 @@ wayland_out_new(const bool is_egl, const unsigned int flags)
     LOG("<<< %s\n", __func__);
 
     ve->is_egl = is_egl;
+    pthread_mutex_init(&ve->upload_lock, NULL);
+    flight_init(ve);
+
+    if ((ve->upload = upload_pool_new(0)) == NULL) {
+        LOG("%s: Failed to create upload pool\n", __func__);
+        goto fail;
+    }
 
     if ((ve->dbsc = dmabufs_ctl_new()) == NULL) {
         LOG("%s: Failed to create dmbauf control\n", __func__);
         goto fail;
     }
 
-    if ((ve->dpool = dmabuf_pool_new_dmabufs(ve->dbsc, 32)) == NULL) {
+    if ((ve->dpool = dmabuf_pool_new_dmabufs(ve->dbsc, DMABUF_POOL_SIZE)) == NULL) {
         LOG("%s: Failed to create dmbauf pool\n", __func__);
         goto fail;
     }
 
+    if ((ve->vsync = vsync_clock_new()) == NULL) {
+        LOG("%s: Failed to create vsync clock\n", __func__);
+        goto fail;
+    }
+
     if ((ve->vid_pq = pollqueue_new()) == NULL) {
         LOG("%s: Failed to create pollq\n", __func__);
         goto fail;
@@ -1025,13 +2221,15 @@ wayland_out_new(const bool is_egl, const unsigned int flags)
     ve->win_rect = wo_window_size(ve->win);
     wo_surface_dst_pos_set(ve->vid, ve->win_rect);
     wo_surface_stats_enable(ve->vid);
+    wo_surface_on_presented_set(ve->vid, vid_presented_cb, ve);
 
     if (!ve->is_egl)
         wo_surface_on_win_resize_set(ve->vid, vid_resize_dmabuf_cb, ve);
 
-    // Some egl setup must be done on display thread
+    // EGL setup is done on the render thread as that is where the
+    // context must be current
     if (ve->is_egl) {
-        if (do_egl_setup(ve) != 0) {
+        if (egl_thread_start(ve) != 0) {
             LOG("EGL init failed\n");
             goto fail;
         }
@@ -1046,6 +2244,64 @@ fail:
     return NULL;
 }
 
+vid_out_env_t *
+vidout_wayland_tile_new(vid_out_env_t * const root, const unsigned int n, const unsigned int count)
+{
+    vid_out_env_t * ve;
+    unsigned int cols = 1;
+
+    if (root->is_egl || root->null_out != NULL || root->root != NULL || n >= count) {
+        LOG("%s: Tiles need a dmabuf root output\n", __func__);
+        return NULL;
+    }
+    if ((ve = calloc(1, sizeof(*ve))) == NULL)
+        return NULL;
+    pthread_mutex_init(&ve->upload_lock, NULL);
+    flight_init(ve);
+    ve->backpressure = root->backpressure;
+    ve->in_flight_adapt = root->in_flight_adapt;
+
+    // Square-ish grid, filled row by row
+    while (cols * cols < count)
+        ++cols;
+    ve->root = root;
+    ve->tile_n = n;
+    ve->tile_cols = cols;
+    ve->tile_rows = (count + cols - 1) / cols;
+    root->tiles_in_flight_max = count * TILE_IN_FLIGHT;
+
+    ve->dbsc = dmabufs_ctl_ref(root->dbsc);
+    ve->vid_pq = pollqueue_ref(root->vid_pq);
+    ve->woe = wo_env_ref(root->woe);
+    ve->win = wo_window_ref(root->win);
+
+    if ((ve->dpool = dmabuf_pool_new_dmabufs(ve->dbsc, DMABUF_POOL_SIZE)) == NULL) {
+        LOG("%s: Failed to create dmbauf pool\n", __func__);
+        goto fail;
+    }
+
+    if ((ve->vsync = vsync_clock_new()) == NULL) {
+        LOG("%s: Failed to create vsync clock\n", __func__);
+        goto fail;
+    }
+
+    if ((ve->vid = wo_make_surface_z(ve->win, NULL, 10)) == NULL) {
+        LOG("%s: Failed to create tile surface\n", __func__);
+        goto fail;
+    }
+    ve->win_rect = tile_rect(ve, wo_window_size(ve->win));
+    wo_surface_dst_pos_set(ve->vid, ve->win_rect);
+    wo_surface_stats_enable(ve->vid);
+    wo_surface_on_presented_set(ve->vid, vid_presented_cb, ve);
+    wo_surface_on_win_resize_set(ve->vid, vid_resize_tile_cb, ve);
+
+    return ve;
+
+fail:
+    vidout_wayland_delete(ve);
+    return NULL;
+}
+
 vid_out_env_t*
 vidout_wayland_new(unsigned int flags)
 {
@@ -1058,6 +2314,56 @@ dmabuf_wayland_out_new(unsigned int flags)
     return wayland_out_new(false, flags);
 }
 
+vid_out_env_t *
+dmabuf_null_out_new(unsigned int flags, const unsigned int hold_ms, const unsigned int hold_frames)
+{
+    vid_out_env_t *const ve = calloc(1, sizeof(*ve));
+    (void)flags;
+
+    LOG("<<< %s\n", __func__);
+
+    if (ve == NULL)
+        return NULL;
+    pthread_mutex_init(&ve->upload_lock, NULL);
+    flight_init(ve);
+
+    if ((ve->upload = upload_pool_new(0)) == NULL) {
+        LOG("%s: Failed to create upload pool\n", __func__);
+        goto fail;
+    }
+
+    // Build servers may well have no dma-heap - shm is fine as nothing
+    // will actually scan out of it
+    if ((ve->dbsc = dmabufs_ctl_new()) == NULL &&
+        (ve->dbsc = dmabufs_shm_new()) == NULL) {
+        LOG("%s: Failed to create dmbauf control\n", __func__);
+        goto fail;
+    }
+
+    if ((ve->dpool = dmabuf_pool_new_dmabufs(ve->dbsc, DMABUF_POOL_SIZE)) == NULL) {
+        LOG("%s: Failed to create dmbauf pool\n", __func__);
+        goto fail;
+    }
+
+    // Never fed so never has an estimate
+    if ((ve->vsync = vsync_clock_new()) == NULL) {
+        LOG("%s: Failed to create vsync clock\n", __func__);
+        goto fail;
+    }
+
+    if ((ve->null_out = null_out_new((int64_t)hold_ms * 1000000, hold_frames)) == NULL) {
+        LOG("%s: Failed to create null output\n", __func__);
+        goto fail;
+    }
+
+    LOG(">>> %s\n", __func__);
+    return ve;
+
+fail:
+    vidout_wayland_delete(ve);
+    return NULL;
+}
+
 #if HAS_RUNTICKER
 void vidout_wayland_runticker(vid_out_env_t * ve, const char * text)
 {
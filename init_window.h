@@ -8,18 +8,88 @@ typedef struct vid_out_env_s vid_out_env_t;
 #define WOUT_FLAG_FULLSCREEN 1
 #define WOUT_FLAG_NO_WAIT    2
 
+// What _display does if the compositor already holds as many buffers as
+// the in-flight limit allows
+typedef enum vidout_backpressure_e {
+    VIDOUT_BACKPRESSURE_DROP = 0,   // Drop the frame & return 0 (default)
+    VIDOUT_BACKPRESSURE_BLOCK,      // Wait for a buffer to be released
+    VIDOUT_BACKPRESSURE_EAGAIN,     // Return AVERROR(EAGAIN) without taking the frame
+} vidout_backpressure_t;
+
 struct AVFrame;
 struct AVCodecContext;
+struct bench_s;
+struct dmabuf_h;
 
 int vidout_wayland_get_buffer2(struct AVCodecContext *s, struct AVFrame *frame, int flags);
+// Allocate a s/w frame (format is an AVPixelFormat) in a dmabuf from dpo's
+// pool, the same as a s/w decoder would get from _get_buffer2. Contents
+// are undefined. Returns NULL if the format can't be displayed.
+struct AVFrame * vidout_wayland_frame_alloc(struct vid_out_env_s * dpo, const int format, const int width, const int height);
+// The dmabuf behind a s/w frame from _get_buffer2 or _frame_alloc (of any
+// output), NULL if it isn't one. CPU access should be bracketed by
+// dmabuf_read_start/end. The frame holds the ref.
+struct dmabuf_h * vidout_wayland_frame_dmabuf(const struct AVFrame * const frame);
+// If frame is a s/w frame that isn't already in one of dpo's buffers (e.g.
+// the output of a s/w filter) replace its data with a copy that is. The
+// copy is split across an upload thread pool & timed for the stats.
+// DRM_PRIME & already pooled frames are left alone. Returns 0 or AVERROR.
+// _display does this itself for any s/w frame in a displayable format.
+int vidout_wayland_frame_to_pool(struct vid_out_env_s * dpo, struct AVFrame * frame);
 void vidout_wayland_modeset(struct vid_out_env_s * dpo, int w, int h, AVRational frame_rate);
 int vidout_wayland_display(struct vid_out_env_s * dpo, struct AVFrame * frame);
+// As _display but tag identifies the frame to the bench timer (0 = none)
+// Both return AVERROR(EAGAIN) if the in-flight limit has been reached &
+// the backpressure mode is VIDOUT_BACKPRESSURE_EAGAIN
+// EGL output hands the frame to its render thread & never waits; if the
+// previous frame hasn't been rendered yet it is dropped
+int vidout_wayland_display_tag(struct vid_out_env_s * dpo, struct AVFrame * frame, const uint64_t tag);
+// Set bench timer to stamp attach/commit/present/release on. Not owned.
+void vidout_wayland_bench_set(vid_out_env_t * dpo, struct bench_s * const bench);
 // Returns the number of frames that have been queued by _display but
 // not yet released
 int vidout_wayland_in_flight(const vid_out_env_t * dpo);
+// Set the backpressure mode & in-flight limit (2-8). depth 0 adapts the
+// limit to cover the compositor's observed release latency. Tiles start
+// with their root's settings. Ignored by EGL output.
+void vidout_wayland_backpressure_set(vid_out_env_t * dpo, const vidout_backpressure_t mode, const unsigned int depth);
+// dmabuf output keeps the wl_buffer (EGL output the EGLImage & texture)
+// for each dmabuf it has seen so a decoder's buffers are only imported
+// once. Call when a decoder (or anything else that allocates frames) is
+// closed so its buffers aren't kept alive. Unused entries are dropped
+// after a while anyway.
+void vidout_wayland_import_cache_flush(vid_out_env_t * dpo);
+// Current in-flight limit
+int vidout_wayland_in_flight_max(const vid_out_env_t * dpo);
+// eventfd that becomes readable whenever a buffer is released - for use
+// with VIDOUT_BACKPRESSURE_EAGAIN. Read it to clear. Tiles share one with
+// their root so wakeups may be for another tile. -1 if none.
+int vidout_wayland_release_fd(const vid_out_env_t * dpo);
+// Number of frames the compositor has discarded without showing
+unsigned int vidout_wayland_discarded(const vid_out_env_t * dpo);
+// Clock (CLOCK_xxx) that presentation & vsync times are in
+int vidout_wayland_clock_id(const vid_out_env_t * dpo);
+// Cumulative busy & idle time of the wayland display thread (both 0 if
+// there isn't one)
+void vidout_wayland_pollqueue_load(const vid_out_env_t * dpo, uint64_t * const busy_ns, uint64_t * const idle_ns);
+// Time (ns) of the first vblank at or after t_ns as estimated from
+// presentation feedback. period_ns may be NULL.
+// Returns -EAGAIN if no estimate is available yet (or ever e.g. EGL output)
+int vidout_wayland_vsync_next(const vid_out_env_t * dpo, const int64_t t_ns, int64_t * const vblank_ns, int64_t * const period_ns);
 struct vid_out_env_s * vidout_wayland_new(unsigned int flags);
 
 struct vid_out_env_s * dmabuf_wayland_out_new(unsigned int flags);
+// Headless output with no wayland dependency. Frames are counted as
+// presented on arrival & released once hold_frames newer frames have
+// arrived or after hold_ms (0 = count only). Buffer allocation &
+// in_flight limits are as dmabuf output. Not usable with tiles, cube or
+// ticker.
+struct vid_out_env_s * dmabuf_null_out_new(unsigned int flags, const unsigned int hold_ms, const unsigned int hold_frames);
+// Mosaic: create tile n of count in a grid filling dpo's window. Each tile
+// is a full output with its own surface, buffer pool, stats & vsync
+// estimate but shares the window, wayland env, pollqueue & in-flight budget
+// with dpo. dmabuf output only. All tiles must be deleted before dpo.
+struct vid_out_env_s * vidout_wayland_tile_new(struct vid_out_env_s * dpo, const unsigned int n, const unsigned int count);
 void vidout_wayland_delete(struct vid_out_env_s * dpo);
 
 void vidout_wayland_runticker(struct vid_out_env_s * dpo, const char * text);
@@ -0,0 +1,348 @@
+#include "kf_index.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+
+#define KF_SIDECAR_SUFFIX   ".kfidx"
+#define KF_SIDECAR_VERSION  1
+
+struct kf_index_s {
+    pthread_mutex_t lock;
+    char * filename;
+    char * sidecar;
+    struct stat st;         // Of filename when opened
+
+    int stream_index;       // -1 until known
+    AVRational time_base;
+    kf_index_entry_t * ents;
+    unsigned int n;
+    unsigned int size;
+    bool complete;
+
+    atomic_bool abort;
+    bool thread_ok;
+    pthread_t thread;
+};
+
+// Call with lock held
+static int
+ent_add(kf_index_t * const kfi, const int64_t pts, const int64_t pos)
+{
+    unsigned int i;
+
+    if (kfi->n >= kfi->size) {
+        const unsigned int size = kfi->size == 0 ? 256 : kfi->size * 2;
+        kf_index_entry_t * const ents = realloc(kfi->ents, size * sizeof(*ents));
+        if (ents == NULL)
+            return -ENOMEM;
+        kfi->ents = ents;
+        kfi->size = size;
+    }
+
+    // Almost always an append but keep sorted if pts goes backwards
+    for (i = kfi->n; i != 0 && kfi->ents[i - 1].pts > pts; --i)
+        /* Loop */;
+    if (i != 0 && kfi->ents[i - 1].pts == pts)
+        return 0;
+    memmove(kfi->ents + i + 1, kfi->ents + i, (kfi->n - i) * sizeof(*kfi->ents));
+    kfi->ents[i] = (kf_index_entry_t){.pts = pts, .pos = pos};
+    ++kfi->n;
+    return 0;
+}
+
+static int
+sidecar_load(kf_index_t * const kfi)
+{
+    FILE * const f = fopen(kfi->sidecar, "r");
+    unsigned int version, count, i;
+    long long size, mtime_s, mtime_ns;
+    int stream_index, tb_num, tb_den;
+    int rv = -EINVAL;
+
+    if (f == NULL)
+        return -errno;
+
+    if (fscanf(f, "kfidx %u %lld %lld %lld %d %d %d %u\n", &version, &size, &mtime_s, &mtime_ns,
+               &stream_index, &tb_num, &tb_den, &count) != 8 ||
+        version != KF_SIDECAR_VERSION ||
+        size != (long long)kfi->st.st_size ||
+        mtime_s != (long long)kfi->st.st_mtim.tv_sec ||
+        mtime_ns != (long long)kfi->st.st_mtim.tv_nsec ||
+        stream_index < 0 || tb_num <= 0 || tb_den <= 0)
+        goto fail;
+
+    pthread_mutex_lock(&kfi->lock);
+    for (i = 0; i != count; ++i) {
+        int64_t pts, pos;
+        if (fscanf(f, "%"SCNd64" %"SCNd64"\n", &pts, &pos) != 2 ||
+            ent_add(kfi, pts, pos) != 0)
+            break;
+    }
+    if (i == count) {
+        kfi->stream_index = stream_index;
+        kfi->time_base = (AVRational){tb_num, tb_den};
+        kfi->complete = true;
+        rv = 0;
+    }
+    else {
+        kfi->n = 0;
+    }
+    pthread_mutex_unlock(&kfi->lock);
+
+fail:
+    fclose(f);
+    return rv;
+}
+
+// Write to a temp file & rename so a reader never sees half an index
+static int
+sidecar_save(kf_index_t * const kfi)
+{
+    const size_t len = strlen(kfi->sidecar) + 8;
+    char * const tmp = malloc(len);
+    FILE * f = NULL;
+    unsigned int i;
+    int rv = -ENOMEM;
+
+    if (tmp == NULL)
+        return rv;
+    snprintf(tmp, len, "%s.tmp", kfi->sidecar);
+
+    if ((f = fopen(tmp, "w")) == NULL) {
+        rv = -errno;
+        goto fail;
+    }
+
+    pthread_mutex_lock(&kfi->lock);
+    fprintf(f, "kfidx %u %lld %lld %lld %d %d %d %u\n", KF_SIDECAR_VERSION,
+            (long long)kfi->st.st_size,
+            (long long)kfi->st.st_mtim.tv_sec, (long long)kfi->st.st_mtim.tv_nsec,
+            kfi->stream_index, kfi->time_base.num, kfi->time_base.den, kfi->n);
+    for (i = 0; i != kfi->n; ++i)
+        fprintf(f, "%"PRId64" %"PRId64"\n", kfi->ents[i].pts, kfi->ents[i].pos);
+    pthread_mutex_unlock(&kfi->lock);
+
+    if (fclose(f) != 0 || rename(tmp, kfi->sidecar) != 0) {
+        rv = -errno;
+        unlink(tmp);
+        goto fail;
+    }
+    rv = 0;
+
+fail:
+    free(tmp);
+    return rv;
+}
+
+static void *
+build_thread(void * v)
+{
+    kf_index_t * const kfi = v;
+    AVFormatContext * ctx = NULL;
+    AVPacket * pkt = NULL;
+    unsigned int i;
+    int vs;
+
+    if (avformat_open_input(&ctx, kfi->filename, NULL, NULL) != 0 ||
+        avformat_find_stream_info(ctx, NULL) < 0 ||
+        (vs = av_find_best_stream(ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0 ||
+        (pkt = av_packet_alloc()) == NULL)
+        goto fail;
+
+    // Only the video packets are wanted
+    for (i = 0; i != ctx->nb_streams; ++i)
+        ctx->streams[i]->discard = (int)i == vs ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    pthread_mutex_lock(&kfi->lock);
+    kfi->stream_index = vs;
+    kfi->time_base = ctx->streams[vs]->time_base;
+    pthread_mutex_unlock(&kfi->lock);
+
+    while (!atomic_load(&kfi->abort)) {
+        if (av_read_frame(ctx, pkt) < 0) {
+            pthread_mutex_lock(&kfi->lock);
+            kfi->complete = true;
+            pthread_mutex_unlock(&kfi->lock);
+            break;
+        }
+        if (pkt->stream_index == vs && (pkt->flags & AV_PKT_FLAG_KEY) != 0) {
+            const int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+            if (pts != AV_NOPTS_VALUE) {
+                pthread_mutex_lock(&kfi->lock);
+                ent_add(kfi, pts, pkt->pos);
+                pthread_mutex_unlock(&kfi->lock);
+            }
+        }
+        av_packet_unref(pkt);
+    }
+
+    if (kfi->complete) {
+        // Not being able to write the sidecar isn't an error - we just
+        // rebuild next time
+        if (sidecar_save(kfi) == 0)
+            printf("Keyframe index: %u keyframes saved to %s\n", kfi->n, kfi->sidecar);
+    }
+
+fail:
+    av_packet_free(&pkt);
+    avformat_close_input(&ctx);
+    return NULL;
+}
+
+bool
+kf_index_complete(kf_index_t * const kfi)
+{
+    bool rv;
+    pthread_mutex_lock(&kfi->lock);
+    rv = kfi->complete;
+    pthread_mutex_unlock(&kfi->lock);
+    return rv;
+}
+
+unsigned int
+kf_index_count(kf_index_t * const kfi)
+{
+    unsigned int rv;
+    pthread_mutex_lock(&kfi->lock);
+    rv = kfi->n;
+    pthread_mutex_unlock(&kfi->lock);
+    return rv;
+}
+
+// Index of the first entry with pts > pts. Call with lock held
+static unsigned int
+ent_upper(const kf_index_t * const kfi, const int64_t pts)
+{
+    unsigned int lo = 0;
+    unsigned int hi = kfi->n;
+
+    while (lo < hi) {
+        const unsigned int mid = lo + (hi - lo) / 2;
+        if (kfi->ents[mid].pts <= pts)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int
+kf_index_find(kf_index_t * const kfi, const int64_t pts, kf_index_entry_t * const ent)
+{
+    unsigned int i;
+    int rv = -ENOENT;
+
+    pthread_mutex_lock(&kfi->lock);
+    i = ent_upper(kfi, pts);
+    // Beyond the last keyframe is only a hit once we know there are no more
+    if (i != 0 && (i != kfi->n || kfi->complete)) {
+        *ent = kfi->ents[i - 1];
+        rv = 0;
+    }
+    pthread_mutex_unlock(&kfi->lock);
+    return rv;
+}
+
+int
+kf_index_next(kf_index_t * const kfi, const int64_t pts, kf_index_entry_t * const ent)
+{
+    unsigned int i;
+    int rv = -ENOENT;
+
+    pthread_mutex_lock(&kfi->lock);
+    i = ent_upper(kfi, pts);
+    if (i != kfi->n) {
+        *ent = kfi->ents[i];
+        rv = 0;
+    }
+    pthread_mutex_unlock(&kfi->lock);
+    return rv;
+}
+
+int
+kf_index_seek(kf_index_t * const kfi, AVFormatContext * const ctx, const int stream_index, const int64_t pts)
+{
+    kf_index_entry_t ent;
+    int kf_stream = -1;
+
+    if (kfi != NULL) {
+        pthread_mutex_lock(&kfi->lock);
+        kf_stream = kfi->stream_index;
+        pthread_mutex_unlock(&kfi->lock);
+    }
+    if (kf_stream != stream_index || kf_index_find(kfi, pts, &ent) != 0)
+        return av_seek_frame(ctx, stream_index, pts, AVSEEK_FLAG_BACKWARD);
+
+    if (ent.pos >= 0 && (ctx->iformat->flags & AVFMT_NO_BYTE_SEEK) == 0 &&
+        av_seek_frame(ctx, stream_index, ent.pos, AVSEEK_FLAG_BYTE) >= 0)
+        return 0;
+
+    // We know exactly where the keyframe is so no searching needed
+    return avformat_seek_file(ctx, stream_index, ent.pts, ent.pts, ent.pts, 0);
+}
+
+void
+kf_index_close(kf_index_t ** const ppkfi)
+{
+    kf_index_t * const kfi = *ppkfi;
+
+    if (kfi == NULL)
+        return;
+    *ppkfi = NULL;
+
+    if (kfi->thread_ok) {
+        atomic_store(&kfi->abort, true);
+        pthread_join(kfi->thread, NULL);
+    }
+    pthread_mutex_destroy(&kfi->lock);
+    free(kfi->ents);
+    free(kfi->sidecar);
+    free(kfi->filename);
+    free(kfi);
+}
+
+kf_index_t *
+kf_index_open(const char * const filename)
+{
+    kf_index_t * kfi = calloc(1, sizeof(*kfi));
+    size_t len;
+
+    if (kfi == NULL)
+        return NULL;
+
+    pthread_mutex_init(&kfi->lock, NULL);
+    kfi->stream_index = -1;
+
+    if (stat(filename, &kfi->st) != 0 || !S_ISREG(kfi->st.st_mode))
+        goto fail;
+
+    len = strlen(filename) + sizeof(KF_SIDECAR_SUFFIX);
+    if ((kfi->filename = strdup(filename)) == NULL ||
+        (kfi->sidecar = malloc(len)) == NULL)
+        goto fail;
+    snprintf(kfi->sidecar, len, "%s"KF_SIDECAR_SUFFIX, filename);
+
+    if (sidecar_load(kfi) == 0) {
+        printf("Keyframe index: %u keyframes loaded from %s\n", kfi->n, kfi->sidecar);
+        return kfi;
+    }
+
+    if (pthread_create(&kfi->thread, NULL, build_thread, kfi) != 0)
+        goto fail;
+    kfi->thread_ok = true;
+    return kfi;
+
+fail:
+    kf_index_close(&kfi);
+    return NULL;
+}
+
@@ -0,0 +1,58 @@
+#ifndef _KF_INDEX_H
+#define _KF_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libavutil/rational.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Keyframe index
+// Maps keyframe pts -> byte offset for the best video stream of a file.
+// The index is built on a background thread with its own demuxer (packets
+// are read but not decoded) whilst playback runs, and is saved to a
+// <file>.kfidx sidecar once complete so the next open is instant. The
+// sidecar is ignored if the file size or mtime have changed.
+// Lookups can be made whilst the build is still running - they only see
+// what has been indexed so far.
+
+struct AVFormatContext;
+struct kf_index_s;
+typedef struct kf_index_s kf_index_t;
+
+typedef struct kf_index_entry_s {
+    int64_t pts;        // In the stream time base
+    int64_t pos;        // Byte offset of the packet, -1 if unknown
+} kf_index_entry_t;
+
+// Returns NULL if the file isn't a regular file or on error
+kf_index_t * kf_index_open(const char * const filename);
+// Stops the build if it is still running
+void kf_index_close(kf_index_t ** const ppkfi);
+
+bool kf_index_complete(kf_index_t * const kfi);
+unsigned int kf_index_count(kf_index_t * const kfi);
+
+// Last keyframe with pts <= pts
+// Returns 0 OK, -ENOENT if none (yet)
+int kf_index_find(kf_index_t * const kfi, const int64_t pts, kf_index_entry_t * const ent);
+// First keyframe with pts > pts
+// Returns 0 OK, -ENOENT if none (yet)
+int kf_index_next(kf_index_t * const kfi, const int64_t pts, kf_index_entry_t * const ent);
+
+// Seek ctx so the next packet read from stream_index is the keyframe at or
+// before pts (stream time base). Uses a byte seek if the format allows it,
+// otherwise an exact timestamp seek. If the index doesn't cover pts (or kfi
+// is NULL) falls back to a plain backward av_seek_frame.
+// Returns 0 or -ve AVERROR
+int kf_index_seek(kf_index_t * const kfi, struct AVFormatContext * const ctx, const int stream_index, const int64_t pts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,173 @@
+#include "mmap_avio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+// Size of the buffer handed to avio. The context is direct so packet reads
+// bypass it & it only holds the small reads demuxers do for headers
+#define AVIO_BUF_SIZE   (4 * 1024)
+// Read-ahead window - re-advised once the read position is half way through
+#define WILLNEED_WINDOW (4 * 1024 * 1024)
+
+typedef struct mmap_avio_s {
+    int fd;
+    uint8_t * map;
+    size_t size;
+    size_t pos;
+    size_t page_size;
+    size_t advised_end;     // End of the last WILLNEED window
+} mmap_avio_t;
+
+static void
+window_update(mmap_avio_t * const ma)
+{
+    size_t start;
+    size_t end;
+
+    if (ma->pos + WILLNEED_WINDOW / 2 < ma->advised_end && ma->pos < ma->advised_end)
+        return;
+
+    start = ma->pos & ~(ma->page_size - 1);
+    end = ma->pos + WILLNEED_WINDOW;
+    if (end > ma->size)
+        end = ma->size;
+    if (end > start)
+        madvise(ma->map + start, end - start, MADV_WILLNEED);
+    ma->advised_end = end;
+}
+
+static int
+mmap_read_packet(void * opaque, uint8_t * buf, int buf_size)
+{
+    mmap_avio_t * const ma = opaque;
+    size_t n = ma->size - ma->pos;
+
+    if (n == 0)
+        return AVERROR_EOF;
+    if (n > (size_t)buf_size)
+        n = buf_size;
+
+    window_update(ma);
+    // The one copy left - see mmap_avio.h
+    memcpy(buf, ma->map + ma->pos, n);
+    ma->pos += n;
+    return (int)n;
+}
+
+static int64_t
+mmap_seek(void * opaque, int64_t offset, int whence)
+{
+    mmap_avio_t * const ma = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return ma->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = ma->pos + offset;
+            break;
+        case SEEK_END:
+            pos = ma->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > (int64_t)ma->size)
+        return AVERROR(EINVAL);
+
+    // Non-sequential access - start a new window from here
+    if ((size_t)pos < ma->pos || (size_t)pos > ma->advised_end)
+        ma->advised_end = 0;
+    ma->pos = pos;
+    return pos;
+}
+
+static void
+mmap_avio_free(mmap_avio_t * const ma)
+{
+    if (ma == NULL)
+        return;
+    if (ma->map != NULL)
+        munmap(ma->map, ma->size);
+    if (ma->fd != -1)
+        close(ma->fd);
+    free(ma);
+}
+
+void
+mmap_avio_close(AVIOContext ** const ppavio)
+{
+    AVIOContext * avio = *ppavio;
+
+    if (avio == NULL)
+        return;
+    *ppavio = NULL;
+
+    mmap_avio_free(avio->opaque);
+    av_freep(&avio->buffer);
+    avio_context_free(&avio);
+}
+
+AVIOContext *
+mmap_avio_open(const char * const filename)
+{
+    const char * name = filename;
+    mmap_avio_t * ma = NULL;
+    uint8_t * buf = NULL;
+    AVIOContext * avio;
+    struct stat st;
+
+    // Plain paths & file: URLs only
+    if (strncmp(name, "file:", 5) == 0)
+        name += 5;
+    else if (strstr(name, "://") != NULL)
+        return NULL;
+
+    if ((ma = calloc(1, sizeof(*ma))) == NULL)
+        return NULL;
+    ma->fd = -1;
+    ma->page_size = sysconf(_SC_PAGESIZE);
+
+    if ((ma->fd = open(name, O_RDONLY | O_CLOEXEC)) == -1)
+        goto fail;
+    // Pipes, devices & empty files can't usefully be mapped
+    if (fstat(ma->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        goto fail;
+
+    ma->size = st.st_size;
+    if ((ma->map = mmap(NULL, ma->size, PROT_READ, MAP_SHARED, ma->fd, 0)) == MAP_FAILED) {
+        ma->map = NULL;
+        goto fail;
+    }
+    madvise(ma->map, ma->size, MADV_SEQUENTIAL);
+
+    if ((buf = av_malloc(AVIO_BUF_SIZE)) == NULL)
+        goto fail;
+    if ((avio = avio_alloc_context(buf, AVIO_BUF_SIZE, 0, ma, mmap_read_packet, NULL, mmap_seek)) == NULL)
+        goto fail;
+    // Read straight into the caller's buffer (usually packet data) rather
+    // than via avio's buffer
+    avio->direct = 1;
+
+    return avio;
+
+fail:
+    av_free(buf);
+    mmap_avio_free(ma);
+    return NULL;
+}
+
@@ -0,0 +1,31 @@
+#ifndef _MMAP_AVIO_H
+#define _MMAP_AVIO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// AVIOContext that reads a local file through an mmap of the whole file
+// rather than read() syscalls. The kernel is asked to read ahead in a
+// window that follows the read position.
+// Reads are direct so packet data is copied once, from the mapping into the
+// packet, rather than via avio's buffer. That isn't zero copy; handing out
+// the mapping itself would need the demuxer to reference it in
+// AVPacket.buf, and avio frees & reallocs its own buffer when probing so
+// can't be given the mapping as that.
+
+struct AVIOContext;
+
+// Returns NULL if the name isn't a regular local file (pipes, devices,
+// network URLs etc.) or the map fails - use ordinary I/O in that case
+struct AVIOContext * mmap_avio_open(const char * const filename);
+// Frees the context, its buffer & the mapping
+// Call after avformat_close_input (which doesn't free custom I/O)
+void mmap_avio_close(struct AVIOContext ** const ppavio);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,32 @@
+#ifndef _PROC_STATS_H
+#define _PROC_STATS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Process resource usage snapshot for capacity measurement
+// CPU is as clock_gettime(CLOCK_PROCESS_CPUTIME_ID) so covers all threads.
+// dmabuf usage is found by walking /proc/self/fd so includes buffers
+// exported to us by decoders, each buffer counted once however many fds
+// reference it. Buffers that are only mapped (no open fd) are missed.
+
+typedef struct proc_stats_s {
+    int64_t wall_ns;            // CLOCK_MONOTONIC
+    int64_t cpu_ns;             // User + system, all threads
+    uint64_t dmabuf_bytes;
+    unsigned int dmabuf_count;
+} proc_stats_t;
+
+int proc_stats_sample(proc_stats_t * const ps);
+// Online CPUs - to scale cpu_ns / wall_ns to a fraction of the machine
+unsigned int proc_stats_cpus(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
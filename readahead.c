@@ -0,0 +1,253 @@
+#include "readahead.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/mathematics.h>
+
+#include "ring_queue.h"
+
+struct readahead_s {
+    ring_queue_t * q;
+    readahead_limits_t limits;
+    AVRational time_base;
+
+    pthread_mutex_t lock;
+    pthread_cond_t drained_cond;
+
+    // Protected by lock
+    bool aborted;
+    bool primed;            // Consumer has had at least one packet
+    bool eos;
+    unsigned int packets;
+    size_t bytes;
+    int64_t in_us;          // Timestamp of last packet in
+    int64_t out_us;         // Timestamp of last packet out
+    bool out_valid;
+    readahead_stats_t stats;
+};
+
+static int64_t
+time_us(void)
+{
+    struct timespec ts = {0,0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)(ts.tv_nsec / 1000) + (int64_t)(ts.tv_sec * 1000000);
+}
+
+static int64_t
+pkt_us(const readahead_t * const ra, const AVPacket * const pkt)
+{
+    const int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    if (ts == AV_NOPTS_VALUE || ra->time_base.num == 0 || ra->time_base.den == 0)
+        return AV_NOPTS_VALUE;
+    return av_rescale_q(ts, ra->time_base, (AVRational){1, 1000000});
+}
+
+// Call with lock held
+static int64_t
+duration_us(const readahead_t * const ra)
+{
+    return (ra->packets == 0 || !ra->out_valid || ra->in_us == AV_NOPTS_VALUE || ra->in_us < ra->out_us) ?
+        0 : ra->in_us - ra->out_us;
+}
+
+static bool
+over_high(const readahead_t * const ra)
+{
+    return ra->bytes >= ra->limits.high_bytes ||
+        (ra->limits.high_us != 0 && duration_us(ra) >= ra->limits.high_us);
+}
+
+static bool
+under_low(const readahead_t * const ra)
+{
+    return ra->bytes <= ra->limits.low_bytes &&
+        (ra->limits.high_us == 0 || duration_us(ra) <= ra->limits.low_us);
+}
+
+int
+readahead_put(readahead_t * const ra, AVPacket * const pkt)
+{
+    const int64_t us = pkt == NULL ? AV_NOPTS_VALUE : pkt_us(ra, pkt);
+    int64_t in_us_prev;
+    int rv;
+
+    pthread_mutex_lock(&ra->lock);
+    if (over_high(ra)) {
+        ++ra->stats.high_waits;
+        while (!ra->aborted && !under_low(ra))
+            pthread_cond_wait(&ra->drained_cond, &ra->lock);
+    }
+    if (ra->aborted) {
+        pthread_mutex_unlock(&ra->lock);
+        return -EPIPE;
+    }
+    // Account before the put - once it is in the ring the consumer may take
+    // it (& subtract it) before we get the lock back
+    in_us_prev = ra->in_us;
+    if (pkt != NULL) {
+        ++ra->packets;
+        ra->bytes += pkt->size;
+        if (us != AV_NOPTS_VALUE) {
+            ra->in_us = us;
+            if (!ra->out_valid) {
+                // Nothing taken out yet - start the duration from here
+                ra->out_us = us;
+                ra->out_valid = true;
+            }
+        }
+        if (ra->bytes > ra->stats.max_bytes)
+            ra->stats.max_bytes = ra->bytes;
+        if (duration_us(ra) > ra->stats.max_duration_us)
+            ra->stats.max_duration_us = duration_us(ra);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    // Packet count limit (& the actual wait for the consumer) is in the ring
+    rv = ring_queue_put(ra->q, pkt, true);
+
+    pthread_mutex_lock(&ra->lock);
+    if (rv != 0) {
+        if (pkt != NULL) {
+            --ra->packets;
+            ra->bytes -= pkt->size;
+            ra->in_us = in_us_prev;
+        }
+    }
+    else if (pkt == NULL) {
+        ra->eos = true;
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return rv;
+}
+
+int
+readahead_get(readahead_t * const ra, AVPacket ** const ppkt)
+{
+    void * v;
+    int rv;
+
+    if ((rv = ring_queue_get(ra->q, &v, false)) == -EAGAIN) {
+        int64_t t0 = 0;
+
+        pthread_mutex_lock(&ra->lock);
+        // Waiting for the first packet isn't an underrun
+        if (ra->primed && !ra->eos && !ra->aborted) {
+            ++ra->stats.underruns;
+            t0 = time_us();
+        }
+        pthread_mutex_unlock(&ra->lock);
+
+        rv = ring_queue_get(ra->q, &v, true);
+
+        if (t0 != 0) {
+            const int64_t t = time_us() - t0;
+            pthread_mutex_lock(&ra->lock);
+            ra->stats.underrun_us += t;
+            pthread_mutex_unlock(&ra->lock);
+        }
+    }
+    if (rv != 0)
+        return rv;
+
+    *ppkt = v;
+    if (v != NULL) {
+        const AVPacket * const pkt = v;
+        const int64_t us = pkt_us(ra, pkt);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->primed = true;
+        --ra->packets;
+        ra->bytes -= pkt->size;
+        if (us != AV_NOPTS_VALUE) {
+            ra->out_us = us;
+            ra->out_valid = true;
+        }
+        if (under_low(ra))
+            pthread_cond_signal(&ra->drained_cond);
+        pthread_mutex_unlock(&ra->lock);
+    }
+    return 0;
+}
+
+void
+readahead_abort(readahead_t * const ra)
+{
+    pthread_mutex_lock(&ra->lock);
+    ra->aborted = true;
+    pthread_cond_broadcast(&ra->drained_cond);
+    pthread_mutex_unlock(&ra->lock);
+    ring_queue_abort(ra->q);
+}
+
+void
+readahead_time_base_set(readahead_t * const ra, const AVRational time_base)
+{
+    pthread_mutex_lock(&ra->lock);
+    ra->time_base = time_base;
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void
+readahead_stats_get(readahead_t * const ra, readahead_stats_t * const stats)
+{
+    pthread_mutex_lock(&ra->lock);
+    *stats = ra->stats;
+    stats->packets = ra->packets;
+    stats->bytes = ra->bytes;
+    stats->duration_us = duration_us(ra);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void
+readahead_delete(readahead_t ** const ppra)
+{
+    readahead_t * const ra = *ppra;
+    void * v;
+
+    if (ra == NULL)
+        return;
+    *ppra = NULL;
+
+    if (ra->q != NULL) {
+        while (ring_queue_get(ra->q, &v, false) == 0) {
+            AVPacket * pkt = v;
+            av_packet_free(&pkt);
+        }
+        ring_queue_delete(&ra->q);
+    }
+    pthread_cond_destroy(&ra->drained_cond);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
+
+readahead_t *
+readahead_new(const readahead_limits_t * const limits)
+{
+    readahead_t * ra = calloc(1, sizeof(*ra));
+
+    if (ra == NULL)
+        return NULL;
+
+    ra->limits = *limits;
+    if (ra->limits.low_bytes > ra->limits.high_bytes)
+        ra->limits.low_bytes = ra->limits.high_bytes;
+    if (ra->limits.low_us > ra->limits.high_us)
+        ra->limits.low_us = ra->limits.high_us;
+    ra->in_us = AV_NOPTS_VALUE;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->drained_cond, NULL);
+
+    if ((ra->q = ring_queue_new(limits->max_packets)) == NULL) {
+        readahead_delete(&ra);
+        return NULL;
+    }
+    return ra;
+}
+
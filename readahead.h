@@ -0,0 +1,68 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libavutil/rational.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Demux read-ahead buffer
+// Bounded queue of AVPackets between demux & decode, limited by packet
+// count, bytes and duration. Once either the byte or duration high
+// watermark is hit the producer blocks until the buffer has drained below
+// the low watermark so that reads happen in bursts and a storage stall is
+// absorbed by whatever is buffered.
+// Single producer, single consumer. NULL packet = EOS.
+
+struct AVPacket;
+struct readahead_s;
+typedef struct readahead_s readahead_t;
+
+typedef struct readahead_limits_s {
+    unsigned int max_packets;
+    size_t high_bytes;
+    size_t low_bytes;
+    int64_t high_us;        // Duration watermarks, by packet timestamp
+    int64_t low_us;
+} readahead_limits_t;
+
+typedef struct readahead_stats_s {
+    unsigned int packets;   // Current fill
+    size_t bytes;
+    int64_t duration_us;
+    size_t max_bytes;       // Highest fill seen
+    int64_t max_duration_us;
+    uint64_t high_waits;    // Times the producer hit a high watermark
+    uint64_t underruns;     // Times the consumer found it empty (after the 1st fill)
+    int64_t underrun_us;    // Total time the consumer spent waiting in underrun
+} readahead_stats_t;
+
+readahead_t * readahead_new(const readahead_limits_t * const limits);
+// Frees any packets still queued
+void readahead_delete(readahead_t ** const ppra);
+
+// Timebase for packet timestamps (duration accounting) - set before use
+void readahead_time_base_set(readahead_t * const ra, const AVRational time_base);
+
+// Takes ownership of pkt (on success)
+// Return 0 OK, -EPIPE if aborted
+int readahead_put(readahead_t * const ra, struct AVPacket * const pkt);
+// Waits for a packet; *ppkt = NULL at EOS
+// Return 0 OK, -EPIPE if aborted & empty
+int readahead_get(readahead_t * const ra, struct AVPacket ** const ppkt);
+// Wake & fail the producer - consumer gets whatever is left
+void readahead_abort(readahead_t * const ra);
+
+void readahead_stats_get(readahead_t * const ra, readahead_stats_t * const stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,165 @@
+#include "ring_queue.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct ring_queue_s {
+    unsigned int depth;
+    atomic_bool aborted;
+
+    // Free running indices - slot = idx % depth
+    // head only written by the consumer, tail only by the producer
+    atomic_uint head;
+    atomic_uint tail;
+
+    sem_t items;    // Count of filled slots
+    sem_t space;    // Count of empty slots
+
+    // Stats - each only written from one side
+    atomic_uint max_count;
+    atomic_uint_least64_t puts;
+    atomic_uint_least64_t occupancy_sum;
+    atomic_uint_least64_t full_waits;
+    atomic_uint_least64_t empty_waits;
+
+    void * slots[];
+};
+
+static int
+sem_wait_q(sem_t * const sem, const bool wait, atomic_uint_least64_t * const wait_count)
+{
+    int rv;
+
+    if (sem_trywait(sem) == 0)
+        return 0;
+    if (!wait)
+        return -EAGAIN;
+
+    atomic_fetch_add_explicit(wait_count, 1, memory_order_relaxed);
+    while ((rv = sem_wait(sem)) == -1 && errno == EINTR)
+        /* loop */;
+    return rv == 0 ? 0 : -errno;
+}
+
+int
+ring_queue_put(ring_queue_t * const rq, void * const v, const bool wait)
+{
+    unsigned int tail;
+    unsigned int n;
+    int rv;
+
+    if (atomic_load(&rq->aborted))
+        return -EPIPE;
+
+    if ((rv = sem_wait_q(&rq->space, wait, &rq->full_waits)) != 0)
+        return rv;
+
+    if (atomic_load(&rq->aborted)) {
+        // Pass the wakeup on & fail
+        sem_post(&rq->space);
+        return -EPIPE;
+    }
+
+    tail = atomic_load_explicit(&rq->tail, memory_order_relaxed);
+    rq->slots[tail % rq->depth] = v;
+    atomic_store_explicit(&rq->tail, tail + 1, memory_order_release);
+
+    n = tail + 1 - atomic_load_explicit(&rq->head, memory_order_acquire);
+    if (n > atomic_load_explicit(&rq->max_count, memory_order_relaxed))
+        atomic_store_explicit(&rq->max_count, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&rq->puts, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&rq->occupancy_sum, n, memory_order_relaxed);
+
+    sem_post(&rq->items);
+    return 0;
+}
+
+int
+ring_queue_get(ring_queue_t * const rq, void ** const pv, const bool wait)
+{
+    unsigned int head;
+    int rv;
+
+    // Every put posts a token after the item is visible so a token normally
+    // means there is an item. The only extra token is the one posted by abort
+    if ((rv = sem_wait_q(&rq->items, wait, &rq->empty_waits)) != 0)
+        return rv;
+
+    head = atomic_load_explicit(&rq->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&rq->tail, memory_order_acquire)) {
+        // Woken by abort - repost so that any other get sees it too
+        sem_post(&rq->items);
+        return -EPIPE;
+    }
+
+    *pv = rq->slots[head % rq->depth];
+    atomic_store_explicit(&rq->head, head + 1, memory_order_release);
+    sem_post(&rq->space);
+    return 0;
+}
+
+void
+ring_queue_abort(ring_queue_t * const rq)
+{
+    if (rq == NULL)
+        return;
+    atomic_store(&rq->aborted, true);
+    sem_post(&rq->items);
+    sem_post(&rq->space);
+}
+
+unsigned int
+ring_queue_count(const ring_queue_t * const rq)
+{
+    return atomic_load(&((ring_queue_t *)rq)->tail) - atomic_load(&((ring_queue_t *)rq)->head);
+}
+
+void
+ring_queue_stats_get(const ring_queue_t * const rq, ring_queue_stats_t * const stats)
+{
+    ring_queue_t * const q = (ring_queue_t *)rq;
+
+    *stats = (ring_queue_stats_t){
+        .depth = q->depth,
+        .count = ring_queue_count(q),
+        .max_count = atomic_load(&q->max_count),
+        .puts = atomic_load(&q->puts),
+        .occupancy_sum = atomic_load(&q->occupancy_sum),
+        .full_waits = atomic_load(&q->full_waits),
+        .empty_waits = atomic_load(&q->empty_waits),
+    };
+}
+
+void
+ring_queue_delete(ring_queue_t ** const pprq)
+{
+    ring_queue_t * const rq = *pprq;
+
+    if (rq == NULL)
+        return;
+    *pprq = NULL;
+
+    sem_destroy(&rq->items);
+    sem_destroy(&rq->space);
+    free(rq);
+}
+
+ring_queue_t *
+ring_queue_new(unsigned int depth)
+{
+    ring_queue_t * rq;
+
+    if (depth == 0)
+        depth = 1;
+
+    if ((rq = calloc(1, sizeof(*rq) + depth * sizeof(rq->slots[0]))) == NULL)
+        return NULL;
+
+    rq->depth = depth;
+    sem_init(&rq->items, 0, 0);
+    sem_init(&rq->space, 0, depth);
+    return rq;
+}
+
@@ -0,0 +1,52 @@
+#ifndef _RING_QUEUE_H
+#define _RING_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bounded single producer, single consumer queue of pointers
+// The data path is lock-free - semaphores are only used to sleep when the
+// queue is full (producer) or empty (consumer)
+// NULL is a valid item so can be used as an EOS marker
+
+struct ring_queue_s;
+typedef struct ring_queue_s ring_queue_t;
+
+typedef struct ring_queue_stats_s {
+    unsigned int depth;         // Queue size
+    unsigned int count;         // Current occupancy
+    unsigned int max_count;     // Highest occupancy seen
+    uint64_t puts;              // Items queued
+    uint64_t occupancy_sum;     // Sum of occupancy after each put (mean = sum / puts)
+    uint64_t full_waits;        // Number of puts that had to wait for space
+    uint64_t empty_waits;       // Number of gets that had to wait for an item
+} ring_queue_stats_t;
+
+ring_queue_t * ring_queue_new(unsigned int depth);
+// Any items still in the queue are lost - drain first if they need freeing
+void ring_queue_delete(ring_queue_t ** const pprq);
+
+// Return:
+//  0        OK
+// -EAGAIN   Queue full (empty for get) and wait == false
+// -EPIPE    Queue aborted (get only returns this once the queue is empty)
+int ring_queue_put(ring_queue_t * const rq, void * const v, const bool wait);
+int ring_queue_get(ring_queue_t * const rq, void ** const pv, const bool wait);
+
+// Wake any waiters & fail all future puts
+// Gets continue to succeed until the queue is empty
+void ring_queue_abort(ring_queue_t * const rq);
+
+unsigned int ring_queue_count(const ring_queue_t * const rq);
+void ring_queue_stats_get(const ring_queue_t * const rq, ring_queue_stats_t * const stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
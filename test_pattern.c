@@ -0,0 +1,158 @@
+#include "test_pattern.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+#define STAMP_CELL      8       // Cell size in pixels
+#define STAMP_SYNC      2       // White, black then the data
+#define STAMP_BITS      64
+#define STAMP_WHITE     235
+#define STAMP_BLACK     16
+#define BAR_SIZE        16
+
+typedef enum pat_layout_e {
+    PAT_NONE = 0,
+    PAT_YUV420P,
+    PAT_NV12,
+    PAT_RGBX,                   // Any 32-bit RGB - drawn in grey
+} pat_layout_t;
+
+static pat_layout_t
+fmt_layout(const int format)
+{
+    switch (format) {
+        case AV_PIX_FMT_YUV420P:
+            return PAT_YUV420P;
+        case AV_PIX_FMT_NV12:
+            return PAT_NV12;
+        case AV_PIX_FMT_RGB0:
+        case AV_PIX_FMT_BGR0:
+        case AV_PIX_FMT_0RGB:
+        case AV_PIX_FMT_0BGR:
+            return PAT_RGBX;
+        default:
+            break;
+    }
+    return PAT_NONE;
+}
+
+bool
+test_pattern_format_ok(const int format)
+{
+    return fmt_layout(format) != PAT_NONE;
+}
+
+static void
+rect_fill(uint8_t * const data, const int linesize, const unsigned int bpp,
+          const int x, const int y, const int w, const int h, const uint8_t v)
+{
+    int i;
+    for (i = 0; i != h; ++i)
+        memset(data + (y + i) * linesize + x * bpp, v, w * bpp);
+}
+
+// Chroma planes - cycle the colour with the frame number
+static void
+chroma_draw(AVFrame * const frame, const pat_layout_t layout, const uint32_t frame_no)
+{
+    const int cw = (frame->width + 1) / 2;
+    const int ch = (frame->height + 1) / 2;
+    const uint8_t u = (uint8_t)frame_no;
+    const uint8_t v = (uint8_t)(255 - u);
+    // Keep the stamp neutral so it reads back as a clean black / white
+    const int sw = (STAMP_SYNC + STAMP_BITS) * STAMP_CELL / 2;
+    const int sh = STAMP_CELL / 2;
+    int y;
+
+    if (layout == PAT_YUV420P) {
+        rect_fill(frame->data[1], frame->linesize[1], 1, 0, 0, cw, ch, u);
+        rect_fill(frame->data[2], frame->linesize[2], 1, 0, 0, cw, ch, v);
+        rect_fill(frame->data[1], frame->linesize[1], 1, 0, 0, sw, sh, 128);
+        rect_fill(frame->data[2], frame->linesize[2], 1, 0, 0, sw, sh, 128);
+        return;
+    }
+
+    for (y = 0; y != ch; ++y) {
+        uint8_t * const p = frame->data[1] + y * frame->linesize[1];
+        int x;
+        for (x = 0; x != cw; ++x) {
+            const bool neutral = y < sh && x < sw;
+            p[x * 2] = neutral ? 128 : u;
+            p[x * 2 + 1] = neutral ? 128 : v;
+        }
+    }
+}
+
+void
+test_pattern_draw(AVFrame * const frame, const test_pattern_stamp_t * const stamp)
+{
+    const pat_layout_t layout = fmt_layout(frame->format);
+    const unsigned int bpp = layout == PAT_RGBX ? 4 : 1;
+    const int w = frame->width;
+    const int h = frame->height;
+    const uint64_t bits = ((uint64_t)stamp->frame_no << 32) | stamp->t_us;
+    uint8_t * const data = frame->data[0];
+    const int linesize = frame->linesize[0];
+    uint8_t * ramp;
+    int i;
+
+    if (layout == PAT_NONE || w < TEST_PATTERN_MIN_WIDTH || h < TEST_PATTERN_MIN_HEIGHT)
+        return;
+
+    // Diagonal ramp scrolling down - every line is a window on the same
+    // ramp so build it once & copy
+    if ((ramp = malloc((w + 256) * bpp)) != NULL) {
+        for (i = 0; i != w + 256; ++i)
+            memset(ramp + i * bpp, (uint8_t)i, bpp);
+        for (i = 0; i != h; ++i)
+            memcpy(data + i * linesize, ramp + (((unsigned int)i - stamp->frame_no * 2) & 255) * bpp, w * bpp);
+        free(ramp);
+    }
+
+    // Bars - one moving across, one moving down below the stamp
+    rect_fill(data, linesize, bpp, (stamp->frame_no * 8) % (w - BAR_SIZE), 0, BAR_SIZE, h, STAMP_WHITE);
+    rect_fill(data, linesize, bpp, 0, STAMP_CELL + (stamp->frame_no * 4) % (h - BAR_SIZE - STAMP_CELL),
+              w, BAR_SIZE, STAMP_BLACK);
+
+    // Stamp - sync cells then the bits msb first
+    rect_fill(data, linesize, bpp, 0, 0, STAMP_CELL, STAMP_CELL, STAMP_WHITE);
+    rect_fill(data, linesize, bpp, STAMP_CELL, 0, STAMP_CELL, STAMP_CELL, STAMP_BLACK);
+    for (i = 0; i != STAMP_BITS; ++i)
+        rect_fill(data, linesize, bpp, (STAMP_SYNC + i) * STAMP_CELL, 0, STAMP_CELL, STAMP_CELL,
+                  ((bits >> (STAMP_BITS - 1 - i)) & 1) != 0 ? STAMP_WHITE : STAMP_BLACK);
+
+    if (layout != PAT_RGBX)
+        chroma_draw(frame, layout, stamp->frame_no);
+}
+
+// Sample the middle of a cell
+static bool
+cell_bit(const AVFrame * const frame, const unsigned int bpp, const int n)
+{
+    return frame->data[0][(STAMP_CELL / 2) * frame->linesize[0] +
+                          (n * STAMP_CELL + STAMP_CELL / 2) * bpp] >= 128;
+}
+
+int
+test_pattern_stamp_read(const AVFrame * const frame, test_pattern_stamp_t * const stamp)
+{
+    const pat_layout_t layout = fmt_layout(frame->format);
+    const unsigned int bpp = layout == PAT_RGBX ? 4 : 1;
+    uint64_t bits = 0;
+    int i;
+
+    if (layout == PAT_NONE || frame->width < TEST_PATTERN_MIN_WIDTH || frame->height < TEST_PATTERN_MIN_HEIGHT ||
+        !cell_bit(frame, bpp, 0) || cell_bit(frame, bpp, 1))
+        return -EINVAL;
+
+    for (i = 0; i != STAMP_BITS; ++i)
+        bits = (bits << 1) | (cell_bit(frame, bpp, STAMP_SYNC + i) ? 1 : 0);
+    stamp->frame_no = (uint32_t)(bits >> 32);
+    stamp->t_us = (uint32_t)bits;
+    return 0;
+}
+
@@ -0,0 +1,39 @@
+#ifndef _TEST_PATTERN_H
+#define _TEST_PATTERN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Synthetic test pattern
+// Draws a moving pattern into a s/w frame along with a stamp - a row of
+// black / white cells along the top carrying the frame number & a
+// timestamp that can be read back from the frame (or a dump of it).
+// Supported formats: yuv420p, nv12, rgb0, bgr0, 0rgb, 0bgr
+
+struct AVFrame;
+
+typedef struct test_pattern_stamp_s {
+    uint32_t frame_no;
+    uint32_t t_us;          // Low 32 bits of the generation time in us
+} test_pattern_stamp_t;
+
+bool test_pattern_format_ok(const int format);
+// Width & height must be at least TEST_PATTERN_MIN_WIDTH x
+// TEST_PATTERN_MIN_HEIGHT for the stamp to fit
+#define TEST_PATTERN_MIN_WIDTH  (66 * 8)
+#define TEST_PATTERN_MIN_HEIGHT 32
+
+void test_pattern_draw(struct AVFrame * const frame, const test_pattern_stamp_t * const stamp);
+// Returns 0 OK, -EINVAL if the frame doesn't carry a valid stamp
+int test_pattern_stamp_read(const struct AVFrame * const frame, test_pattern_stamp_t * const stamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
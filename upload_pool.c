@@ -0,0 +1,207 @@
+#include "upload_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libavutil/common.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+// Slices including the caller's
+#define UPLOAD_SLICES_MAX   4
+// Frames smaller than this are copied on the calling thread
+#define UPLOAD_MT_MIN_BYTES (256 * 1024)
+
+typedef struct upload_job_s {
+    unsigned int planes;
+    unsigned int slices;
+    uint8_t * dst[4];
+    int dst_stride[4];
+    const uint8_t * src[4];
+    int src_stride[4];
+    int bytewidth[4];
+    int height[4];
+} upload_job_t;
+
+typedef struct upload_worker_s {
+    struct upload_pool_s * up;
+    unsigned int n;             // Slice number - 0 is the caller
+    pthread_t thread;
+} upload_worker_t;
+
+struct upload_pool_s {
+    pthread_mutex_t copy_lock;  // One copy at a time
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;    // Workers wait for a new job
+    pthread_cond_t done_cond;   // Caller waits for the workers to finish
+    const upload_job_t * job;
+    uint64_t job_seq;
+    unsigned int pending;       // Worker slices not yet done
+    bool terminate;
+
+    unsigned int n_workers;
+    upload_worker_t workers[UPLOAD_SLICES_MAX - 1];
+};
+
+static void
+slice_copy(const upload_job_t * const job, const unsigned int k)
+{
+    unsigned int i;
+
+    for (i = 0; i != job->planes; ++i) {
+        const int y0 = job->height[i] * k / job->slices;
+        const int y1 = job->height[i] * (k + 1) / job->slices;
+
+        av_image_copy_plane(job->dst[i] + y0 * job->dst_stride[i], job->dst_stride[i],
+                            job->src[i] + y0 * job->src_stride[i], job->src_stride[i],
+                            job->bytewidth[i], y1 - y0);
+    }
+}
+
+static void *
+worker_thread(void * v)
+{
+    upload_worker_t * const w = v;
+    upload_pool_t * const up = w->up;
+    uint64_t seq = 0;
+
+    pthread_mutex_lock(&up->lock);
+    for (;;) {
+        const upload_job_t * job;
+
+        while (!up->terminate && up->job_seq == seq)
+            pthread_cond_wait(&up->job_cond, &up->lock);
+        if (up->terminate)
+            break;
+        seq = up->job_seq;
+        job = up->job;
+        pthread_mutex_unlock(&up->lock);
+
+        if (w->n < job->slices)
+            slice_copy(job, w->n);
+
+        pthread_mutex_lock(&up->lock);
+        if (--up->pending == 0)
+            pthread_cond_signal(&up->done_cond);
+    }
+    pthread_mutex_unlock(&up->lock);
+    return NULL;
+}
+
+int
+upload_pool_copy(upload_pool_t * const up, AVFrame * const dst, const AVFrame * const src)
+{
+    const AVPixFmtDescriptor * const desc = av_pix_fmt_desc_get(src->format);
+    upload_job_t job = {0};
+    size_t bytes = 0;
+    int planes;
+    int i;
+
+    if (desc == NULL || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) != 0 ||
+        dst->format != src->format || dst->width != src->width || dst->height != src->height ||
+        (planes = av_pix_fmt_count_planes(src->format)) <= 0 || planes > 4)
+        return AVERROR(EINVAL);
+
+    job.planes = planes;
+    for (i = 0; i != planes; ++i) {
+        // As av_image_copy
+        job.height[i] = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(src->height, desc->log2_chroma_h) : src->height;
+        if ((job.bytewidth[i] = av_image_get_linesize(src->format, src->width, i)) < 0)
+            return job.bytewidth[i];
+        job.dst[i] = dst->data[i];
+        job.dst_stride[i] = dst->linesize[i];
+        job.src[i] = src->data[i];
+        job.src_stride[i] = src->linesize[i];
+        bytes += (size_t)job.bytewidth[i] * job.height[i];
+    }
+    job.slices = bytes < UPLOAD_MT_MIN_BYTES ? 1 : up->n_workers + 1;
+
+    pthread_mutex_lock(&up->copy_lock);
+
+    if (job.slices > 1) {
+        pthread_mutex_lock(&up->lock);
+        up->job = &job;
+        up->pending = up->n_workers;
+        ++up->job_seq;
+        pthread_cond_broadcast(&up->job_cond);
+        pthread_mutex_unlock(&up->lock);
+    }
+
+    slice_copy(&job, 0);
+
+    if (job.slices > 1) {
+        pthread_mutex_lock(&up->lock);
+        while (up->pending != 0)
+            pthread_cond_wait(&up->done_cond, &up->lock);
+        up->job = NULL;
+        pthread_mutex_unlock(&up->lock);
+    }
+
+    pthread_mutex_unlock(&up->copy_lock);
+    return 0;
+}
+
+void
+upload_pool_delete(upload_pool_t ** const ppup)
+{
+    upload_pool_t * const up = *ppup;
+    unsigned int i;
+
+    if (up == NULL)
+        return;
+    *ppup = NULL;
+
+    pthread_mutex_lock(&up->lock);
+    up->terminate = true;
+    pthread_cond_broadcast(&up->job_cond);
+    pthread_mutex_unlock(&up->lock);
+
+    for (i = 0; i != up->n_workers; ++i)
+        pthread_join(up->workers[i].thread, NULL);
+
+    pthread_cond_destroy(&up->done_cond);
+    pthread_cond_destroy(&up->job_cond);
+    pthread_mutex_destroy(&up->lock);
+    pthread_mutex_destroy(&up->copy_lock);
+    free(up);
+}
+
+upload_pool_t *
+upload_pool_new(unsigned int threads)
+{
+    upload_pool_t * up = calloc(1, sizeof(*up));
+    unsigned int i;
+
+    if (up == NULL)
+        return NULL;
+
+    if (threads == 0) {
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores < 1 ? 1 : (unsigned int)cores;
+    }
+    if (threads > UPLOAD_SLICES_MAX)
+        threads = UPLOAD_SLICES_MAX;
+
+    pthread_mutex_init(&up->copy_lock, NULL);
+    pthread_mutex_init(&up->lock, NULL);
+    pthread_cond_init(&up->job_cond, NULL);
+    pthread_cond_init(&up->done_cond, NULL);
+
+    // The caller does a slice too
+    for (i = 0; i + 1 < threads; ++i) {
+        upload_worker_t * const w = up->workers + i;
+        w->up = up;
+        w->n = i + 1;
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0)
+            break;
+        ++up->n_workers;
+    }
+    return up;
+}
+
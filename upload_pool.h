@@ -0,0 +1,33 @@
+#ifndef _UPLOAD_POOL_H
+#define _UPLOAD_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Parallel frame copy
+// Copies a s/w frame into another of the same format & size with the rows
+// of every plane split into slices across a small pool of worker threads.
+// The calling thread does one slice itself. Small frames aren't worth the
+// wakeups & are copied on the calling thread alone.
+// Any number of threads may call upload_pool_copy - copies are done one at
+// a time.
+
+struct AVFrame;
+struct upload_pool_s;
+typedef struct upload_pool_s upload_pool_t;
+
+// threads == 0 picks a default from the number of cores
+upload_pool_t * upload_pool_new(unsigned int threads);
+void upload_pool_delete(upload_pool_t ** const ppup);
+
+// dst must already be allocated with the same format & size as src
+// Returns 0 or AVERROR
+int upload_pool_copy(upload_pool_t * const up, struct AVFrame * const dst, const struct AVFrame * const src);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,150 @@
+#include "vsync_clock.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Loop gains - phase error is corrected by 1/PHASE_GAIN each update,
+// period by 1/PERIOD_GAIN of the per-vblank error
+#define PHASE_GAIN   4
+#define PERIOD_GAIN  16
+// Updates with phase error inside 1/LOCK_TOL of a period needed before lock
+#define LOCK_COUNT   4
+#define LOCK_TOL     8
+// If the compositor's refresh differs by more than 1/REFRESH_TOL reset
+#define REFRESH_TOL  100
+// Guess used until we have something better
+#define DEFAULT_PERIOD_NS 16666667.0
+
+struct vsync_clock_s {
+    pthread_mutex_t lock;
+
+    bool have_ref;
+    unsigned int good_count;    // Consecutive in-tolerance updates
+    int64_t ref_ns;             // Estimated time of reference vblank
+    uint64_t ref_seq;           // Compositor seq of ref vblank (0 = unknown)
+    double period_ns;           // Estimated period
+};
+
+static void
+clock_restart(vsync_clock_t * const vc, const int64_t time_ns, const uint32_t refresh_ns, const uint64_t seq)
+{
+    vc->have_ref = true;
+    vc->good_count = 0;
+    vc->ref_ns = time_ns;
+    vc->ref_seq = seq;
+    if (refresh_ns != 0)
+        vc->period_ns = refresh_ns;
+}
+
+void
+vsync_clock_update(vsync_clock_t * const vc, const int64_t time_ns,
+                   const uint32_t refresh_ns, const uint64_t seq)
+{
+    int64_t n;
+    double err;
+
+    if (vc == NULL)
+        return;
+
+    pthread_mutex_lock(&vc->lock);
+
+    if (!vc->have_ref ||
+        (refresh_ns != 0 && fabs(refresh_ns - vc->period_ns) * REFRESH_TOL > vc->period_ns)) {
+        clock_restart(vc, time_ns, refresh_ns, seq);
+        goto unlock;
+    }
+
+    // Number of vblanks since ref - trust seq if we have it
+    n = (seq != 0 && vc->ref_seq != 0) ? (int64_t)(seq - vc->ref_seq) :
+        llround((time_ns - vc->ref_ns) / vc->period_ns);
+
+    if (n == 0)
+        goto unlock;    // Same vblank as last time - nothing new
+    if (n < 0) {
+        clock_restart(vc, time_ns, refresh_ns, seq);
+        goto unlock;
+    }
+
+    err = (double)(time_ns - vc->ref_ns) - n * vc->period_ns;
+    if (fabs(err) * 2 > vc->period_ns) {
+        // Lost it (or seq was wrong) - start again from here
+        clock_restart(vc, time_ns, refresh_ns, seq);
+        goto unlock;
+    }
+
+    vc->ref_ns += llround(n * vc->period_ns + err / PHASE_GAIN);
+    vc->ref_seq = seq;
+    // Only trust our own period if the compositor hasn't told us
+    if (refresh_ns == 0)
+        vc->period_ns += err / (PERIOD_GAIN * n);
+
+    if (fabs(err) * LOCK_TOL > vc->period_ns)
+        vc->good_count = 0;
+    else if (vc->good_count < LOCK_COUNT)
+        ++vc->good_count;
+
+unlock:
+    pthread_mutex_unlock(&vc->lock);
+}
+
+int
+vsync_clock_next(vsync_clock_t * const vc, const int64_t t_ns,
+                 int64_t * const vblank_ns, int64_t * const period_ns)
+{
+    int rv = -EAGAIN;
+
+    if (vc == NULL)
+        return rv;
+
+    pthread_mutex_lock(&vc->lock);
+    if (vc->good_count >= LOCK_COUNT) {
+        const double n = ceil((t_ns - vc->ref_ns) / vc->period_ns);
+        *vblank_ns = vc->ref_ns + llround(n * vc->period_ns);
+        if (period_ns != NULL)
+            *period_ns = llround(vc->period_ns);
+        rv = 0;
+    }
+    pthread_mutex_unlock(&vc->lock);
+    return rv;
+}
+
+void
+vsync_clock_reset(vsync_clock_t * const vc)
+{
+    if (vc == NULL)
+        return;
+    pthread_mutex_lock(&vc->lock);
+    vc->have_ref = false;
+    vc->good_count = 0;
+    pthread_mutex_unlock(&vc->lock);
+}
+
+void
+vsync_clock_delete(vsync_clock_t ** const ppvc)
+{
+    vsync_clock_t * const vc = *ppvc;
+
+    if (vc == NULL)
+        return;
+    *ppvc = NULL;
+
+    pthread_mutex_destroy(&vc->lock);
+    free(vc);
+}
+
+vsync_clock_t *
+vsync_clock_new(void)
+{
+    vsync_clock_t * const vc = calloc(1, sizeof(*vc));
+
+    if (vc == NULL)
+        return NULL;
+
+    pthread_mutex_init(&vc->lock, NULL);
+    vc->period_ns = DEFAULT_PERIOD_NS;
+    return vc;
+}
+
@@ -0,0 +1,43 @@
+#ifndef _VSYNC_CLOCK_H
+#define _VSYNC_CLOCK_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Vblank timing recovery
+// Fed with presentation feedback (time, refresh, seq) this maintains a
+// phase-locked estimate of when vblanks occur so that frames can be targeted
+// at a specific vblank rather than just "as soon as possible after PTS"
+// All times are in ns in the presentation clock domain
+// Update & query may be called from different threads
+
+struct vsync_clock_s;
+typedef struct vsync_clock_s vsync_clock_t;
+
+vsync_clock_t * vsync_clock_new(void);
+void vsync_clock_delete(vsync_clock_t ** const ppvc);
+
+// Drop lock - e.g. after a mode change
+void vsync_clock_reset(vsync_clock_t * const vc);
+
+// Add a presentation timestamp
+// refresh_ns and seq may be 0 if unknown
+// Only timestamps that are known to be vblank aligned should be added
+void vsync_clock_update(vsync_clock_t * const vc, const int64_t time_ns,
+                        const uint32_t refresh_ns, const uint64_t seq);
+
+// Get the time of the first vblank at or after t_ns
+// period_ns may be NULL
+// Returns 0 on success, -EAGAIN if not (yet) locked
+int vsync_clock_next(vsync_clock_t * const vc, const int64_t t_ns,
+                     int64_t * const vblank_ns, int64_t * const period_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -11,6 +11,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libdrm/drm_fourcc.h>
@@ -64,6 +65,7 @@ struct wo_fb_s {
     size_t obj_no[WO_FB_PLANES];
     uint64_t mod;
     wo_rect_t crop;   // 16.16 fixed
+    uint64_t tag;
 
     struct wl_buffer *way_buf;
 
@@ -100,6 +102,8 @@ struct wo_surface_s {
     void * win_resize_v;
 
     bool presentation_req;
+    wo_surface_presented_fn presented_fn;
+    void * presented_v;
     wo_surface_stats_t stats;
     unsigned int w_discarded;
     unsigned int w_presented;
@@ -152,6 +156,12 @@ struct wo_env_s {
     struct wl_region * region_all;
 
     sem_t * finish_sem;
+
+    // Display thread load - times only written by the pollqueue thread
+    int64_t pq_poll_start;
+    int64_t pq_poll_end;
+    atomic_uint_least64_t pq_busy_ns;
+    atomic_uint_least64_t pq_idle_ns;
 };
 
 #define TRACE_REFS  0
@@ -645,6 +655,18 @@ wo_fb_crop_frac_set(wo_fb_t * wfb, const wo_rect_t crop)
     wfb->crop = crop;
 }
 
+void
+wo_fb_tag_set(wo_fb_t * const wfb, const uint64_t tag)
+{
+    wfb->tag = tag;
+}
+
+uint64_t
+wo_fb_tag(const wo_fb_t * const wfb)
+{
+    return wfb->tag;
+}
+
 void
 wo_fb_write_start(wo_fb_t * wfb)
 {
@@ -688,6 +710,20 @@ presentation_sync_output_cb(void *data,
     (void)output;
 }
 
+// Listener data for a single feedback request
+typedef struct presentation_fb_s {
+    wo_surface_t * wos;
+    uint64_t tag;
+    int64_t commit_ns;
+} presentation_fb_t;
+
+static void
+presentation_fb_free(presentation_fb_t * const pfb)
+{
+    wo_surface_unref(&pfb->wos);
+    free(pfb);
+}
+
 // Presented/Discarded can occur after close has finished so need to
 static void
 presentation_presented_cb(void *data,
@@ -700,31 +736,45 @@ presentation_presented_cb(void *data,
           uint32_t seq_lo,
           uint32_t flags)
 {
-    wo_surface_t * wos = data;
-    (void)tv_sec_hi;
-    (void)tv_sec_lo;
-    (void)tv_nsec;
-    (void)refresh;
-    (void)seq_hi;
-    (void)seq_lo;
-    (void)flags;
+    presentation_fb_t * const pfb = data;
+    wo_surface_t * const wos = pfb->wos;
 
     wp_presentation_feedback_destroy(wp_presentation_feedback);
 
     ++wos->stats.presented_count;
-    wo_surface_unref(&wos);
+    if (wos->presented_fn) {
+        const wo_presented_t pres = {
+            .time_ns = (int64_t)(((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000 + tv_nsec,
+            .refresh_ns = refresh,
+            .seq = ((uint64_t)seq_hi << 32) | seq_lo,
+            .flags = flags,
+            .tag = pfb->tag,
+            .commit_ns = pfb->commit_ns,
+        };
+        wos->presented_fn(wos->presented_v, wos, &pres);
+    }
+    presentation_fb_free(pfb);
 }
 
 static void
 presentation_discarded_cb(void *data,
           struct wp_presentation_feedback *wp_presentation_feedback)
 {
-    wo_surface_t * wos = data;
+    presentation_fb_t * const pfb = data;
+    wo_surface_t * const wos = pfb->wos;
 
     wp_presentation_feedback_destroy(wp_presentation_feedback);
 
     ++wos->stats.discarded_count;
-    wo_surface_unref(&wos);
+    if (wos->presented_fn) {
+        const wo_presented_t pres = {
+            .discarded = true,
+            .tag = pfb->tag,
+            .commit_ns = pfb->commit_ns,
+        };
+        wos->presented_fn(wos->presented_v, wos, &pres);
+    }
+    presentation_fb_free(pfb);
 }
 
 static const struct wp_presentation_feedback_listener presentation_feedback_listener = {
@@ -766,6 +816,7 @@ surface_attach_fb_cb(void * v, short revents)
     // 1st time through ensure we commit everything
     bool commit_req_this = !wos->commit0_done;
     bool commit_req_parent = !wos->commit0_done && wos->parent != NULL;
+    presentation_fb_t * pfb = NULL;
     (void)revents;
 
     // Not the first time anymore
@@ -788,10 +839,12 @@ surface_attach_fb_cb(void * v, short revents)
             fb_on_release_setup(wofb);
             commit_req_this = true;
 
-            if (wos->presentation_req || 1) {
+            if (wos->woe->presentation != NULL && (pfb = calloc(1, sizeof(*pfb))) != NULL) {
                 struct wp_presentation_feedback * feedback =
                     wp_presentation_feedback(wos->woe->presentation, wos->s.surface);
-                wp_presentation_feedback_add_listener(feedback, &presentation_feedback_listener, wo_surface_ref(wos));
+                pfb->wos = wo_surface_ref(wos);
+                pfb->tag = wofb->tag;
+                wp_presentation_feedback_add_listener(feedback, &presentation_feedback_listener, pfb);
             }
         }
         if (wofb != NULL &&
@@ -828,6 +881,12 @@ surface_attach_fb_cb(void * v, short revents)
             wos->dst_pos = a->dst_pos;
         }
     }
+    if (pfb != NULL) {
+        // pfb is owned by the listener so must be set before commit
+        struct timespec ts = {0, 0};
+        clock_gettime(wo_env_presentation_clock(wos->woe), &ts);
+        pfb->commit_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
     if (commit_req_this)
         wl_surface_commit(wos->s.surface);
     if (commit_req_parent)
@@ -951,6 +1010,43 @@ wo_surface_dmabuf_fmt_check(wo_surface_t * const wos, const uint32_t fmt, const
         (mod != cmod && fmt_list_find(&woe->fmt_list, fmt, cmod));
 }
 
+struct surface_presented_set_arg_s {
+    wo_surface_t * const wos;
+    const wo_surface_presented_fn fn;
+    void * const v;
+    sem_t sem;
+};
+
+static void
+surface_presented_set_cb(void * v, short revents)
+{
+    struct surface_presented_set_arg_s * const a = v;
+    (void)revents;
+    a->wos->presented_fn = a->fn;
+    a->wos->presented_v = a->v;
+    sem_post(&a->sem);
+}
+
+// Feedback callbacks run on the event thread so set there - once this
+// returns no callback with the old fn/v is running or will run
+void
+wo_surface_on_presented_set(wo_surface_t * wos, wo_surface_presented_fn fn, void *v)
+{
+    struct surface_presented_set_arg_s a = {.wos = wos, .fn = fn, .v = v};
+
+    sem_init(&a.sem, 0, 0);
+    if (pollqueue_callback_once(wos->woe->pq, surface_presented_set_cb, &a) != 0) {
+        // No event thread - nothing to race with
+        wos->presented_fn = fn;
+        wos->presented_v = v;
+    }
+    else {
+        while (sem_wait(&a.sem) == -1 && errno == EINTR)
+            /* Loop */;
+    }
+    sem_destroy(&a.sem);
+}
+
 void
 wo_surface_on_win_resize_set(wo_surface_t * wos, wo_surface_win_resize_fn fn, void *v)
 {
@@ -1466,6 +1562,14 @@ fail:
 // Contains a flush in the pre-poll function so there is no need for one in
 // any callback
 
+static int64_t
+mono_ns(void)
+{
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 // Pre display thread poll function
 static void
 pollq_pre_cb(void *v, struct pollfd *pfd)
@@ -1481,6 +1585,11 @@ pollq_pre_cb(void *v, struct pollfd *pfd)
     else
         pfd->events = POLLOUT | POLLIN;
     pfd->fd = wl_display_get_fd(display);
+
+    // Everything since the last poll returned counts as busy
+    woe->pq_poll_start = mono_ns();
+    if (woe->pq_poll_end != 0)
+        atomic_fetch_add(&woe->pq_busy_ns, woe->pq_poll_start - woe->pq_poll_end);
 }
 
 // Post display thread poll function
@@ -1492,6 +1601,9 @@ pollq_post_cb(void *v, short revents)
     wo_env_t *const woe = v;
     struct wl_display *const display = woe->w_display;
 
+    woe->pq_poll_end = mono_ns();
+    atomic_fetch_add(&woe->pq_idle_ns, woe->pq_poll_end - woe->pq_poll_start);
+
     if ((revents & POLLIN) == 0)
         wl_display_cancel_read(display);
     else
@@ -1504,6 +1616,13 @@ pollq_post_cb(void *v, short revents)
 //
 // Main env
 
+void
+wo_env_pollqueue_load(const wo_env_t * const woe, uint64_t * const busy_ns, uint64_t * const idle_ns)
+{
+    *busy_ns = atomic_load(&woe->pq_busy_ns);
+    *idle_ns = atomic_load(&woe->pq_idle_ns);
+}
+
 struct wl_display *
 wo_env_display(const wo_env_t * const woe)
 {
@@ -1516,6 +1635,12 @@ wo_env_pollqueue(const wo_env_t * const woe)
     return woe->pq;
 }
 
+int
+wo_env_presentation_clock(const wo_env_t * const woe)
+{
+    return woe->presentation_clock_id;
+}
+
 wo_env_t *
 wo_env_ref(wo_env_t * const woe)
 {
@@ -1664,6 +1789,9 @@ wo_env_new_default(void)
     if (woe == NULL)
         return NULL;
 
+    // Protocol says that clock_id is sent on bind but default to something
+    // sane in case presentation isn't supported
+    woe->presentation_clock_id = CLOCK_MONOTONIC;
     fmt_list_init(&woe->fmt_list, 16);
 
     if (get_display_and_registry(woe) != 0)
@@ -66,6 +66,21 @@ typedef struct wo_surface_stats_s {
     unsigned int discarded_count;
 } wo_surface_stats_t;
 
+// Presentation feedback for a single commit
+// Times are in the presentation clock domain (see wo_env_presentation_clock)
+typedef struct wo_presented_s {
+    bool discarded;         // Commit was never shown - times & flags invalid
+    int64_t time_ns;        // Time the content became visible
+    uint32_t refresh_ns;    // Predicted refresh period, 0 if unknown
+    uint64_t seq;           // Vblank sequence number, 0 if unknown
+    uint32_t flags;         // WP_PRESENTATION_FEEDBACK_KIND_xxx
+    uint64_t tag;           // Tag of the fb attached by this commit
+    int64_t commit_ns;      // Time of wl_surface_commit
+} wo_presented_t;
+
+// Called from the wayland pollqueue thread
+typedef void (* wo_surface_presented_fn)(void * v, wo_surface_t * wos, const wo_presented_t * pres);
+
 // Retrieve stats
 const wo_surface_stats_t * wo_surface_stats_get(wo_surface_t * const wos);
 // Enable stats for this surface. There is a small overhead so only enable
@@ -103,6 +118,9 @@ void * wo_fb_data(const wo_fb_t * wfb, const unsigned int plane);
 
 // crop is expected to be in 16.16 fixed point format
 void wo_fb_crop_frac_set(wo_fb_t * wfb, const wo_rect_t crop);
+// Opaque user tag passed back in presentation feedback
+void wo_fb_tag_set(wo_fb_t * const wfb, const uint64_t tag);
+uint64_t wo_fb_tag(const wo_fb_t * const wfb);
 
 void wo_fb_write_start(wo_fb_t * wfb);
 void wo_fb_write_end(wo_fb_t * wfb);
@@ -115,6 +133,10 @@ typedef void (*wo_surface_win_resize_fn)(void * v, wo_surface_t * wos, const wo_
 
 bool wo_surface_dmabuf_fmt_check(wo_surface_t * const wos, const uint32_t fmt, const uint64_t mod);
 void wo_surface_on_win_resize_set(wo_surface_t * wos, wo_surface_win_resize_fn fn, void *v);
+// Set callback for presentation feedback on every new fb attached
+// Set before the first attach and clear before the callback context goes away
+// Synchronous with the event thread so must not be called from it
+void wo_surface_on_presented_set(wo_surface_t * wos, wo_surface_presented_fn fn, void *v);
 int wo_surface_dst_pos_set(wo_surface_t * const wos, const wo_rect_t pos);
 unsigned int wo_surface_dst_width(const wo_surface_t * const wos);
 unsigned int wo_surface_dst_height(const wo_surface_t * const wos);
@@ -134,8 +156,13 @@ wo_env_t * wo_window_env(const wo_window_t * wowin);
 
 struct wl_display * wo_env_display(const wo_env_t * const woe);
 struct pollqueue * wo_env_pollqueue(const wo_env_t * const woe);
+// Cumulative time the display (pollqueue) thread has spent working and
+// waiting in poll. Load over an interval is busy / (busy + idle) of the deltas
+void wo_env_pollqueue_load(const wo_env_t * const woe, uint64_t * const busy_ns, uint64_t * const idle_ns);
 
 int wo_env_sync(wo_env_t * const woe);
+// Clock used for presentation timestamps (CLOCK_xxx)
+int wo_env_presentation_clock(const wo_env_t * const woe);
 wo_env_t * wo_env_ref(wo_env_t * const woe);
 void wo_env_unref(wo_env_t ** const ppWoe);
 // Unrefs the wo_env and waits for up to a second for everything else to finish